@@ -0,0 +1,254 @@
+// Counts every node traversal tests, so this has to come before the BVH
+// headers.
+#define FR_BVH_COUNT_NODES
+
+#include <cstdlib>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "types/bvh.hpp"
+#include "types/hit_record.hpp"
+#include "types/mesh.hpp"
+#include "types/slim_ray.hpp"
+#include "types/wide_bvh.hpp"
+#include "utils/simd.hpp"
+
+using std::cout;
+using std::endl;
+using std::setw;
+using std::fixed;
+using std::setprecision;
+using std::string;
+using std::vector;
+using std::numeric_limits;
+using glm::vec3;
+using glm::vec4;
+
+using namespace fr;
+
+/// Size of the cube the triangles and ray origins are scattered through.
+#define FR_BENCH_SCENE_SIZE 100.0f
+
+/// Results of tracing every ray through one configuration.
+struct BenchResult {
+    double seconds;
+    uint64_t nodes;
+    uint64_t hits;
+};
+
+/// Returns the monotonic time in seconds.
+static double Now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+/// Returns a point uniformly distributed over the unit sphere.
+static vec3 RandomDirection(std::minstd_rand& generator) {
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    vec3 v;
+    do {
+        v = vec3(uniform(generator), uniform(generator), uniform(generator));
+    } while (glm::dot(v, v) > 1.0f || glm::dot(v, v) < 0.0001f);
+    return glm::normalize(v);
+}
+
+/**
+ * Builds a mesh of num_tris small random triangles scattered through the
+ * scene cube. The same seed always gives the same mesh, so every
+ * configuration traces the same scene.
+ */
+static Mesh* MakeMesh(uint32_t num_tris) {
+    std::minstd_rand generator(1);
+    std::uniform_real_distribution<float> position(0.0f, FR_BENCH_SCENE_SIZE);
+    std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+
+    Mesh* mesh = new Mesh(1, 1);
+    mesh->xform_cols[0] = vec4(1.0f, 0.0f, 0.0f, 0.0f);
+    mesh->xform_cols[1] = vec4(0.0f, 1.0f, 0.0f, 0.0f);
+    mesh->xform_cols[2] = vec4(0.0f, 0.0f, 1.0f, 0.0f);
+    mesh->xform_cols[3] = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    mesh->ComputeMatrices();
+
+    mesh->vertices.reserve(num_tris * 3);
+    mesh->faces.reserve(num_tris);
+    for (uint32_t i = 0; i < num_tris; i++) {
+        vec3 center(position(generator), position(generator), position(generator));
+        vec3 v[3];
+        for (uint32_t j = 0; j < 3; j++) {
+            v[j] = center + vec3(offset(generator), offset(generator), offset(generator));
+        }
+        vec3 n = glm::normalize(glm::cross(v[1] - v[0], v[2] - v[0]));
+
+        uint32_t first = mesh->vertices.size();
+        for (uint32_t j = 0; j < 3; j++) {
+            mesh->vertices.emplace_back(v[j], n);
+        }
+        mesh->faces.emplace_back(first, first + 1, first + 2);
+    }
+
+    return mesh;
+}
+
+/// Builds num_rays rays starting inside the scene cube, headed every which
+/// way.
+static void MakeRays(uint32_t num_rays, vector<SlimRay>* rays) {
+    std::minstd_rand generator(2);
+    std::uniform_real_distribution<float> position(0.0f, FR_BENCH_SCENE_SIZE);
+
+    rays->reserve(num_rays);
+    for (uint32_t i = 0; i < num_rays; i++) {
+        vec3 origin(position(generator), position(generator), position(generator));
+        rays->emplace_back(origin, RandomDirection(generator));
+    }
+}
+
+/**
+ * Times tracing every ray with trace(ray, hit), which returns true if the
+ * ray hit anything, and counts the nodes visited along the way.
+ */
+template <typename Trace>
+static BenchResult Run(const vector<SlimRay>& rays, Trace trace) {
+    BenchResult result;
+    result.hits = 0;
+    bvh_nodes_visited = 0;
+
+    double start = Now();
+    for (const auto& ray : rays) {
+        HitRecord hit(0, 0, numeric_limits<float>::infinity());
+        if (trace(ray, &hit)) result.hits++;
+    }
+    result.seconds = Now() - start;
+    result.nodes = bvh_nodes_visited;
+
+    return result;
+}
+
+static void Report(const string& name, uint64_t bytes, uint32_t num_rays,
+ const BenchResult& result) {
+    cout << std::left << setw(28) << name << std::right << fixed <<
+     setprecision(2) <<
+     setw(9) << bytes / (1024.0 * 1024.0) << " MB" <<
+     setw(10) << num_rays / result.seconds / 1000.0 << "k rays/s" <<
+     setw(9) << result.nodes / result.seconds / 1000000.0 << "M nodes/s" <<
+     setw(8) << static_cast<double>(result.nodes) / num_rays << " nodes/ray" <<
+     setw(9) << result.hits << " hits" << endl;
+}
+
+/**
+ * Traces with the binary BVH the way traversal worked before it was
+ * templated, with the leaf intersector behind a std::function.
+ */
+static void BenchBinaryFunction(uint32_t num_tris, const vector<SlimRay>& rays) {
+    Mesh* mesh = MakeMesh(num_tris);
+    BVH bvh(mesh, 1);
+
+    std::function<bool(uint32_t, const SlimRay&, HitRecord*, bool*)> intersector =
+     [mesh](uint32_t index, const SlimRay& ray, HitRecord* hit, bool* suspend) {
+        uint32_t face;
+        float u, v;
+        return mesh->IntersectFaces(index, 1, ray, ray, &hit->t, &face, &u, &v);
+    };
+
+    BenchResult result = Run(rays, [&bvh, &intersector](const SlimRay& ray, HitRecord* hit) {
+        return bvh.Traverse(ray, hit, intersector).hit != 0;
+    });
+    Report("binary, std::function", bvh.GetSizeInBytes(), rays.size(), result);
+
+    delete mesh;
+}
+
+/// Traces with the binary BVH and the intersector inlined into traversal.
+static void BenchBinary(uint32_t num_tris, uint32_t leaf_size,
+ const vector<SlimRay>& rays) {
+    Mesh* mesh = MakeMesh(num_tris);
+    BVH bvh(mesh, leaf_size);
+
+    BenchResult result = Run(rays, [&bvh, mesh](const SlimRay& ray, HitRecord* hit) {
+        return bvh.Traverse(ray, hit,
+         [mesh](uint32_t index, const SlimRay& tri_ray, HitRecord* tri_hit, bool* suspend) {
+            uint32_t face;
+            float u, v;
+            return mesh->IntersectFaces(index, 1, tri_ray, tri_ray, &tri_hit->t,
+             &face, &u, &v);
+        }).hit != 0;
+    });
+    Report("binary, leaf " + std::to_string(leaf_size), bvh.GetSizeInBytes(),
+     rays.size(), result);
+
+    delete mesh;
+}
+
+/// Traces with a wide BVH the way Library::Intersect does, optionally with
+/// the faces baked into blocks of the same width.
+static void BenchWide(uint32_t num_tris, uint32_t leaf_size, uint32_t width,
+ bool bake, const vector<SlimRay>& rays) {
+    Mesh* mesh = MakeMesh(num_tris);
+    {
+        BVH bvh(mesh, leaf_size);
+        mesh->bvh = new WideBVH(&bvh, width);
+    }
+    if (bake) mesh->Bake(width);
+
+    WideBVH* bvh = mesh->bvh;
+    BenchResult result = Run(rays, [bvh, mesh](const SlimRay& ray, HitRecord* hit) {
+        return bvh->Traverse(ray, hit,
+         [mesh](uint32_t first, uint32_t count, const SlimRay& tri_ray, HitRecord* tri_hit) {
+            uint32_t face;
+            float u, v;
+            return mesh->IntersectFaces(first, count, tri_ray, tri_ray,
+             &tri_hit->t, &face, &u, &v);
+        });
+    });
+    Report(std::to_string(width) + " wide, leaf " + std::to_string(leaf_size) +
+     (bake ? ", baked" : ""), bvh->GetSizeInBytes() + mesh->GetBakedSizeInBytes(),
+     rays.size(), result);
+
+    delete mesh;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t num_tris = 200000;
+    uint32_t num_rays = 600000;
+    if (argc > 1) num_tris = strtoul(argv[1], nullptr, 10);
+    if (argc > 2) num_rays = strtoul(argv[2], nullptr, 10);
+
+    if (num_tris == 0 || num_rays == 0) {
+        cout << "Usage: bvhbench [triangles] [rays]" << endl;
+        return EXIT_FAILURE;
+    }
+
+    vector<SlimRay> rays;
+    MakeRays(num_rays, &rays);
+
+    cout << "Tracing " << num_rays << " closest hit rays through " <<
+     num_tris << " random triangles on one thread." << endl;
+    cout << "Binary nodes are " << sizeof(LinearNode) << " bytes. Every " <<
+     "configuration should report the same number of hits." << endl;
+
+    // Type erased leaf intersector against the templated one.
+    BenchBinaryFunction(num_tris, rays);
+    BenchBinary(num_tris, 1, rays);
+
+    // Fewer, fuller leaves.
+    BenchBinary(num_tris, 4, rays);
+
+    // Wide nodes, then wide nodes over triangles baked into blocks. Only
+    // try 8 wide where AVX can test the children at once.
+    uint32_t max_width = SIMDWidth();
+    for (uint32_t width = 4; width <= max_width; width *= 2) {
+        BenchWide(num_tris, 4, width, false, rays);
+        BenchWide(num_tris, 4, width, true, rays);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -27,6 +27,12 @@ render {
     samples = 10,
     bounces = 3,
     threshold = 0.0001,
+    bake = false, -- bake meshes into world space (faster, more memory)
+    bvh_leaf_size = 4, -- most triangles per BVH leaf (fewer nodes, less memory)
+    max_mesh_faces = 0, -- split bigger meshes across workers (0 = never split)
+    worker_boxes = 8, -- boxes per worker in the worker BVH (tighter, fewer hops)
+    replicate_faces = 16, -- copy meshes this small to every worker (0 = never)
+    shared_memory = true, -- same-host workers talk through shared memory
     min = vec3(-10, -10, -10),
     max = vec3(10, 10, 10),
 }
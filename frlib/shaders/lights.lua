@@ -18,7 +18,7 @@ vec3 = fr.vec3
 function indirect(V, N, T)
     local ambient = emissive(T)
 
-    accumulate3("R", "G", "B", ambient)
+    accumulate3(buffers.R, buffers.G, buffers.B, ambient)
 end
 
 function emissive(T)
@@ -28,6 +28,8 @@ end
     ]]}
 
     return shader {
+        builtin = "light",
+        color = {color.r, color.g, color.b},
         code = code
     }
 end
@@ -1,3 +1,38 @@
+-- Batched version of the phong direct() function below, which the workers call
+-- with every hit on the shader at once. Shared by the shader builders.
+local direct_batch = [[
+
+direct_batch_buffers = {"R", "G", "B"}
+
+local sqrt = math.sqrt
+
+function direct_batch(n, V, N, T, L, I, out)
+    local dr, dg, db = dscale * dcolor[1], dscale * dcolor[2], dscale * dcolor[3]
+
+    for i = 0, n - 1 do
+        local x, y, z = i * 3, i * 3 + 1, i * 3 + 2
+
+        local len = sqrt(N[x] * N[x] + N[y] * N[y] + N[z] * N[z])
+        local Nx, Ny, Nz = N[x] / len, N[y] / len, N[z] / len
+
+        local NdotL = Nx * L[x] + Ny * L[y] + Nz * L[z]
+        if NdotL < 0 then NdotL = 0 end
+
+        local NdotV = 2 * (Nx * V[x] + Ny * V[y] + Nz * V[z])
+        local VdotR = (NdotV * Nx - V[x]) * V[x] +
+                      (NdotV * Ny - V[y]) * V[y] +
+                      (NdotV * Nz - V[z]) * V[z]
+        if VdotR < 0 then VdotR = 0 end
+
+        local specular = sscale * (VdotR ^ spower)
+        out[x] = I[x] * (dr * NdotL + specular)
+        out[y] = I[y] * (dg * NdotL + specular)
+        out[z] = I[z] * (db * NdotL + specular)
+    end
+end
+
+]]
+
 -- Builds a phong shader with diffuse contribution and color dscale and dcolor,
 -- ambient contribution and color ascale and acolor, and specular contribution
 -- and power sscale and spower.
@@ -22,6 +57,8 @@ reflect = fr.reflect
     "local sscale = ", tostring(sscale), "\n",
     "local spower = ", tostring(spower), "\n",
 
+    direct_batch,
+
     [[
 
 function direct(V, N, T, L, I)
@@ -36,18 +73,25 @@ function direct(V, N, T, L, I)
 
     local specular = sscale * I * (VdotR ^ spower)
 
-    accumulate3("R", "G", "B", diffuse + specular)
+    accumulate3(buffers.R, buffers.G, buffers.B, diffuse + specular)
 end
 
 function indirect(V, N, T)
     local ambient = ascale * acolor
 
-    accumulate3("R", "G", "B", ambient)
+    accumulate3(buffers.R, buffers.G, buffers.B, ambient)
 end
 
     ]]}
 
     return shader {
+        builtin = "phong",
+        dscale = dscale,
+        dcolor = {dcolor.r, dcolor.g, dcolor.b},
+        ascale = ascale,
+        acolor = {acolor.r, acolor.g, acolor.b},
+        sscale = sscale,
+        spower = spower,
         code = code
     }
 end
@@ -78,6 +122,8 @@ hemisample = fr.hemisample
     "local sscale = ", tostring(sscale), "\n",
     "local spower = ", tostring(spower), "\n",
 
+    direct_batch,
+
     [[
 
 function direct(V, N, T, L, I)
@@ -93,7 +139,7 @@ function direct(V, N, T, L, I)
     local R = reflect(-V, N)
     local specular = sscale * I * (VdotR ^ spower)
 
-    accumulate3("R", "G", "B", diffuse + specular)
+    accumulate3(buffers.R, buffers.G, buffers.B, diffuse + specular)
 end
 
 function indirect(V, N, T)
@@ -105,6 +151,13 @@ end
     ]]}
 
     return shader {
+        builtin = "montecarlo",
+        dscale = dscale,
+        dcolor = {dcolor.r, dcolor.g, dcolor.b},
+        ascale = ascale,
+        samples = samples,
+        sscale = sscale,
+        spower = spower,
         code = code
     }
 end
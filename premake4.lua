@@ -75,7 +75,8 @@ solution "flexrender"
             "libfr",
             "rt",
             "uv",
-            "msgpack"
+            "msgpack",
+            "pthread"
         }
 
     project "flexworker"
@@ -99,7 +100,8 @@ solution "flexrender"
             "libfr",
             "rt",
             "uv",
-            "msgpack"
+            "msgpack",
+            "pthread"
         }
 
     project "baseline"
@@ -123,5 +125,83 @@ solution "flexrender"
             "libfr",
             "rt",
             "uv",
-            "msgpack"
+            "msgpack",
+            "pthread"
+        }
+
+    project "codectest"
+        kind "ConsoleApp"
+        language "C++"
+        targetdir "bin"
+        targetname "codectest"
+        files {
+            "tests/ray_codec_test.cpp"
+        }
+        includedirs {
+            "src/shared",
+            "3p/build/include",
+        }
+        libdirs {
+            "bin",
+            "3p/build/lib"
+        }
+        links {
+            "libfr",
+            "rt",
+            "uv",
+            "msgpack",
+            "pthread"
+        }
+
+    -- The same checks against the codec built with quantized directions.
+    project "codectest-quantized"
+        kind "ConsoleApp"
+        language "C++"
+        targetdir "bin"
+        targetname "codectest-quantized"
+        defines {
+            "FR_RAY_CODEC_QUANTIZE"
+        }
+        files {
+            "tests/ray_codec_test.cpp",
+            "src/shared/utils/ray_codec.cpp"
+        }
+        includedirs {
+            "src/shared",
+            "3p/build/include",
+        }
+        libdirs {
+            "bin",
+            "3p/build/lib"
+        }
+        links {
+            "libfr",
+            "rt",
+            "uv",
+            "msgpack",
+            "pthread"
+        }
+
+    project "bvhbench"
+        kind "ConsoleApp"
+        language "C++"
+        targetdir "bin"
+        targetname "bvhbench"
+        files {
+            "bench/**.cpp"
+        }
+        includedirs {
+            "src/shared",
+            "3p/build/include",
+        }
+        libdirs {
+            "bin",
+            "3p/build/lib"
+        }
+        links {
+            "libfr",
+            "rt",
+            "uv",
+            "msgpack",
+            "pthread"
         }
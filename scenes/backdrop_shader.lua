@@ -11,5 +11,5 @@ end
 
 function indirect(V, N, T)
     local color = texture3("bg_r", "bg_g", "bg_b", T)
-    accumulate3("R", "G", "B", color)
+    accumulate3(buffers.R, buffers.G, buffers.B, color)
 end
@@ -18,11 +18,11 @@ function direct(V, N, T, L, I)
     local color = texture3("tile_r", "tile_g", "tile_b", T)
     local diffuse = 0.6 * color * I * NdotL
     local specular = 0.2 * I * (VdotR ^ 8)
-    accumulate3("R", "G", "B", diffuse + specular)
+    accumulate3(buffers.R, buffers.G, buffers.B, diffuse + specular)
 end
 
 function indirect(V, N, T)
     local color = texture3("tile_r", "tile_g", "tile_b", T)
     local ambient = 0.2 * color
-    accumulate3("R", "G", "B", ambient)
+    accumulate3(buffers.R, buffers.G, buffers.B, ambient)
 end
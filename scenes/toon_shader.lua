@@ -13,13 +13,13 @@ function direct(V, N, T, L, I)
 
     local LdotN = dot(L, N)
     if LdotN > 0.95 then
-        accumulate3("R", "G", "B", vec3(1, 1, 1))
+        accumulate3(buffers.R, buffers.G, buffers.B, vec3(1, 1, 1))
     elseif LdotN > 0.66 then
-        accumulate3("R", "G", "B", vec3(0.5, 0.2, 0.2))
+        accumulate3(buffers.R, buffers.G, buffers.B, vec3(0.5, 0.2, 0.2))
     elseif LdotN > 0.33 then
-        accumulate3("R", "G", "B", vec3(0.15, 0.05, 0.05))
+        accumulate3(buffers.R, buffers.G, buffers.B, vec3(0.15, 0.05, 0.05))
     else
-        accumulate3("R", "G", "B", vec3(0.05, 0.01, 0.01))
+        accumulate3(buffers.R, buffers.G, buffers.B, vec3(0.05, 0.01, 0.01))
     end
 end
 
@@ -28,5 +28,5 @@ function indirect(V, N, T)
         return
     end
 
-    accumulate3("R", "G", "B", vec3(0.1, 0.05, 0.05))
+    accumulate3(buffers.R, buffers.G, buffers.B, vec3(0.1, 0.05, 0.05))
 end
@@ -135,8 +135,11 @@ void EngineInit(const string& config_file, const string& scene_file,
 
     // Build triangle BVHs for each mesh.
     vector<pair<uint32_t, BoundingBox>> mesh_bounds;
-    lib->ForEachMesh([&mesh_bounds](uint32_t id, Mesh* mesh) {
-        mesh->bvh = new BVH(mesh);
+    uint32_t width = SIMDWidth();
+    lib->ForEachMesh([&mesh_bounds, config, width](uint32_t id, Mesh* mesh) {
+        BVH bvh(mesh, config->bvh_leaf_size);
+        mesh->bvh = new WideBVH(&bvh, width);
+        if (config->bake) mesh->Bake(width);
         mesh_bounds.emplace_back(make_pair(id, mesh->bvh->Extents()));
         cout << "." << flush;
     });
@@ -193,17 +196,15 @@ uint32_t SyncMesh(Mesh* mesh) {
         assert(shader != nullptr);
 
         // Prep the shader if we haven't already.
-        if (shader->script == nullptr) {
-            shader->script = new ShaderScript(shader->code, lib);
-        }
+        shader->Script(lib);
 
         // Prep any procedural textures for execution.
         for (const auto& kv : mat->textures) {
             uint32_t tex_id = kv.second;
             Texture* tex = lib->LookupTexture(tex_id);
             assert(mat != nullptr);
-            if (tex->kind == Texture::Kind::PROCEDURAL && tex->script == nullptr) {
-                tex->script = new TextureScript(tex->code);
+            if (tex->kind == Texture::Kind::PROCEDURAL) {
+                tex->Script();
             }
         }
     }
@@ -235,7 +236,7 @@ void ScheduleJob() {
     // Generate a new primary ray.
     Camera* cam = lib->LookupCamera();
     assert(cam != nullptr);
-    FatRay* ray = new FatRay;
+    FatRay* ray = RayPool::New();
     if (cam->GeneratePrimary(ray)) {
         stats.intersects_produced++;
 
@@ -246,6 +247,7 @@ void ScheduleJob() {
         CheckUVResult(result, "queue_work");
         active_jobs++;
     } else {
+        RayPool::Release(ray);
         if (active_jobs == 0) StopRender();
     }
 }
@@ -378,7 +380,7 @@ void ProcessIntersect(FatRay* ray, WorkResults* results) {
     }
 
     // Kill the ray.
-    delete ray;
+    RayPool::Release(ray);
     results->intersects_killed++;
     return;
 }
@@ -398,7 +400,7 @@ void ProcessLight(FatRay* ray, WorkResults* results) {
     }
 
     // Kill the ray.
-    delete ray;
+    RayPool::Release(ray);
     results->lights_killed++;
     return;
 }
@@ -423,9 +425,8 @@ void IlluminateIntersection(FatRay* ray, WorkResults* results) {
 
     Shader* shader = lib->LookupShader(mat->shader);
     assert(shader != nullptr);
-    assert(shader->script != nullptr);
 
-    shader->script->Indirect(ray, hit, results);
+    shader->Script(lib)->Indirect(ray, hit, results);
 
     // Process traced rays immediately.
     Recurse(results);
@@ -441,7 +442,6 @@ void IlluminateIntersection(FatRay* ray, WorkResults* results) {
 
         Shader* shader = lib->LookupShader(mat->shader);
         assert(shader != nullptr);
-        assert(shader->script != nullptr);
 
         for (const auto& tri : mesh->faces) {
             for (uint16_t i = 0; i < config->samples; i++) {
@@ -463,7 +463,7 @@ void IlluminateIntersection(FatRay* ray, WorkResults* results) {
                 }
 
                 // Create a new light ray that inherits the source <x, y> pixel.
-                FatRay* light = new FatRay(FatRay::Kind::LIGHT, ray->x, ray->y);
+                FatRay* light = RayPool::New(FatRay::Kind::LIGHT, ray->x, ray->y);
                 results->lights_produced++;
 
                 // The origin is at the sample position.
@@ -473,7 +473,7 @@ void IlluminateIntersection(FatRay* ray, WorkResults* results) {
                 light->target = target;
 
                 // Run the shader's emissive() function.
-                light->emission = shader->script->Emissive(texcoord);
+                light->emission = shader->Script(lib)->Emissive(texcoord);
 
                 // Scale the transmittance by the number of samples.
                 light->transmittance = ray->transmittance / config->samples;
@@ -509,9 +509,8 @@ void ShadeIntersection(FatRay* ray, WorkResults* results) {
 
     Shader* shader = lib->LookupShader(mat->shader);
     assert(shader != nullptr);
-    assert(shader->script != nullptr);
 
-    shader->script->Direct(ray, hit, results);
+    shader->Script(lib)->Direct(ray, hit, results);
 
     // Process traced rays immediately.
     Recurse(results);
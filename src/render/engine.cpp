@@ -6,9 +6,9 @@
 #include <vector>
 #include <utility>
 #include <ctime>
-#include <semaphore.h>
-#include <stdio.h>
-#include <errno.h>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 #include "uv.h"
 
@@ -19,12 +19,27 @@
 /// How long to wait for more data before flushing the send buffer.
 #define FR_FLUSH_TIMEOUT_MS 10
 
+/// The maximum number of meshes sent to a single worker but not acknowledged
+/// yet.
+#define FR_SYNC_WINDOW 8
+
+/// The maximum number of bytes of serialized meshes (and their assets) that
+/// may be queued up or in flight before the scene parser has to wait.
+#define FR_SYNC_MAX_BYTES (256 * 1024 * 1024)
+
 using std::string;
 using std::stringstream;
 using std::numeric_limits;
 using std::vector;
 using std::pair;
 using std::make_pair;
+using std::deque;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using std::condition_variable;
+using glm::vec3;
+using glm::vec4;
 
 namespace fr {
 
@@ -63,13 +78,71 @@ static uv_timer_t interesting_timer;
 /// Timer for checking runaway conditions.
 static uv_timer_t runaway_timer;
 
-/// Synchronization primitives for synchronizing the synchronization.
-/// "We need to go deeper..."
-static sem_t mesh_read;
-static sem_t mesh_synced;
+/// A parsed and serialized mesh (and its dependent assets) on its way to a
+/// worker.
+struct MeshSync {
+    /// The worker the mesh belongs to.
+    uint32_t worker;
+
+    /// The messages to send, with malloc'd bodies.
+    vector<Message> messages;
+
+    /// The total size of the message bodies.
+    size_t bytes;
+};
+
+/// What the survey pass over the scene learned about a mesh, for balancing
+/// the scene across the workers.
+struct MeshSurvey {
+    /// The space code of the mesh's centroid.
+    uint64_t spacecode;
+
+    /// The number of faces in the mesh.
+    uint64_t faces;
+
+    /// The size of the mesh's vertices and faces.
+    uint64_t bytes;
+
+    /// The mesh's bounds in world space.
+    BoundingBox bounds;
+
+    /// Whether the mesh goes to every worker.
+    bool replicate;
+};
+
+/// Every mesh in the scene, in parse order. Only touched by the scene parser.
+static vector<MeshSurvey> survey;
+
+/// Guards the sync queue, byte count, and done flag between the scene parser
+/// and the loop.
+static mutex sync_lock;
+
+/// Signaled when acknowledged meshes free up room in the byte budget.
+static condition_variable sync_space;
+
+/// Meshes the scene parser has produced that the loop hasn't picked up yet.
+static deque<MeshSync*> sync_queue;
+
+/// The number of bytes of meshes queued up or in flight.
+static size_t sync_bytes = 0;
+
+/// Whether the scene parser is done producing meshes. Only set on the loop,
+/// once the parser's work request has completed.
+static bool sync_done = false;
 
-/// The ID of the mesh we're currently syncing over the network.
-static uint32_t current_mesh_id = 0;
+/// Wakes up the loop when the scene parser produces a mesh.
+static uv_async_t sync_async;
+
+/// Meshes waiting for room in each worker's window, indexed by worker. Only
+/// touched on the loop.
+static vector<deque<MeshSync*>> sync_pending;
+
+/// The sizes of meshes sent to each worker but not acknowledged yet, in send
+/// order, indexed by worker. Only touched on the loop.
+static vector<deque<size_t>> sync_window;
+
+/// The ID to hand out to the next mesh. Only touched by the scene parser.
+static uint32_t next_mesh_id = 0;
 
 /// The scene file we're rendering.
 static string scene;
@@ -91,7 +164,10 @@ namespace client {
 void Init();
 void DispatchMessage(NetNode* node);
 void StartSync();
+uint32_t SurveyMesh(Mesh* mesh);
 uint32_t SyncMesh(Mesh* mesh);
+uint32_t QueueMesh(Mesh* mesh);
+void PartitionScene();
 void BuildWBVH();
 void StartRender();
 void StopRender();
@@ -105,7 +181,9 @@ void OnInterestingTimeout(uv_timer_t* timer, int status);
 void OnRunawayTimeout(uv_timer_t* timer, int status);
 void OnSyncStart(uv_work_t* req);
 void AfterSync(uv_work_t* req, int status);
-void OnSyncIdle(uv_idle_t* handle, int status);
+void OnSyncAsync(uv_async_t* handle, int status);
+void PumpSync(uint32_t worker);
+void FinishSync();
 
 void OnOK(NetNode* node);
 void OnSyncImage(NetNode* node);
@@ -129,6 +207,17 @@ void EngineInit(const string& config_file, const string& scene_file,
     }
     TOUTLN("Config loaded.");
 
+    // Rays can only skip the boxes of workers they remember visiting, so past
+    // that, extra boxes just test the same geometry again.
+    Config* config = lib->LookupConfig();
+    if (config->worker_boxes > 1 &&
+        config->workers.size() > FR_MAX_VISITED_WORKERS) {
+        TERRLN("Warning: only the first " << FR_MAX_VISITED_WORKERS <<
+         " workers are visited once per ray with render.worker_boxes > 1. " <<
+         "Rays may test workers " << FR_MAX_VISITED_WORKERS + 1 << " to " <<
+         config->workers.size() << " once per box.");
+    }
+
     scene = scene_file;
 
     client::Init();
@@ -396,11 +485,20 @@ void client::OnOK(NetNode* node) {
             break;
 
         case NetNode::State::SYNCING_ASSETS:
-            // Delete the current mesh from the library.
-            lib->StoreMesh(current_mesh_id, nullptr);
-            if (sem_post(&mesh_synced) < 0) {
-                perror("sem_post");
-                exit(EXIT_FAILURE);
+            {
+                // The oldest mesh in flight to this worker made it. Give its
+                // bytes back to the scene parser.
+                deque<size_t>& window = sync_window[node->me];
+                assert(!window.empty());
+                {
+                    lock_guard<mutex> guard(sync_lock);
+                    sync_bytes -= window.front();
+                }
+                sync_space.notify_one();
+                window.pop_front();
+
+                PumpSync(node->me);
+                FinishSync();
             }
             break;
 
@@ -421,11 +519,16 @@ void client::OnOK(NetNode* node) {
 
         case NetNode::State::BUILDING_BVH:
             {
-                assert(node->message.size == sizeof(BoundingBox));
-                BoundingBox bounds = *(reinterpret_cast<BoundingBox*>(node->message.body));
-                worker_bounds.emplace_back(make_pair(node->me, bounds));
+                // Each worker's bounds come as one or more boxes, which all
+                // become leaves of the worker BVH.
+                assert(node->message.size % sizeof(BoundingBox) == 0);
+                size_t num_boxes = node->message.size / sizeof(BoundingBox);
+                BoundingBox* boxes = reinterpret_cast<BoundingBox*>(node->message.body);
+                for (size_t i = 0; i < num_boxes; i++) {
+                    worker_bounds.emplace_back(make_pair(node->me, boxes[i]));
+                }
 
-                TOUTLN("[" << node->ip << "] Local BVH ready.");
+                TOUTLN("[" << node->ip << "] Local BVH ready (" << num_boxes << " boxes).");
                 num_workers_built++;
 
                 if (use_linear_scan) {
@@ -526,9 +629,6 @@ void client::OnSyncImage(NetNode* node) {
 void client::StartSync() {
     int result = 0;
 
-    // Build the spatial index.
-    lib->BuildSpatialIndex();
-
     Config* config = lib->LookupConfig();
     assert(config != nullptr);
 
@@ -539,27 +639,17 @@ void client::StartSync() {
     }
     lib->StoreImage(image);
 
-    // Initialize the semaphores for ping-ponging between threads.
-    if (sem_init(&mesh_read, 0, 0) < 0) {
-        perror("sem_init");
-        exit(EXIT_FAILURE);
-    }
-    if (sem_init(&mesh_synced, 0, 1) < 0) {
-        perror("sem_init");
-        exit(EXIT_FAILURE);
-    }
+    // Set up the pipeline between the scene parser and the network.
+    sync_pending.resize(config->workers.size() + 1);
+    sync_window.resize(config->workers.size() + 1);
+    next_mesh_id = lib->NextMeshID();
+    result = uv_async_init(uv_default_loop(), &sync_async, OnSyncAsync);
+    CheckUVResult(result, "async_init");
 
     // Queue up the scene parsing to happen on the thread pool.
     uv_work_t* req = reinterpret_cast<uv_work_t*>(malloc(sizeof(uv_work_t)));
     result = uv_queue_work(uv_default_loop(), req, OnSyncStart, AfterSync);
     CheckUVResult(result, "queue_work");
-
-    // Start up the idle callback for handling networking.
-    uv_idle_t* idler = reinterpret_cast<uv_idle_t*>(malloc(sizeof(uv_idle_t)));
-    result = uv_idle_init(uv_default_loop(), idler);
-    CheckUVResult(result, "idle_init");
-    result = uv_idle_start(idler, OnSyncIdle);
-    CheckUVResult(result, "idle_start");
 }
 
 void client::BuildWBVH() {
@@ -653,6 +743,9 @@ void client::OnSyncStart(uv_work_t* req) {
 
     assert(req != nullptr);
 
+    // Divide the scene up between the workers.
+    PartitionScene();
+
     // Parse and distribute the scene.
     SceneScript scene_script(SyncMesh);
     TOUTLN("Loading scene from " << scene << ".");
@@ -661,14 +754,140 @@ void client::OnSyncStart(uv_work_t* req) {
         exit(EXIT_FAILURE);
     }
 
-    // Signal that we're finished.
-    SyncMesh(nullptr);
     TOUTLN("Scene distributed.");
 }
 
 void client::AfterSync(uv_work_t* req, int status) {
     assert(req != nullptr);
     free(req);
+
+    // The scene parser is done, so nothing can send on the async handle
+    // anymore and it's safe for FinishSync() to close it. Pick up whatever
+    // it queued last, since that wakeup may not have landed yet.
+    {
+        lock_guard<mutex> guard(sync_lock);
+        sync_done = true;
+    }
+    OnSyncAsync(&sync_async, 0);
+}
+
+void client::PartitionScene() {
+    // !!! WARNING !!!
+    // Everything this function does and calls must be thread-safe. This
+    // function will NOT run in the main thread, it runs on the thread pool.
+
+    Config* config = lib->LookupConfig();
+    assert(config != nullptr);
+
+    // Survey the meshes with a throwaway parse, so we know how the scene is
+    // laid out before anything is sent. The survey library gets its own
+    // copy of the config so the shaders, textures, and materials it creates
+    // don't end up in ours.
+    {
+        Library survey_lib;
+        survey_lib.StoreConfig(new Config(*config));
+
+        SceneScript survey_script(SurveyMesh);
+        TOUTLN("Surveying scene from " << scene << ".");
+        if (!survey_script.Parse(scene, &survey_lib)) {
+            TERRLN("Can't continue with bad scene.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Balance the memory each worker needs along the space code order, which
+    // keeps each worker's meshes close together. Replicated meshes cost every
+    // worker the same, so they don't count.
+    vector<pair<uint64_t, uint64_t>> costs;
+    costs.reserve(survey.size());
+    for (const auto& mesh : survey) {
+        if (mesh.replicate) continue;
+        costs.emplace_back(mesh.spacecode, mesh.bytes);
+    }
+    lib->BuildSpatialIndex(costs);
+
+    // Report the load each worker ends up with.
+    uint32_t num_workers = config->workers.size();
+    vector<uint64_t> meshes(num_workers + 1, 0);
+    vector<uint64_t> faces(num_workers + 1, 0);
+    vector<uint64_t> bytes(num_workers + 1, 0);
+    vector<BoundingBox> bounds(num_workers + 1);
+    uint64_t total_bytes = 0;
+    uint64_t replicated_meshes = 0;
+    uint64_t replicated_bytes = 0;
+    for (const auto& mesh : survey) {
+        if (mesh.replicate) {
+            replicated_meshes++;
+            replicated_bytes += mesh.bytes;
+            continue;
+        }
+        uint32_t worker = lib->LookupNetNodeBySpaceCode(mesh.spacecode);
+        meshes[worker]++;
+        faces[worker] += mesh.faces;
+        bytes[worker] += mesh.bytes;
+        bounds[worker] = bounds[worker].Union(mesh.bounds);
+        total_bytes += mesh.bytes;
+    }
+
+    uint64_t max_bytes = 0;
+    for (uint32_t worker = 1; worker <= num_workers; worker++) {
+        NetNode* node = lib->LookupNetNode(worker);
+        float area = bounds[worker].IsValid() ? bounds[worker].SurfaceArea() : 0.0f;
+        TOUTLN("[" << node->ip << "] Assigned " << meshes[worker] << " meshes, " << faces[worker] << "f, " << (bytes[worker] / (1024.0f * 1024.0f)) << " MB, bounds area " << area << ".");
+        max_bytes = std::max(max_bytes, bytes[worker]);
+    }
+    if (total_bytes > 0) {
+        float imbalance = max_bytes * num_workers / static_cast<float>(total_bytes);
+        TOUTLN("Scene partitioned, the largest worker has " << imbalance << "x the average load.");
+    }
+    if (replicated_meshes > 0) {
+        TOUTLN("Replicating " << replicated_meshes << " meshes, " << (replicated_bytes / (1024.0f * 1024.0f)) << " MB to every worker.");
+    }
+
+    survey.clear();
+    survey.shrink_to_fit();
+}
+
+uint32_t client::SurveyMesh(Mesh* mesh) {
+    // !!! WARNING !!!
+    // Everything this function does and calls must be thread-safe. This
+    // function will NOT run in the main thread, it runs on the thread pool.
+
+    Config* config = lib->LookupConfig();
+    assert(config != nullptr);
+
+    // Survey the pieces the sync will actually send, making the same
+    // replication and splitting decisions.
+    if (config->replicate_faces > 0 && mesh->faces.size() <= config->replicate_faces) {
+        mesh->replicate = true;
+    }
+
+    vector<Mesh*> pieces;
+    if (config->max_mesh_faces > 0 && mesh->faces.size() > config->max_mesh_faces &&
+        !mesh->replicate) {
+        mesh->Split(config->max_mesh_faces, &pieces);
+        delete mesh;
+    } else {
+        pieces.push_back(mesh);
+    }
+
+    for (auto piece : pieces) {
+        MeshSurvey entry;
+        entry.spacecode = SpaceEncode(piece->centroid, config->min, config->max);
+        entry.replicate = piece->replicate;
+        entry.faces = piece->faces.size();
+        entry.bytes = piece->vertices.size() * sizeof(Vertex) +
+         piece->faces.size() * sizeof(Triangle);
+        for (const auto& vertex : piece->vertices) {
+            entry.bounds.Absorb(vec3(piece->xform * vec4(vertex.v, 1.0f)));
+        }
+        survey.push_back(entry);
+
+        delete piece;
+    }
+
+    // Nothing looks at the IDs handed out during the survey.
+    return survey.size();
 }
 
 uint32_t client::SyncMesh(Mesh* mesh) {
@@ -676,79 +895,154 @@ uint32_t client::SyncMesh(Mesh* mesh) {
     // Everything this function does and calls must be thread-safe. This
     // function will NOT run in the main thread, it runs on the thread pool.
 
-    // Wait for the main thread to be finished with the network.
-    if (sem_wait(&mesh_synced) < 0) {
-        perror("sem_wait");
-        exit(EXIT_FAILURE);
+    Config* config = lib->LookupConfig();
+    assert(config != nullptr);
+
+    // Small meshes are cheap to copy to everyone, and save rays a hop.
+    if (config->replicate_faces > 0 && mesh->faces.size() <= config->replicate_faces) {
+        mesh->replicate = true;
     }
 
-    uint32_t id = 0;
-    if (mesh != nullptr) {
-        // Store the mesh in the library and get back its ID.
-        id = lib->NextMeshID();
-        mesh->id = id;
-        lib->StoreMesh(id, mesh);
+    // Meshes over the face budget go out in pieces, so they can be spread
+    // over several workers. The scene gets the ID of the first piece.
+    // Replicated meshes end up whole on every worker anyway.
+    if (config->max_mesh_faces > 0 && mesh->faces.size() > config->max_mesh_faces &&
+        !mesh->replicate) {
+        vector<Mesh*> pieces;
+        mesh->Split(config->max_mesh_faces, &pieces);
+        TOUTLN("Splitting " << mesh->faces.size() << "f mesh into " << pieces.size() << " pieces.");
+        delete mesh;
+
+        uint32_t id = 0;
+        for (auto piece : pieces) {
+            uint32_t piece_id = QueueMesh(piece);
+            if (id == 0) id = piece_id;
+        }
+        return id;
     }
 
-    // Tell the main thread which mesh we'd like to sync over the network.
-    current_mesh_id = id;
+    return QueueMesh(mesh);
+}
 
-    // Wake up the main thread to do the networking.
-    if (sem_post(&mesh_read) < 0) {
-        perror("sem_post");
-        exit(EXIT_FAILURE);
+uint32_t client::QueueMesh(Mesh* mesh) {
+    // !!! WARNING !!!
+    // Everything this function does and calls must be thread-safe. This
+    // function will NOT run in the main thread, it runs on the thread pool.
+
+    // Hand out the next mesh ID ourselves, since meshes never go in the
+    // renderer's library.
+    uint32_t id = next_mesh_id++;
+    mesh->id = id;
+
+    Config* config = lib->LookupConfig();
+    assert(config != nullptr);
+
+    // Figure out which workers the mesh belongs to. Replicated meshes go to
+    // everyone.
+    uint32_t first = 1;
+    uint32_t last = config->workers.size();
+    if (!mesh->replicate) {
+        uint64_t spacecode = SpaceEncode(mesh->centroid, config->min, config->max);
+        first = last = lib->LookupNetNodeBySpaceCode(spacecode);
     }
 
+    for (uint32_t worker = first; worker <= last; worker++) {
+        NetNode* node = lib->LookupNetNode(worker);
+
+        // Serialize it here, so the loop only has to write it out. Only this
+        // thread packs assets during the sync, so the node's record of which
+        // assets it has stays consistent.
+        MeshSync* sync = new MeshSync;
+        sync->worker = worker;
+        node->PackMesh(lib, mesh, &sync->messages);
+        sync->bytes = 0;
+        for (const auto& msg : sync->messages) {
+            sync->bytes += msg.size;
+        }
+
+        TOUTLN("[" << node->ip << "] Queueing " << (mesh->replicate ? "replicated " : "") << "mesh " << id << " for worker " << worker << ".");
+
+        // Wait for room in the byte budget, then queue it up for the loop.
+        {
+            unique_lock<mutex> guard(sync_lock);
+            sync_space.wait(guard, []() {
+                return sync_bytes < FR_SYNC_MAX_BYTES;
+            });
+            sync_bytes += sync->bytes;
+            sync_queue.push_back(sync);
+        }
+        uv_async_send(&sync_async);
+    }
+
+    // We don't need it anymore.
+    delete mesh;
+
     return id;
 }
 
-void client::OnSyncIdle(uv_idle_t* handle, int status) {
-    assert(handle != nullptr);
+void client::OnSyncAsync(uv_async_t* handle, int status) {
+    assert(handle == &sync_async);
     assert(status == 0);
 
-    int result = 0;
+    // Pick up everything the scene parser has produced.
+    deque<MeshSync*> produced;
+    {
+        lock_guard<mutex> guard(sync_lock);
+        produced.swap(sync_queue);
+    }
 
-    // Are we done reading in a new mesh?
-    if (sem_trywait(&mesh_read) < 0) {
-        if (errno == EAGAIN) {
-            // Nope.
-            return;
-        }
-        perror("sem_trywait");
-        exit(EXIT_FAILURE);
+    for (auto sync : produced) {
+        sync_pending[sync->worker].push_back(sync);
     }
 
-    // Are we done syncing assets?
-    if (current_mesh_id == 0) {
-        // Shut off the idle handler.
-        result = uv_idle_stop(handle);
-        CheckUVResult(result, "idle_stop");
-        uv_close(reinterpret_cast<uv_handle_t*>(handle), nullptr);
+    // Send as much as the workers' windows allow.
+    for (uint32_t worker = 1; worker < sync_pending.size(); worker++) {
+        PumpSync(worker);
+    }
+
+    FinishSync();
+}
 
-        // Sync the camera with everyone.
-        lib->ForEachNetNode([](uint32_t id, NetNode* node) {
-            node->state = NetNode::State::SYNCING_CAMERA;
-            TOUTLN("[" << node->ip << "] Syncing camera.");
-            node->SendCamera(lib);
-        });
+void client::PumpSync(uint32_t worker) {
+    deque<MeshSync*>& pending = sync_pending[worker];
+    deque<size_t>& window = sync_window[worker];
+    NetNode* node = lib->LookupNetNode(worker);
 
-        build_start = time(nullptr);
+    while (!pending.empty() && window.size() < FR_SYNC_WINDOW) {
+        MeshSync* sync = pending.front();
+        pending.pop_front();
 
-        return;
+        node->SendAllOwned(sync->messages);
+        window.push_back(sync->bytes);
+
+        delete sync;
     }
+}
 
-    Mesh* mesh = lib->LookupMesh(current_mesh_id);
-    assert(mesh != nullptr);
-    Config* config = lib->LookupConfig();
-    assert(config != nullptr);
+void client::FinishSync() {
+    // Is the scene parser done, and has everything been acknowledged?
+    {
+        lock_guard<mutex> guard(sync_lock);
+        if (!sync_done || !sync_queue.empty()) return;
+    }
+    for (uint32_t worker = 1; worker < sync_pending.size(); worker++) {
+        if (!sync_pending[worker].empty() || !sync_window[worker].empty()) {
+            return;
+        }
+    }
 
-    uint64_t spacecode = SpaceEncode(mesh->centroid, config->min, config->max);
-    uint32_t id = lib->LookupNetNodeBySpaceCode(spacecode);
-    NetNode* node = lib->LookupNetNode(id);
+    // Only finish once.
+    if (uv_is_closing(reinterpret_cast<uv_handle_t*>(&sync_async))) return;
+    uv_close(reinterpret_cast<uv_handle_t*>(&sync_async), nullptr);
 
-    TOUTLN("[" << node->ip << "] Sending mesh " << current_mesh_id << " to worker " << id << ".");
+    // Sync the camera with everyone.
+    lib->ForEachNetNode([](uint32_t id, NetNode* node) {
+        node->state = NetNode::State::SYNCING_CAMERA;
+        TOUTLN("[" << node->ip << "] Syncing camera.");
+        node->SendCamera(lib);
+    });
 
-    node->SendMesh(lib, current_mesh_id);
+    build_start = time(nullptr);
 }
 
 } // namespace fr
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "scripting/script.hpp"
+#include "scripting/builtin_shader.hpp"
 #include "scripting/config_script.hpp"
 #include "scripting/scene_script.hpp"
 #include "scripting/shader_script.hpp"
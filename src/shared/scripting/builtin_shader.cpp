@@ -0,0 +1,303 @@
+#include "scripting/builtin_shader.hpp"
+
+#include <cstdlib>
+#include <cassert>
+#include <cmath>
+#include <ctime>
+
+#include "types.hpp"
+#include "utils.hpp"
+
+using std::string;
+using glm::vec2;
+using glm::vec3;
+using glm::normalize;
+using glm::cross;
+using glm::dot;
+using glm::reflect;
+
+namespace fr {
+
+BuiltinShader::BuiltinShader(const Library* lib) :
+ _lib(lib),
+ _r(Image::NO_BUFFER),
+ _g(Image::NO_BUFFER),
+ _b(Image::NO_BUFFER),
+ _resolved(false) {}
+
+void BuiltinShader::Direct(const FatRay* ray, vec3 hit, WorkResults* results) {
+    // Nothing by default.
+}
+
+void BuiltinShader::Indirect(const FatRay* ray, vec3 hit, WorkResults* results) {
+    // Nothing by default.
+}
+
+vec3 BuiltinShader::Emissive(vec2 texcoord) {
+    return vec3(0.0f, 0.0f, 0.0f);
+}
+
+vec3 BuiltinShader::View(vec3 hit) {
+    Camera* cam = _lib->LookupCamera();
+    return normalize(cam->eye - hit);
+}
+
+void BuiltinShader::Accumulate3(const FatRay* ray, vec3 color,
+ WorkResults* results) {
+    // The image doesn't exist yet when shaders are created, so look the
+    // buffers up the first time we need them.
+    if (!_resolved) {
+        Image* image = _lib->LookupImage();
+        assert(image != nullptr);
+
+        _r = image->LookupBuffer("R");
+        _g = image->LookupBuffer("G");
+        _b = image->LookupBuffer("B");
+        if (_r == Image::NO_BUFFER || _g == Image::NO_BUFFER ||
+            _b == Image::NO_BUFFER) {
+            TERRLN("Built-in shaders require R, G, and B buffers!");
+            exit(EXIT_FAILURE);
+        }
+        _resolved = true;
+    }
+
+    results->ops.emplace_back(BufferOp::Kind::ACCUMULATE, _r,
+     ray->x, ray->y, color.x * ray->transmittance);
+    results->ops.emplace_back(BufferOp::Kind::ACCUMULATE, _g,
+     ray->x, ray->y, color.y * ray->transmittance);
+    results->ops.emplace_back(BufferOp::Kind::ACCUMULATE, _b,
+     ray->x, ray->y, color.z * ray->transmittance);
+}
+
+/// Phong direct lighting shared by the phong and montecarlo shaders, matching
+/// direct() in frlib/shaders/phong.lua.
+static vec3 PhongDirect(const FatRay* ray, vec3 view, float dscale,
+ vec3 dcolor, float sscale, float spower) {
+    vec3 normal = ray->hit.geom.n;
+    vec3 light = -ray->slim.direction;
+    vec3 illumination = ray->emission;
+
+    float n_dot_l = dot(normal, light);
+    if (n_dot_l < 0.0f) n_dot_l = 0.0f;
+
+    vec3 r = reflect(-view, normalize(normal));
+    float v_dot_r = dot(r, view);
+    if (v_dot_r < 0.0f) v_dot_r = 0.0f;
+
+    vec3 diffuse = dscale * dcolor * illumination * n_dot_l;
+    vec3 specular = sscale * illumination * powf(v_dot_r, spower);
+
+    return diffuse + specular;
+}
+
+/// The calling thread's sampling generator state, or 0 until it's seeded.
+static __thread uint32_t random_state = 0;
+
+/// Returns a uniform random number in [0, 1), like math.random(). Each thread
+/// has its own generator, seeded differently by its thread slot, so compute
+/// threads never contend on shared state.
+static float Random() {
+    if (random_state == 0) {
+        uint32_t seed = static_cast<uint32_t>(time(nullptr)) *
+         FR_MAX_THREAD_SLOTS + ThreadSlot();
+        random_state = seed % 2147483646 + 1;
+    }
+
+    // Park and Miller's minimal standard generator (as in std::minstd_rand),
+    // which keeps the state in [1, 2^31 - 2].
+    random_state = static_cast<uint32_t>(
+     static_cast<uint64_t>(random_state) * 48271 % 2147483647);
+
+    // Keep the top 24 bits, which is all a float can hold.
+    return ((random_state - 1) >> 7) / 16777216.0f;
+}
+
+/// Cosine weighted sample of the hemisphere above the normal, matching
+/// hemisample() in frlib/base/sample.lua.
+static vec3 HemiSample(vec3 normal) {
+    // Sample a unit disc and project up onto the hemisphere (Malley's method).
+    float x = 2.0f * Random() - 1.0f;
+    float limit = sqrtf(1.0f - x * x);
+    float y = (2.0f * Random() - 1.0f) * limit;
+    float z = sqrtf(fmaxf(0.0f, 1.0f - x * x - y * y));
+
+    // Build an orthonormal basis from the surface normal, avoiding an axis
+    // that's nearly colinear with it.
+    vec3 w = normal;
+    vec3 t(1.0f, 0.0f, 0.0f);
+    if (fabsf(dot(t, w)) > 0.9f) {
+        t = vec3(0.0f, 1.0f, 0.0f);
+    }
+    vec3 u = normalize(cross(t, w));
+    vec3 v = normalize(cross(w, u));
+
+    // Transform our direction vector into the basis.
+    return normalize(x * u + y * v + z * w);
+}
+
+/// frlib's phong(dscale, dcolor, ascale, acolor, sscale, spower).
+class PhongShader : public BuiltinShader {
+public:
+    explicit PhongShader(const float* params, const Library* lib) :
+     BuiltinShader(lib),
+     _dscale(params[0]),
+     _dcolor(params[1], params[2], params[3]),
+     _ascale(params[4]),
+     _acolor(params[5], params[6], params[7]),
+     _sscale(params[8]),
+     _spower(params[9]) {}
+
+    virtual void Direct(const FatRay* ray, vec3 hit, WorkResults* results) {
+        Accumulate3(ray, PhongDirect(ray, View(hit), _dscale, _dcolor,
+         _sscale, _spower), results);
+    }
+
+    virtual void Indirect(const FatRay* ray, vec3 hit, WorkResults* results) {
+        Accumulate3(ray, _ascale * _acolor, results);
+    }
+
+private:
+    float _dscale;
+    vec3 _dcolor;
+    float _ascale;
+    vec3 _acolor;
+    float _sscale;
+    float _spower;
+};
+
+/// frlib's montecarlo(dscale, dcolor, ascale, samples, sscale, spower).
+class MonteCarloShader : public BuiltinShader {
+public:
+    explicit MonteCarloShader(const float* params, const Library* lib) :
+     BuiltinShader(lib),
+     _dscale(params[0]),
+     _dcolor(params[1], params[2], params[3]),
+     _ascale(params[4]),
+     _samples(static_cast<int>(params[5])),
+     _sscale(params[6]),
+     _spower(params[7]) {}
+
+    virtual void Direct(const FatRay* ray, vec3 hit, WorkResults* results) {
+        Accumulate3(ray, PhongDirect(ray, View(hit), _dscale, _dcolor,
+         _sscale, _spower), results);
+    }
+
+    virtual void Indirect(const FatRay* ray, vec3 hit, WorkResults* results) {
+        vec3 normal = ray->hit.geom.n;
+        for (int i = 0; i < _samples; i++) {
+            TraceRay(_lib, ray, hit, HemiSample(normal), 1.0f / _samples,
+             results);
+        }
+    }
+
+private:
+    float _dscale;
+    vec3 _dcolor;
+    float _ascale;
+    int _samples;
+    float _sscale;
+    float _spower;
+};
+
+/// frlib's light(color).
+class LightShader : public BuiltinShader {
+public:
+    explicit LightShader(const float* params, const Library* lib) :
+     BuiltinShader(lib),
+     _color(params[0], params[1], params[2]) {}
+
+    virtual void Indirect(const FatRay* ray, vec3 hit, WorkResults* results) {
+        Accumulate3(ray, _color, results);
+    }
+
+    virtual vec3 Emissive(vec2 texcoord) {
+        return _color;
+    }
+
+private:
+    vec3 _color;
+};
+
+template <typename T>
+static BuiltinShader* CreateBuiltin(const float* params, const Library* lib) {
+    return new T(params, lib);
+}
+
+static const BuiltinParam PHONG_PARAMS[] = {
+    {"dscale", 1},
+    {"dcolor", 3},
+    {"ascale", 1},
+    {"acolor", 3},
+    {"sscale", 1},
+    {"spower", 1}
+};
+
+static const BuiltinParam MONTECARLO_PARAMS[] = {
+    {"dscale", 1},
+    {"dcolor", 3},
+    {"ascale", 1},
+    {"samples", 1},
+    {"sscale", 1},
+    {"spower", 1}
+};
+
+static const BuiltinParam LIGHT_PARAMS[] = {
+    {"color", 3}
+};
+
+/// Every built-in shader we know about.
+static const BuiltinInfo BUILTINS[] = {
+    {"phong", PHONG_PARAMS, 6, CreateBuiltin<PhongShader>},
+    {"montecarlo", MONTECARLO_PARAMS, 6, CreateBuiltin<MonteCarloShader>},
+    {"light", LIGHT_PARAMS, 1, CreateBuiltin<LightShader>}
+};
+
+const BuiltinInfo* LookupBuiltinShader(const string& name) {
+    for (const auto& info : BUILTINS) {
+        if (name == info.name) return &info;
+    }
+    return nullptr;
+}
+
+uint32_t BuiltinParamSize(const BuiltinInfo* info) {
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < info->num_params; i++) {
+        size += info->params[i].width;
+    }
+    return size;
+}
+
+void TraceRay(const Library* lib, const FatRay* ray, vec3 hit,
+ vec3 direction, float partial, WorkResults* results) {
+    int16_t bounce = ray->bounces + 1;
+    float transmittance = ray->transmittance * partial;
+
+    Config* config = lib->LookupConfig();
+
+    // Bounce limit and transmittance threshold rejection checks.
+    if (bounce > config->bounce_limit ||
+        transmittance < config->transmittance_threshold) {
+        return;
+    }
+
+    // Create a new tracer ray that inherits many of its properties from the
+    // source ray.
+    FatRay* tracer = RayPool::New(FatRay::Kind::INTERSECT, ray->x, ray->y);
+
+    // The origin is at the intersection point, plus some epsilon along the
+    // new direction to ensure no self intersection.
+    tracer->slim.origin = hit + direction * SELF_INTERSECT_EPSILON;
+    tracer->slim.direction = direction;
+
+    // Set the bounce number and transmittance.
+    tracer->bounces = bounce;
+    tracer->transmittance = transmittance;
+
+    // It hasn't hit anything yet.
+    tracer->hit.worker = 0;
+
+    results->forwards.emplace_back(tracer, nullptr);
+    results->intersects_produced++;
+}
+
+} // namespace fr
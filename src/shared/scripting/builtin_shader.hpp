@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "glm/glm.hpp"
+
+#include "utils/uncopyable.hpp"
+
+namespace fr {
+
+class Library;
+struct FatRay;
+struct WorkResults;
+
+/**
+ * Native implementation of one of the stock frlib shaders. These produce the
+ * same output as the Lua versions, parameter-for-parameter, without ever
+ * entering an interpreter.
+ */
+class BuiltinShader : private Uncopyable {
+public:
+    explicit BuiltinShader(const Library* lib);
+
+    virtual ~BuiltinShader() {}
+
+    /// Native equivalent of a shader's direct() function.
+    virtual void Direct(const FatRay* ray, glm::vec3 hit, WorkResults* results);
+
+    /// Native equivalent of a shader's indirect() function.
+    virtual void Indirect(const FatRay* ray, glm::vec3 hit, WorkResults* results);
+
+    /// Native equivalent of a shader's emissive() function.
+    virtual glm::vec3 Emissive(glm::vec2 texcoord);
+
+protected:
+    /// Returns the (unit) vector from the hit point toward the camera.
+    glm::vec3 View(glm::vec3 hit);
+
+    /// Accumulates the color into the R, G, and B buffers at the ray's pixel.
+    void Accumulate3(const FatRay* ray, glm::vec3 color, WorkResults* results);
+
+    const Library* _lib;
+
+private:
+    uint16_t _r;
+    uint16_t _g;
+    uint16_t _b;
+    bool _resolved;
+};
+
+/// A parameter a built-in shader takes from the scene file.
+struct BuiltinParam {
+    /// The field name in the shader table.
+    const char* name;
+
+    /// The number of floats it takes up (1 for numbers, 3 for colors).
+    uint32_t width;
+};
+
+/// Describes a built-in shader and how to instantiate it.
+struct BuiltinInfo {
+    /// The name used to select it in the scene file.
+    const char* name;
+
+    /// The parameters it takes, in the order they're packed.
+    const BuiltinParam* params;
+
+    /// How many parameters there are.
+    uint32_t num_params;
+
+    /// Creates an instance from the packed parameters.
+    BuiltinShader* (*create)(const float* params, const Library* lib);
+};
+
+/**
+ * Returns the built-in shader with the given name, or nullptr if there isn't
+ * one.
+ */
+const BuiltinInfo* LookupBuiltinShader(const std::string& name);
+
+/// Returns the number of floats the built-in's packed parameters take up.
+uint32_t BuiltinParamSize(const BuiltinInfo* info);
+
+/**
+ * Spawns an intersect ray from the hit point in the given direction, as the
+ * shader trace() function does. The new ray's transmittance is the source
+ * ray's scaled by partial. Nothing is traced if the bounce limit or
+ * transmittance threshold would be exceeded.
+ */
+void TraceRay(const Library* lib, const FatRay* ray, glm::vec3 hit,
+ glm::vec3 direction, float partial, WorkResults* results);
+
+} // namespace fr
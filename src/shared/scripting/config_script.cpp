@@ -1,8 +1,10 @@
 #include "scripting/config_script.hpp"
 
 #include <cstdint>
+#include <string>
 
 #include "types/config.hpp"
+#include "types/linear_node.hpp"
 #include "utils/library.hpp"
 #include "utils/tout.hpp"
 
@@ -12,6 +14,7 @@ using glm::vec3;
 namespace fr {
 
 using std::string;
+using std::to_string;
 
 ConfigScript::ConfigScript() :
  Script(),
@@ -122,6 +125,59 @@ FR_SCRIPT_FUNCTION(ConfigScript, Render) {
     }
     PopField();
 
+    // "bake" is an optional boolean
+    if (PushField("bake", LUA_TBOOLEAN)) {
+        _config->bake = FetchBool();
+    }
+    PopField();
+
+    // "bvh_leaf_size" is an optional uint32
+    if (PushField("bvh_leaf_size", LUA_TNUMBER)) {
+        float leaf_size = FetchFloat();
+        if (leaf_size < 1.0f || leaf_size > FR_MAX_BVH_LEAF_SIZE) {
+            ScriptError("render.bvh_leaf_size must be between 1 and " +
+             to_string(FR_MAX_BVH_LEAF_SIZE));
+        }
+        _config->bvh_leaf_size = static_cast<uint32_t>(leaf_size);
+    }
+    PopField();
+
+    // "max_mesh_faces" is an optional uint32
+    if (PushField("max_mesh_faces", LUA_TNUMBER)) {
+        float max_faces = FetchFloat();
+        if (max_faces < 0.0f) {
+            ScriptError("render.max_mesh_faces must not be negative");
+        }
+        _config->max_mesh_faces = static_cast<uint32_t>(max_faces);
+    }
+    PopField();
+
+    // "worker_boxes" is an optional uint32
+    if (PushField("worker_boxes", LUA_TNUMBER)) {
+        float boxes = FetchFloat();
+        if (boxes < 1.0f) {
+            ScriptError("render.worker_boxes must be at least 1");
+        }
+        _config->worker_boxes = static_cast<uint32_t>(boxes);
+    }
+    PopField();
+
+    // "replicate_faces" is an optional uint32
+    if (PushField("replicate_faces", LUA_TNUMBER)) {
+        float replicate_faces = FetchFloat();
+        if (replicate_faces < 0.0f) {
+            ScriptError("render.replicate_faces must not be negative");
+        }
+        _config->replicate_faces = static_cast<uint32_t>(replicate_faces);
+    }
+    PopField();
+
+    // "shared_memory" is an optional boolean
+    if (PushField("shared_memory", LUA_TBOOLEAN)) {
+        _config->shared_memory = FetchBool();
+    }
+    PopField();
+
     // "min" is a required float3
     if (!PushField("min", LUA_TTABLE)) {
         ScriptError("render.min is required");
@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <limits>
 
+#include "scripting/builtin_shader.hpp"
 #include "types.hpp"
 #include "utils.hpp"
 
@@ -155,13 +156,54 @@ FR_SCRIPT_FUNCTION(SceneScript, Shader) {
     uint32_t id = _lib->NextShaderID();
     Shader *shader = new Shader(id);
 
-    // "shader.code" is a required string.
-    if (!PushField("code", LUA_TSTRING)) {
-        ScriptError("shader.code is required");
+    // "shader.builtin" is an optional string naming a native shader.
+    const BuiltinInfo* info = nullptr;
+    if (PushField("builtin", LUA_TSTRING)) {
+        string builtin = FetchString();
+        info = LookupBuiltinShader(builtin);
+        if (info != nullptr) {
+            shader->builtin = builtin;
+        } else {
+            TOUTLN("Unknown built-in shader '" << builtin << "', falling back to shader.code.");
+        }
     }
-    shader->code = FetchString();
     PopField();
 
+    if (info != nullptr) {
+        // Built-in parameters are named fields in the shader table.
+        for (uint32_t i = 0; i < info->num_params; i++) {
+            const BuiltinParam& param = info->params[i];
+            if (param.width == 1) {
+                if (!PushField(param.name, LUA_TNUMBER)) {
+                    ScriptError(string("shader.") + param.name + " is required");
+                }
+                shader->params.push_back(FetchFloat());
+            } else {
+                if (!PushField(param.name, LUA_TTABLE)) {
+                    ScriptError(string("shader.") + param.name + " is required");
+                }
+                vec3 value = FetchFloat3();
+                shader->params.push_back(value.x);
+                shader->params.push_back(value.y);
+                shader->params.push_back(value.z);
+            }
+            PopField();
+        }
+
+        // "shader.code" is optional, but kept around if it's there.
+        if (PushField("code", LUA_TSTRING)) {
+            shader->code = FetchString();
+        }
+        PopField();
+    } else {
+        // "shader.code" is a required string.
+        if (!PushField("code", LUA_TSTRING)) {
+            ScriptError("shader.code is required");
+        }
+        shader->code = FetchString();
+        PopField();
+    }
+
     _lib->StoreShader(id, shader);
 
     EndTableCall();
@@ -246,6 +288,12 @@ FR_SCRIPT_FUNCTION(SceneScript, Mesh) {
     }
     PopField();
 
+    // "mesh.replicate" is an optional boolean
+    if (PushField("replicate", LUA_TBOOLEAN)) {
+        mesh->replicate = FetchBool();
+    }
+    PopField();
+
     // "mesh.data" is a required function
     if (!PushField("data", LUA_TFUNCTION)) {
         ScriptError("mesh.data is required");
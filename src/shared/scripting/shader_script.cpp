@@ -3,9 +3,9 @@
 #include <cstdlib>
 #include <cassert>
 #include <limits>
-#include <stdio.h>
-#include <errno.h>
+#include <cstring>
 
+#include "scripting/builtin_shader.hpp"
 #include "scripting/texture_script.hpp"
 #include "types.hpp"
 #include "utils.hpp"
@@ -17,23 +17,63 @@ using glm::vec3;
 using glm::vec4;
 using glm::normalize;
 
+/// Wraps the shader's direct_batch() so it sees the raw arrays we pass in as
+/// typed FFI pointers rather than light userdata.
+static const char* DIRECT_BATCH_TRAMPOLINE = R"(
+    local cast = require("ffi").cast
+    local direct_batch = direct_batch
+    function __fr_direct_batch(n, V, N, T, L, I, out)
+        direct_batch(n, cast("float*", V), cast("float*", N),
+         cast("float*", T), cast("float*", L), cast("float*", I),
+         cast("float*", out))
+    end
+)";
+
 namespace fr {
 
-ShaderScript::ShaderScript(const string& code, const Library* lib) :
+ShaderScript::ShaderScript(const Shader* shader, const Library* lib) :
  Script(),
  _lib(lib),
+ _builtin(nullptr),
  _ray(nullptr),
+ _buffer_table(LUA_NOREF),
  _results(nullptr),
  _has_direct(false),
  _has_indirect(false),
  _has_emissive(false),
+ _has_direct_batch(false),
+ _in_batch(false),
  _has_vec2(false),
  _has_vec3(false),
- _has_vec4(false) {
+ _has_vec4(false),
+ _batch_names(),
+ _batch_buffers(),
+ _batch_view(),
+ _batch_normal(),
+ _batch_texcoord(),
+ _batch_light(),
+ _batch_illumination(),
+ _batch_out() {
      _hit.x = numeric_limits<float>::quiet_NaN();
      _hit.y = numeric_limits<float>::quiet_NaN();
      _hit.z = numeric_limits<float>::quiet_NaN();
 
+    // Built-in shaders run natively and never need an interpreter.
+    if (!shader->builtin.empty()) {
+        const BuiltinInfo* info = LookupBuiltinShader(shader->builtin);
+        if (info == nullptr) {
+            TERRLN("Unknown built-in shader '" << shader->builtin << "'!");
+            exit(EXIT_FAILURE);
+        }
+        if (shader->params.size() != BuiltinParamSize(info)) {
+            TERRLN("Wrong number of parameters for built-in shader '" <<
+             shader->builtin << "'!");
+            exit(EXIT_FAILURE);
+        }
+        _builtin = info->create(&shader->params[0], lib);
+        return;
+    }
+
     // TODO: Shader scripts shouldn't have access to the whole standard
     // library...
     FR_SCRIPT_INIT(ShaderScript, ScriptLibs::STANDARD_LIBS);
@@ -53,8 +93,12 @@ ShaderScript::ShaderScript(const string& code, const Library* lib) :
     FR_SCRIPT_REGISTER("texture4", ShaderScript, Texture4);
     FR_SCRIPT_REGISTER("trace", ShaderScript, Trace);
 
+    // Buffer IDs have to be there before the shader runs, so it can capture
+    // them at load time.
+    PublishBuffers();
+
     // Evaluate the shader.
-    if (luaL_dostring(_state, code.c_str())) {
+    if (luaL_dostring(_state, shader->code.c_str())) {
         TERRLN(lua_tostring(_state, -1));
         exit(EXIT_FAILURE);
     }
@@ -72,6 +116,30 @@ ShaderScript::ShaderScript(const string& code, const Library* lib) :
     _has_emissive = lua_isfunction(_state, -1) != 0;
     lua_pop(_state, 1);
 
+    lua_getglobal(_state, "direct_batch");
+    _has_direct_batch = lua_isfunction(_state, -1) != 0;
+    lua_pop(_state, 1);
+
+    // A batched shader has to tell us which buffers its outputs go to.
+    if (_has_direct_batch) {
+        lua_getglobal(_state, "direct_batch_buffers");
+        if (!lua_istable(_state, -1)) {
+            TERRLN("Shader defines direct_batch but not direct_batch_buffers!");
+            exit(EXIT_FAILURE);
+        }
+        ForEachIndex([this](size_t index) {
+            PushIndex(index, LUA_TSTRING);
+            _batch_names.push_back(FetchString());
+            PopIndex();
+        });
+        lua_pop(_state, 1);
+
+        if (luaL_dostring(_state, DIRECT_BATCH_TRAMPOLINE)) {
+            TERRLN(lua_tostring(_state, -1));
+            exit(EXIT_FAILURE);
+        }
+    }
+
     // Do they have global aliases for vector types? If so, we can set
     // vector metatables appropriately when we push arguments onto the stack.
     lua_getglobal(_state, "vec2");
@@ -85,16 +153,23 @@ ShaderScript::ShaderScript(const string& code, const Library* lib) :
     lua_getglobal(_state, "vec4");
     _has_vec4 = lua_istable(_state, -1) != 0;
     lua_pop(_state, 1);
+}
 
-    // Initialize lock.
-    if (sem_init(&_lock, 0, 1) < 0) {
-        perror("sem_init");
-        exit(EXIT_FAILURE);
-    }
+ShaderScript::~ShaderScript() {
+    if (_builtin != nullptr) delete _builtin;
 }
 
 void ShaderScript::Direct(const FatRay* ray, vec3 hit, WorkResults *results) {
-    if (!_has_direct) return;
+    if (_builtin != nullptr) {
+        _builtin->Direct(ray, hit, results);
+        return;
+    }
+
+    if (!_has_direct) {
+        // Batched shaders still work one ray at a time.
+        if (_has_direct_batch) DirectBatch(&ray, 1, results);
+        return;
+    }
 
     Camera* cam = _lib->LookupCamera();
 
@@ -105,12 +180,6 @@ void ShaderScript::Direct(const FatRay* ray, vec3 hit, WorkResults *results) {
     vec3 light = -ray->slim.direction;
     vec3 illumination = ray->emission;
 
-    // Acquire the interpreter lock.
-    if (sem_wait(&_lock) < 0) {
-        perror("sem_wait");
-        exit(EXIT_FAILURE);
-    }
-
     // Set the current data we're operating on.
     _ray = ray;
     _hit = hit;
@@ -145,15 +214,81 @@ void ShaderScript::Direct(const FatRay* ray, vec3 hit, WorkResults *results) {
     // Call the function.
     CallFunc(5, 0);
     // No need to pop, 0 return values.
+}
 
-    // Release the interpreter lock.
-    if (sem_post(&_lock) < 0) {
-        perror("sem_post");
-        exit(EXIT_FAILURE);
+void ShaderScript::DirectBatch(const FatRay* const* rays, size_t count,
+ WorkResults* results) {
+    if (!_has_direct_batch || count == 0) return;
+
+    if (_batch_buffers.size() != _batch_names.size()) {
+        ResolveBatchBuffers();
+    }
+
+    Camera* cam = _lib->LookupCamera();
+    size_t outputs = _batch_buffers.size();
+
+    // Grow the scratch arrays if this is the biggest batch so far.
+    if (_batch_view.size() < count * 3) {
+        _batch_view.resize(count * 3);
+        _batch_normal.resize(count * 3);
+        _batch_texcoord.resize(count * 2);
+        _batch_light.resize(count * 3);
+        _batch_illumination.resize(count * 3);
+    }
+    _batch_out.assign(count * outputs, 0.0f);
+
+    // Lay out the same vectors direct() would get, one after another.
+    for (size_t i = 0; i < count; i++) {
+        const FatRay* ray = rays[i];
+        vec3 hit = ray->target;
+        vec3 view = normalize(cam->eye - hit);
+        vec3 light = -ray->slim.direction;
+
+        memcpy(&_batch_view[i * 3], &view, sizeof(float) * 3);
+        memcpy(&_batch_normal[i * 3], &ray->hit.geom.n, sizeof(float) * 3);
+        memcpy(&_batch_texcoord[i * 2], &ray->hit.geom.t, sizeof(float) * 2);
+        memcpy(&_batch_light[i * 3], &light, sizeof(float) * 3);
+        memcpy(&_batch_illumination[i * 3], &ray->emission, sizeof(float) * 3);
+    }
+
+    // Every ray in the batch shares a material, so texture() can look up its
+    // bindings through any of them. Built-ins that act on a single ray's
+    // pixel are rejected while the batch runs.
+    _ray = rays[0];
+    _hit = rays[0]->target;
+    _results = results;
+    _in_batch = true;
+
+    // Call the function through the trampoline.
+    lua_getglobal(_state, "__fr_direct_batch");
+    lua_pushinteger(_state, count);
+    lua_pushlightuserdata(_state, &_batch_view[0]);
+    lua_pushlightuserdata(_state, &_batch_normal[0]);
+    lua_pushlightuserdata(_state, &_batch_texcoord[0]);
+    lua_pushlightuserdata(_state, &_batch_light[0]);
+    lua_pushlightuserdata(_state, &_batch_illumination[0]);
+    lua_pushlightuserdata(_state, outputs > 0 ? &_batch_out[0] : nullptr);
+    CallFunc(7, 0);
+    _in_batch = false;
+
+    // Accumulate whatever the shader wrote, skipping untouched outputs.
+    for (size_t i = 0; i < count; i++) {
+        const FatRay* ray = rays[i];
+        for (size_t j = 0; j < outputs; j++) {
+            float value = _batch_out[i * outputs + j];
+            if (value == 0.0f) continue;
+            results->ops.emplace_back(BufferOp::Kind::ACCUMULATE,
+             _batch_buffers[j], ray->x, ray->y, value * ray->transmittance);
+        }
     }
 }
 
 void ShaderScript::Indirect(const FatRay* ray, vec3 hit, WorkResults* results) {
+    if (_builtin != nullptr) {
+        _builtin->Indirect(ray, hit, results);
+        return;
+    }
+
     if (!_has_indirect) return;
 
     Camera* cam = _lib->LookupCamera();
@@ -163,12 +298,6 @@ void ShaderScript::Indirect(const FatRay* ray, vec3 hit, WorkResults* results) {
     vec3 normal = ray->hit.geom.n;
     vec2 texcoord = ray->hit.geom.t;
 
-    // Acquire the interpreter lock.
-    if (sem_wait(&_lock) < 0) {
-        perror("sem_wait");
-        exit(EXIT_FAILURE);
-    }
-
     // Set the current data we're operating on.
     _ray = ray;
     _hit = hit;
@@ -197,22 +326,12 @@ void ShaderScript::Indirect(const FatRay* ray, vec3 hit, WorkResults* results) {
     // Call the function.
     CallFunc(3, 0);
     // No need to pop, 0 return values.
-
-    // Release the interpreter lock.
-    if (sem_post(&_lock) < 0) {
-        perror("sem_post");
-        exit(EXIT_FAILURE);
-    }
 }
 
 vec3 ShaderScript::Emissive(vec2 texcoord) {
-    if (!_has_emissive) return vec3(0.0f, 0.0f, 0.0f);
+    if (_builtin != nullptr) return _builtin->Emissive(texcoord);
 
-    // Acquire the interpreter lock.
-    if (sem_wait(&_lock) < 0) {
-        perror("sem_wait");
-        exit(EXIT_FAILURE);
-    }
+    if (!_has_emissive) return vec3(0.0f, 0.0f, 0.0f);
 
     // Locate the function.
     lua_getglobal(_state, "emissive");
@@ -232,17 +351,80 @@ vec3 ShaderScript::Emissive(vec2 texcoord) {
     vec3 value = FetchFloat3();
     lua_pop(_state, 1);
 
-    // Release the interpreter lock.
-    if (sem_post(&_lock) < 0) {
-        perror("sem_post");
+    return value;
+}
+
+void ShaderScript::CheckPerRay(const char* name) {
+    if (_in_batch) {
+        ScriptError(string(name) + "() can't be called from direct_batch, "
+         "write to its outputs instead");
+    }
+}
+
+uint16_t ShaderScript::CheckBuffer(int index) {
+    Image* image = _lib->LookupImage();
+    assert(image != nullptr);
+
+    // Buffers can be referred to by ID directly...
+    if (lua_type(_state, index) == LUA_TNUMBER) {
+        lua_Integer id = lua_tointeger(_state, index);
+        if (id < 0 || id >= image->NumBuffers()) {
+            luaL_error(_state, "buffer %d does not exist", static_cast<int>(id));
+        }
+        return id;
+    }
+
+    // ...or by name, through the buffers table. Lua strings are interned,
+    // so this is a hash lookup rather than a string compare per buffer.
+    const char* name = luaL_checkstring(_state, index);
+    lua_rawgeti(_state, LUA_REGISTRYINDEX, _buffer_table);
+    lua_pushvalue(_state, index);
+    lua_rawget(_state, -2);
+    if (!lua_isnumber(_state, -1)) {
+        luaL_error(_state, "buffer '%s' does not exist", name);
+    }
+    uint16_t id = static_cast<uint16_t>(lua_tointeger(_state, -1));
+    lua_pop(_state, 2);
+    return id;
+}
+
+void ShaderScript::PublishBuffers() {
+    Image* image = _lib->LookupImage();
+    if (image == nullptr) {
+        TERRLN("Shaders can't be loaded before the image exists!");
         exit(EXIT_FAILURE);
     }
 
-    return value;
+    lua_createtable(_state, 0, image->NumBuffers());
+    for (uint16_t id = 0; id < image->NumBuffers(); id++) {
+        lua_pushinteger(_state, id);
+        lua_setfield(_state, -2, image->BufferName(id).c_str());
+    }
+
+    // Keep one reference for ourselves and give the other to the script.
+    lua_pushvalue(_state, -1);
+    _buffer_table = luaL_ref(_state, LUA_REGISTRYINDEX);
+    lua_setglobal(_state, "buffers");
+}
+
+void ShaderScript::ResolveBatchBuffers() {
+    Image* image = _lib->LookupImage();
+    assert(image != nullptr);
+
+    _batch_buffers.clear();
+    for (const auto& name : _batch_names) {
+        uint16_t id = image->LookupBuffer(name.c_str());
+        if (id == Image::NO_BUFFER) {
+            TERRLN("Buffer '" << name << "' in direct_batch_buffers does not exist!");
+            exit(EXIT_FAILURE);
+        }
+        _batch_buffers.push_back(id);
+    }
 }
 
 FR_SCRIPT_FUNCTION(ShaderScript, Accumulate) {
-    string buffer(luaL_checkstring(_state, 1));
+    CheckPerRay("accumulate");
+    uint16_t buffer = CheckBuffer(1);
     float value = static_cast<float>(luaL_checknumber(_state, 2));
 
     _results->ops.emplace_back(BufferOp::Kind::ACCUMULATE, buffer,
@@ -252,8 +434,9 @@ FR_SCRIPT_FUNCTION(ShaderScript, Accumulate) {
 }
 
 FR_SCRIPT_FUNCTION(ShaderScript, Accumulate2) {
-    string buffer1(luaL_checkstring(_state, 1));
-    string buffer2(luaL_checkstring(_state, 2));
+    CheckPerRay("accumulate2");
+    uint16_t buffer1 = CheckBuffer(1);
+    uint16_t buffer2 = CheckBuffer(2);
 
     luaL_checktype(_state, 3, LUA_TTABLE);
     lua_pushvalue(_state, 3);
@@ -269,9 +452,10 @@ FR_SCRIPT_FUNCTION(ShaderScript, Accumulate2) {
 }
 
 FR_SCRIPT_FUNCTION(ShaderScript, Accumulate3) {
-    string buffer1(luaL_checkstring(_state, 1));
-    string buffer2(luaL_checkstring(_state, 2));
-    string buffer3(luaL_checkstring(_state, 3));
+    CheckPerRay("accumulate3");
+    uint16_t buffer1 = CheckBuffer(1);
+    uint16_t buffer2 = CheckBuffer(2);
+    uint16_t buffer3 = CheckBuffer(3);
 
     luaL_checktype(_state, 4, LUA_TTABLE);
     lua_pushvalue(_state, 4);
@@ -289,10 +473,11 @@ FR_SCRIPT_FUNCTION(ShaderScript, Accumulate3) {
 }
 
 FR_SCRIPT_FUNCTION(ShaderScript, Accumulate4) {
-    string buffer1(luaL_checkstring(_state, 1));
-    string buffer2(luaL_checkstring(_state, 2));
-    string buffer3(luaL_checkstring(_state, 3));
-    string buffer4(luaL_checkstring(_state, 4));
+    CheckPerRay("accumulate4");
+    uint16_t buffer1 = CheckBuffer(1);
+    uint16_t buffer2 = CheckBuffer(2);
+    uint16_t buffer3 = CheckBuffer(3);
+    uint16_t buffer4 = CheckBuffer(4);
 
     luaL_checktype(_state, 5, LUA_TTABLE);
     lua_pushvalue(_state, 5);
@@ -312,7 +497,8 @@ FR_SCRIPT_FUNCTION(ShaderScript, Accumulate4) {
 }
 
 FR_SCRIPT_FUNCTION(ShaderScript, Write) {
-    string buffer(luaL_checkstring(_state, 1));
+    CheckPerRay("write");
+    uint16_t buffer = CheckBuffer(1);
     float value = static_cast<float>(luaL_checknumber(_state, 2));
 
     _results->ops.emplace_back(BufferOp::Kind::WRITE, buffer,
@@ -322,8 +508,9 @@ FR_SCRIPT_FUNCTION(ShaderScript, Write) {
 }
 
 FR_SCRIPT_FUNCTION(ShaderScript, Write2) {
-    string buffer1(luaL_checkstring(_state, 1));
-    string buffer2(luaL_checkstring(_state, 2));
+    CheckPerRay("write2");
+    uint16_t buffer1 = CheckBuffer(1);
+    uint16_t buffer2 = CheckBuffer(2);
 
     luaL_checktype(_state, 3, LUA_TTABLE);
     lua_pushvalue(_state, 3);
@@ -339,9 +526,10 @@ FR_SCRIPT_FUNCTION(ShaderScript, Write2) {
 }
 
 FR_SCRIPT_FUNCTION(ShaderScript, Write3) {
-    string buffer1(luaL_checkstring(_state, 1));
-    string buffer2(luaL_checkstring(_state, 2));
-    string buffer3(luaL_checkstring(_state, 3));
+    CheckPerRay("write3");
+    uint16_t buffer1 = CheckBuffer(1);
+    uint16_t buffer2 = CheckBuffer(2);
+    uint16_t buffer3 = CheckBuffer(3);
 
     luaL_checktype(_state, 4, LUA_TTABLE);
     lua_pushvalue(_state, 4);
@@ -359,10 +547,11 @@ FR_SCRIPT_FUNCTION(ShaderScript, Write3) {
 }
 
 FR_SCRIPT_FUNCTION(ShaderScript, Write4) {
-    string buffer1(luaL_checkstring(_state, 1));
-    string buffer2(luaL_checkstring(_state, 2));
-    string buffer3(luaL_checkstring(_state, 3));
-    string buffer4(luaL_checkstring(_state, 4));
+    CheckPerRay("write4");
+    uint16_t buffer1 = CheckBuffer(1);
+    uint16_t buffer2 = CheckBuffer(2);
+    uint16_t buffer3 = CheckBuffer(3);
+    uint16_t buffer4 = CheckBuffer(4);
 
     luaL_checktype(_state, 5, LUA_TTABLE);
     lua_pushvalue(_state, 5);
@@ -577,6 +766,7 @@ FR_SCRIPT_FUNCTION(ShaderScript, Texture4) {
 }
 
 FR_SCRIPT_FUNCTION(ShaderScript, Trace) {
+    CheckPerRay("trace");
     luaL_checktype(_state, 1, LUA_TTABLE);
     lua_pushvalue(_state, 1);
     vec3 direction = FetchFloat3();
@@ -584,35 +774,7 @@ FR_SCRIPT_FUNCTION(ShaderScript, Trace) {
 
     float partial = luaL_checknumber(_state, 2);
 
-    int16_t bounce = _ray->bounces + 1;
-    float transmittance = _ray->transmittance * partial;
-
-    Config* config = _lib->LookupConfig();
-
-    // Bounce limit and transmittance threshold rejection checks.
-    if (bounce > config->bounce_limit ||
-        transmittance < config->transmittance_threshold) {
-        return 0;
-    }
-
-    // Create a new tracer ray that inherits many of its properties from the
-    // source ray.
-    FatRay* tracer = new FatRay(FatRay::Kind::INTERSECT, _ray->x, _ray->y);
-
-    // The origin is at the intersection point, plus some epsilon along the
-    // new direction to ensure no self intersection.
-    tracer->slim.origin = _hit + direction * SELF_INTERSECT_EPSILON;
-    tracer->slim.direction = direction;
-
-    // Set the bounce number and transmittance.
-    tracer->bounces = bounce;
-    tracer->transmittance = transmittance;
-
-    // It hasn't hit anything yet.
-    tracer->hit.worker = 0;
-
-    _results->forwards.emplace_back(tracer, nullptr);
-    _results->intersects_produced++;
+    TraceRay(_lib, _ray, _hit, direction, partial, _results);
 
     return 0;
 }
@@ -1,7 +1,8 @@
 #pragma once
 
-#include <semaphore.h>
+#include <cstdint>
 #include <string>
+#include <vector>
 
 #include "glm/glm.hpp"
 
@@ -10,12 +11,18 @@
 namespace fr {
 
 class Library;
+class BuiltinShader;
 struct FatRay;
+struct Shader;
 struct WorkResults;
 
 class ShaderScript : public Script {
 public:
-    explicit ShaderScript(const std::string& code, const Library *lib);
+    /// Interprets the shader's code, or instantiates its native
+    /// implementation if it names a built-in shader.
+    explicit ShaderScript(const Shader* shader, const Library *lib);
+
+    ~ShaderScript();
 
     /**
      * Runs the direct lighting function of the shader (if it exists) with the
@@ -24,6 +31,21 @@ public:
      */
     void Direct(const FatRay* ray, glm::vec3 hit, WorkResults* results);
 
+    /// Does the shader define a batched direct lighting function?
+    inline bool HasDirectBatch() const { return _has_direct_batch; }
+
+    /**
+     * Runs the batched direct lighting function of the shader over count
+     * light rays that all hit geometry with the same material, in a single
+     * call into the interpreter. The shader's direct_batch(n, V, N, T, L, I,
+     * out) receives LuaJIT FFI float arrays (0-indexed, 3 floats per hit, 2
+     * for T) and writes one float per hit for each buffer named in the global
+     * direct_batch_buffers table into out, which are then accumulated. It may
+     * call texture(), but not the built-ins that act on a single ray.
+     */
+    void DirectBatch(const FatRay* const* rays, size_t count,
+     WorkResults* results);
+
     /**
      * Runs the indirect lighting function of the shader (if it exists) with
      * the given arguments, potentially appending buffer writes to the work
@@ -53,17 +75,50 @@ public:
     FR_SCRIPT_DECLARE(Trace);
 
 private:
+    /// Raises a script error if the named built-in, which acts on the current
+    /// ray, is called from direct_batch().
+    void CheckPerRay(const char* name);
+
+    /// Resolves the buffer argument at the given stack index to a buffer ID.
+    /// Accepts either a buffer name or a buffer ID.
+    uint16_t CheckBuffer(int index);
+
+    /// Resolves the names in direct_batch_buffers to buffer IDs, which can't
+    /// be done until the image exists.
+    void ResolveBatchBuffers();
+
+    /// Publishes the image's buffer IDs to the script as a global buffers
+    /// table mapping each name to its ID.
+    void PublishBuffers();
+
     const Library* _lib;
+    BuiltinShader* _builtin;
     const FatRay* _ray;
     glm::vec3 _hit;
+
+    /// Registry reference to the buffers table, for resolving names.
+    int _buffer_table;
     WorkResults* _results;
     bool _has_direct;
     bool _has_indirect;
     bool _has_emissive;
+    bool _has_direct_batch;
+
+    /// True while direct_batch() runs, when there's no single current ray.
+    bool _in_batch;
     bool _has_vec2;
     bool _has_vec3;
     bool _has_vec4;
-    sem_t _lock;
+
+    // Scratch arrays for batched shading, reused across calls.
+    std::vector<std::string> _batch_names;
+    std::vector<uint16_t> _batch_buffers;
+    std::vector<float> _batch_view;
+    std::vector<float> _batch_normal;
+    std::vector<float> _batch_texcoord;
+    std::vector<float> _batch_light;
+    std::vector<float> _batch_illumination;
+    std::vector<float> _batch_out;
 };
 
 } // namespace fr
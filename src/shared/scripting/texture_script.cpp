@@ -1,8 +1,6 @@
 #include "scripting/texture_script.hpp"
 
 #include <cstdlib>
-#include <stdio.h>
-#include <errno.h>
 
 #include "types.hpp"
 #include "utils.hpp"
@@ -39,21 +37,9 @@ TextureScript::TextureScript(const string& code) :
     lua_getglobal(_state, "vec2");
     _has_vec2 = lua_istable(_state, -1) != 0;
     lua_pop(_state, 1);
-
-    // Initialize lock.
-    if (sem_init(&_lock, 0, 1) < 0) {
-        perror("sem_init");
-        exit(EXIT_FAILURE);
-    }
 }
 
 float TextureScript::Evaluate(vec2 texcoord) {
-    // Acquire the interpreter lock.
-    if (sem_wait(&_lock) < 0) {
-        perror("sem_wait");
-        exit(EXIT_FAILURE);
-    }
-
     // Locate the function.
     lua_getglobal(_state, "texture");
 
@@ -72,12 +58,6 @@ float TextureScript::Evaluate(vec2 texcoord) {
     float value = FetchFloat();
     lua_pop(_state, 1);
 
-    // Release the interpreter lock.
-    if (sem_post(&_lock) < 0) {
-        perror("sem_post");
-        exit(EXIT_FAILURE);
-    }
-
     return value;
 }
 
@@ -1,6 +1,5 @@
 #pragma once
 
-#include <semaphore.h>
 
 #include "glm/glm.hpp"
 
@@ -16,7 +15,6 @@ public:
 
 private:
     bool _has_vec2;
-    sem_t _lock;
 };
 
 } // namespace fr
@@ -24,5 +24,7 @@
 #include "types/traversal_state.hpp"
 #include "types/traversal_stats.hpp"
 #include "types/triangle.hpp"
+#include "types/triangle_block.hpp"
 #include "types/vertex.hpp"
+#include "types/wide_bvh.hpp"
 #include "types/work_results.hpp"
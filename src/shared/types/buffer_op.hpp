@@ -1,17 +1,16 @@
 #pragma once
 
 #include <cstdint>
-#include <string>
 
 namespace fr {
 
 struct BufferOp {
-    enum class Kind {
+    enum class Kind : uint16_t {
         WRITE,
         ACCUMULATE
     };
 
-    explicit BufferOp(Kind kind, const std::string& buffer, int16_t x, int16_t y,
+    explicit BufferOp(Kind kind, uint16_t buffer, int16_t x, int16_t y,
      float value) :
      kind(kind),
      buffer(buffer),
@@ -22,8 +21,8 @@ struct BufferOp {
     /// The kind of buffer operation we're doing.
     Kind kind;
 
-    /// The buffer we're writing into.
-    std::string buffer;
+    /// The ID of the buffer we're writing into (from Image::LookupBuffer()).
+    uint16_t buffer;
 
     /// The x coordinate of the pixel.
     int16_t x;
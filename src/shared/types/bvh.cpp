@@ -15,7 +15,6 @@ using std::pair;
 using std::nth_element;
 using std::partition;
 using std::numeric_limits;
-using std::function;
 using std::string;
 using std::stringstream;
 using std::endl;
@@ -23,10 +22,21 @@ using glm::vec3;
 
 namespace fr {
 
+uint64_t bvh_nodes_visited = 0;
+
 const uint32_t BVH::NUM_BUCKETS = 12;
+const float BVH::TRAVERSAL_COST = 1.0f;
 
-BVH::BVH(const Mesh* mesh) :
+BVH::BVH(Mesh* mesh, uint32_t max_leaf_size) :
  _nodes() {
+    assert(max_leaf_size > 0 && max_leaf_size <= FR_MAX_BVH_LEAF_SIZE);
+    assert(!mesh->IsBaked());
+
+    if (mesh->faces.size() > LinearNode::MAX_INDEX) {
+        TERRLN("Mesh " << mesh->id << " has too many faces for a BVH!");
+        exit(EXIT_FAILURE);
+    }
+
     // Initialize build data from mesh triangles.
     vector<PrimitiveInfo> build_data;
     build_data.reserve(mesh->faces.size());
@@ -36,7 +46,28 @@ BVH::BVH(const Mesh* mesh) :
     }
 
     // Actually build the tree.
-    Build(build_data);
+    vector<uint32_t> ordered;
+    Build(build_data, max_leaf_size, &ordered);
+    assert(ordered.size() == mesh->faces.size());
+
+    // Reorder the faces to match the leaves, so the leaves can index them
+    // directly and neighboring triangles are close in memory. This follows
+    // each cycle of the permutation in place rather than copying the faces,
+    // marking finished slots in ordered as it goes.
+    for (size_t i = 0; i < ordered.size(); i++) {
+        if (ordered[i] == i) continue;
+
+        Triangle temp = mesh->faces[i];
+        size_t j = i;
+        while (ordered[j] != i) {
+            size_t k = ordered[j];
+            mesh->faces[j] = mesh->faces[k];
+            ordered[j] = j;
+            j = k;
+        }
+        mesh->faces[j] = temp;
+        ordered[j] = j;
+    }
 }
 
 BVH::BVH(const vector<pair<uint32_t, BoundingBox>>& things) :
@@ -63,7 +94,15 @@ BVH::BVH(const vector<pair<uint32_t, BoundingBox>>& things) :
             OneThing(build_data[0].index, build_data[0].bounds);
         } else {
             // Actually build the tree.
-            Build(build_data);
+            vector<uint32_t> ordered;
+            Build(build_data, 1, &ordered);
+
+            // Things aren't reordered, so point the leaves back at their IDs.
+            for (auto& node : _nodes) {
+                if (node.IsLeaf()) {
+                    node.SetLeaf(node.Parent(), ordered[node.Index()], node.Count());
+                }
+            }
         }
     }
 }
@@ -71,124 +110,56 @@ BVH::BVH(const vector<pair<uint32_t, BoundingBox>>& things) :
 BVH::BVH() :
  _nodes() {}
 
-TraversalState BVH::Traverse(const SlimRay& ray, HitRecord* nearest,
- function<bool (uint32_t index, const SlimRay& ray, HitRecord* hit, bool* request_suspend)> intersector) {
-    // Initialize fresh state.
-    TraversalState traversal;
-
-    // Quick test for special cases.
-    if (!_nodes[0].bounds.IsValid()) {
-        traversal.current = 0;
-        traversal.state = TraversalState::State::FROM_CHILD;
-        return traversal;
-    }
-
-    // Start by going down the root's near child.
-    traversal.current = NearChild(0, ray.direction);
-    traversal.state = TraversalState::State::FROM_PARENT;
-
-    return Traverse(traversal, ray, nearest, intersector, false);
-}
-
-TraversalState BVH::Traverse(TraversalState state, const SlimRay& ray, HitRecord* nearest,
- function<bool (uint32_t index, const SlimRay& ray, HitRecord* hit, bool* request_suspend)> intersector,
- bool resume) {
-    // Precompute the inverse direction of the ray.
-    vec3 inv_dir(1.0f / ray.direction.x,
-                 1.0f / ray.direction.y,
-                 1.0f / ray.direction.z);
-
-    // Initialize traversal based on passed state.
-    TraversalState traversal = state;
-    bool request_suspend = false;
-
-    if (resume) {
-        if (traversal.state == TraversalState::State::FROM_PARENT) {
-            goto resume_parent;
-        } else if (traversal.state == TraversalState::State::FROM_SIBLING) {
-            goto resume_sibling;
-        } else {
-            TERRLN("Must be in FROM_PARENT or FROM_SIBLING state to resume traversal!");
+vector<BoundingBox> BVH::TopBounds(uint32_t max_boxes) const {
+    assert(max_boxes > 0);
+
+    vector<BoundingBox> boxes;
+    if (!_nodes[0].bounds.IsValid()) return boxes;
+
+    // Open up the largest interior node until we run out of room.
+    vector<size_t> frontier;
+    frontier.push_back(0);
+    while (frontier.size() < max_boxes) {
+        int32_t largest = -1;
+        float largest_area = -1.0f;
+        for (size_t i = 0; i < frontier.size(); i++) {
+            const LinearNode& node = _nodes[frontier[i]];
+            if (node.IsLeaf()) continue;
+
+            float area = node.bounds.SurfaceArea();
+            if (area > largest_area) {
+                largest = i;
+                largest_area = area;
+            }
         }
-    }
-
-    while (true) {
-        switch (traversal.state) {
-            case TraversalState::State::FROM_PARENT:
-                if (!BoundingHit(_nodes[traversal.current].bounds, ray, inv_dir, nearest->t)) {
-                    // Ray missed the near child, try the far child.
-                    traversal.current = Sibling(traversal.current);
-                    traversal.state = TraversalState::State::FROM_SIBLING;
-                } else if (_nodes[traversal.current].leaf) {
-                    // Ray hit the near child and it's a leaf node.
-                    request_suspend = false;
-                    traversal.hit = intersector(_nodes[traversal.current].index, ray, nearest, &request_suspend) || traversal.hit;
-                    if (request_suspend) goto suspend_traversal;
-resume_parent:      traversal.current = Sibling(traversal.current);
-                    traversal.state = TraversalState::State::FROM_SIBLING;
-                } else {
-                    // Ray hit the near child and it's an interior node.
-                    traversal.current = NearChild(traversal.current, ray.direction);
-                    traversal.state = TraversalState::State::FROM_PARENT;
-                }
-                break;
-
-            case TraversalState::State::FROM_SIBLING:
-                if (!BoundingHit(_nodes[traversal.current].bounds, ray, inv_dir, nearest->t)) {
-                    // Ray missed the far child, backtrack to the parent.
-                    traversal.current = _nodes[traversal.current].parent;
-                    traversal.state = TraversalState::State::FROM_CHILD;
-                } else if (_nodes[traversal.current].leaf) {
-                    // Ray hit the far child and it's a leaf node.
-                    request_suspend = false;
-                    traversal.hit = intersector(_nodes[traversal.current].index, ray, nearest, &request_suspend) || traversal.hit;
-                    if (request_suspend) goto suspend_traversal;
-resume_sibling:     traversal.current = _nodes[traversal.current].parent;
-                    traversal.state = TraversalState::State::FROM_CHILD;
-                } else {
-                    // Ray hit the far child and it's an interior node.
-                    traversal.current = NearChild(traversal.current, ray.direction);
-                    traversal.state = TraversalState::State::FROM_PARENT;
-                }
-                break;
+        if (largest < 0) break;
 
-            case TraversalState::State::FROM_CHILD:
-                if (traversal.current == 0) {
-                    // Traversal has finished.
-                    return traversal;
-                }
-                if (traversal.current == NearChild(_nodes[traversal.current].parent, ray.direction)) {
-                    // Coming back up through the near child, so traverse
-                    // to the far child.
-                    traversal.current = Sibling(traversal.current);
-                    traversal.state = TraversalState::State::FROM_SIBLING;
-                } else {
-                    // Coming back up through the far child, so continue
-                    // backtracking through the parent.
-                    traversal.current = _nodes[traversal.current].parent;
-                    traversal.state = TraversalState::State::FROM_CHILD;
-                }
-                break;
+        size_t opened = frontier[largest];
+        frontier[largest] = opened + 1;
+        frontier.push_back(_nodes[opened].Right());
+    }
 
-            default:
-                TERRLN("BVH traversal in unknown state!");
-                exit(EXIT_FAILURE);
-                break;
+    // Empty leaves have no bounds worth reporting.
+    for (auto index : frontier) {
+        if (_nodes[index].bounds.IsValid()) {
+            boxes.push_back(_nodes[index].bounds);
         }
     }
-
-    /// Shouldn't ever get here...
-    TERRLN("Unexpected exit path in BVH traversal.");
-    return TraversalState();
-
-suspend_traversal:
-    return traversal;
+    return boxes;
 }
 
-void BVH::Build(vector<PrimitiveInfo>& build_data) {
+void BVH::Build(vector<PrimitiveInfo>& build_data, uint32_t max_leaf_size,
+ vector<uint32_t>* ordered) {
     // Recursively build the BVH tree.
     size_t total_nodes = 0;
-    LinkedNode* root = RecursiveBuild(build_data, 0, build_data.size(), &total_nodes);
+    ordered->reserve(build_data.size());
+    LinkedNode* root = RecursiveBuild(build_data, 0, build_data.size(),
+     max_leaf_size, ordered, &total_nodes);
+
+    if (total_nodes > LinearNode::MAX_NODES) {
+        TERRLN("BVH has too many nodes!");
+        exit(EXIT_FAILURE);
+    }
 
     // Flatten the tree into a linear representation.
     _nodes.reserve(total_nodes);
@@ -196,7 +167,7 @@ void BVH::Build(vector<PrimitiveInfo>& build_data) {
         _nodes.emplace_back();
     }
     size_t offset = 0;
-    FlattenTree(root, -1, &offset);
+    FlattenTree(root, LinearNode::NO_PARENT, &offset);
     assert(offset == total_nodes);
 
     // Release memory consumed by the linked tree.
@@ -204,7 +175,8 @@ void BVH::Build(vector<PrimitiveInfo>& build_data) {
 }
 
 LinkedNode* BVH::RecursiveBuild(vector<PrimitiveInfo>& build_data, size_t start,
- size_t end, size_t* total_nodes) {
+ size_t end, uint32_t max_leaf_size, vector<uint32_t>* ordered,
+ size_t* total_nodes) {
     assert(start != end);
     
     (*total_nodes)++;
@@ -218,21 +190,40 @@ LinkedNode* BVH::RecursiveBuild(vector<PrimitiveInfo>& build_data, size_t start,
 
     // How many primitives are we partitioning?
     size_t num_primitives = end - start;
-    if (num_primitives == 1) {
-        // Only one primitive left, create a leaf node.
-        node = new LinkedNode(build_data[start].index, bounds);
-    } else {
-        // Find the bounds of the centroids.
-        BoundingBox centroid_bounds;
-        for (size_t i = start; i < end; i++) {
-            centroid_bounds.Absorb(build_data[i].centroid);
-        }
 
-        // Split along the longest axis.
-        BoundingBox::Axis split_axis = centroid_bounds.LongestAxis();
-        float split_min = AxisComponent(centroid_bounds.min, split_axis);
-        float split_max = AxisComponent(centroid_bounds.max, split_axis);
+    // Find the bounds of the centroids.
+    BoundingBox centroid_bounds;
+    for (size_t i = start; i < end; i++) {
+        centroid_bounds.Absorb(build_data[i].centroid);
+    }
+
+    // Split along the longest axis.
+    BoundingBox::Axis split_axis = centroid_bounds.LongestAxis();
+    float split_min = AxisComponent(centroid_bounds.min, split_axis);
+    float split_max = AxisComponent(centroid_bounds.max, split_axis);
+
+    // Stop splitting if the primitives fit in a leaf and intersecting all of
+    // them is no more expensive than the best split. Primitives with the same
+    // centroid can't be split anyway.
+    bool make_leaf = (num_primitives == 1);
+    if (!make_leaf && num_primitives <= max_leaf_size) {
+        if (split_min == split_max) {
+            make_leaf = true;
+        } else {
+            float min_cost = 0.0f;
+            ComputeSAH(build_data, start, end, split_min, split_max,
+             bounds.SurfaceArea(), split_axis, &min_cost);
+            make_leaf = num_primitives <= min_cost;
+        }
+    }
 
+    if (make_leaf) {
+        // Create a leaf node over these primitives.
+        node = new LinkedNode(ordered->size(), num_primitives, bounds);
+        for (size_t i = start; i < end; i++) {
+            ordered->push_back(build_data[i].index);
+        }
+    } else {
         size_t mid = (start + end) / 2;
         if (num_primitives <= 4 || split_min == split_max) {
             // Partition using equal size subsets, since SAH has diminishing
@@ -245,8 +236,9 @@ LinkedNode* BVH::RecursiveBuild(vector<PrimitiveInfo>& build_data, size_t start,
              });
         } else {
             // Partition using the surface area heuristic (SAH).
+            float min_cost = 0.0f;
             uint32_t min_cost_split = ComputeSAH(build_data, start, end,
-             split_min, split_max, bounds.SurfaceArea(), split_axis);
+             split_min, split_max, bounds.SurfaceArea(), split_axis, &min_cost);
 
             PrimitiveInfo* pmid = partition(&build_data[start],
              &build_data[end - 1] + 1, [min_cost_split, split_min, split_max, split_axis](const PrimitiveInfo& p) {
@@ -265,8 +257,8 @@ LinkedNode* BVH::RecursiveBuild(vector<PrimitiveInfo>& build_data, size_t start,
         }
 
         // Recursively build the subtrees for both partitions.
-        node = new LinkedNode(RecursiveBuild(build_data, start, mid, total_nodes),
-                              RecursiveBuild(build_data, mid, end, total_nodes),
+        node = new LinkedNode(RecursiveBuild(build_data, start, mid, max_leaf_size, ordered, total_nodes),
+                              RecursiveBuild(build_data, mid, end, max_leaf_size, ordered, total_nodes),
                               split_axis);
     }
 
@@ -274,9 +266,13 @@ LinkedNode* BVH::RecursiveBuild(vector<PrimitiveInfo>& build_data, size_t start,
 }
 
 uint32_t BVH::ComputeSAH(vector<PrimitiveInfo>& build_data, size_t start,
- size_t end, float min, float max, float surface_area, BoundingBox::Axis axis) {
+ size_t end, float min, float max, float surface_area, BoundingBox::Axis axis,
+ float* min_cost) {
     // Initialize each bucket for potential split candidates.
     BucketInfo buckets[NUM_BUCKETS];
+    for (uint32_t i = 0; i < NUM_BUCKETS; i++) {
+        buckets[i].count = 0;
+    }
     for (size_t i = start; i < end; i++) {
         uint32_t bucket = NUM_BUCKETS *
          ((AxisComponent(build_data[i].centroid, axis) - min) / (max - min));
@@ -285,7 +281,7 @@ uint32_t BVH::ComputeSAH(vector<PrimitiveInfo>& build_data, size_t start,
         assert(bucket >= 0 && bucket < NUM_BUCKETS);
 
         buckets[bucket].count++;
-        buckets[bucket].bounds.Union(build_data[i].bounds);
+        buckets[bucket].bounds = buckets[bucket].bounds.Union(build_data[i].bounds);
     }
 
     // Compute the cost for splitting after each bucket.
@@ -296,26 +292,26 @@ uint32_t BVH::ComputeSAH(vector<PrimitiveInfo>& build_data, size_t start,
         size_t right_count = 0;
 
         for (uint32_t j = 0; j <= i; j++) {
-            left_bounds.Union(buckets[j].bounds);
+            left_bounds = left_bounds.Union(buckets[j].bounds);
             left_count += buckets[j].count;
         }
 
-        for (uint32_t j = i + i; j < NUM_BUCKETS; j++) {
-            right_bounds.Union(buckets[j].bounds);
+        for (uint32_t j = i + 1; j < NUM_BUCKETS; j++) {
+            right_bounds = right_bounds.Union(buckets[j].bounds);
             right_count += buckets[j].count;
         }
 
-        cost[i] = 0.125f +
+        cost[i] = TRAVERSAL_COST +
          (left_count * left_bounds.SurfaceArea() + right_count * right_bounds.SurfaceArea()) /
          surface_area;
     }
     
     // Find which bucket minimizes the cost.
-    float min_cost = cost[0];
+    *min_cost = cost[0];
     uint32_t min_cost_split = 0;
     for (uint32_t i = 1; i < NUM_BUCKETS - 1; i++) {
-        if (cost[i] < min_cost) {
-            min_cost = cost[i];
+        if (cost[i] < *min_cost) {
+            *min_cost = cost[i];
             min_cost_split = i;
         }
     }
@@ -328,18 +324,17 @@ size_t BVH::FlattenTree(LinkedNode* current, size_t parent, size_t* offset) {
     size_t my_offset = (*offset)++;
 
     node->bounds = current->bounds;
-    node->parent = parent;
 
     if (current->children[0] == nullptr) {
         // Create leaf node.
-        node->leaf = 1;
-        node->index = current->index;
+        assert(current->index <= LinearNode::MAX_INDEX);
+        assert(current->count <= FR_MAX_BVH_LEAF_SIZE);
+        node->SetLeaf(parent, current->index, current->count);
     } else {
         // Create interior node.
-        node->leaf = 0;
-        node->axis = current->split;
         FlattenTree(current->children[0], my_offset, offset);
-        node->right = FlattenTree(current->children[1], my_offset, offset);
+        size_t right = FlattenTree(current->children[1], my_offset, offset);
+        node->SetInterior(parent, current->split, right);
     }
 
     return my_offset;
@@ -358,52 +353,35 @@ void BVH::DeleteLinked(LinkedNode* node) {
 }
 
 void BVH::ZeroThings() {
+    // Empty leaves under an invalid root, so traversal never enters them.
     LinearNode root;
-    root.leaf = 0;
-    root.index = numeric_limits<size_t>::max();
-    root.parent = -1;
-    root.right = 2;
-    root.axis = BoundingBox::Axis::X;
+    root.SetInterior(LinearNode::NO_PARENT, BoundingBox::Axis::X, 2);
     _nodes.push_back(root);
 
     LinearNode left;
-    left.leaf = 1;
-    left.index = numeric_limits<size_t>::max();
-    left.parent = 0;
-    left.right = -1;
+    left.SetLeaf(0, 0, 0);
     _nodes.push_back(left);
 
     LinearNode right;
-    right.leaf = 1;
-    right.index = numeric_limits<size_t>::max();
-    right.parent = 0;
-    right.right = -1;
+    right.SetLeaf(0, 0, 0);
     _nodes.push_back(right);
 }
 
 void BVH::OneThing(uint32_t id, const BoundingBox& bounds) {
+    assert(id <= LinearNode::MAX_INDEX);
+
     LinearNode root;
     root.bounds = bounds;
-    root.leaf = 0;
-    root.index = numeric_limits<size_t>::max();
-    root.parent = -1;
-    root.right = 2;
-    root.axis = BoundingBox::Axis::X;
+    root.SetInterior(LinearNode::NO_PARENT, BoundingBox::Axis::X, 2);
     _nodes.push_back(root);
 
     LinearNode left;
     left.bounds = bounds;
-    left.leaf = 1;
-    left.index = id;
-    left.parent = 0;
-    left.right = -1;
+    left.SetLeaf(0, id, 1);
     _nodes.push_back(left);
 
     LinearNode right;
-    right.leaf = 1;
-    right.index = numeric_limits<size_t>::max();
-    right.parent = 0;
-    right.right = -1;
+    right.SetLeaf(0, 0, 0);
     _nodes.push_back(right);
 }
 
@@ -1,24 +1,43 @@
 #pragma once
 
 #include <cstdint>
+#include <cstdlib>
 #include <vector>
-#include <functional>
 #include <utility>
 
 #include "glm/glm.hpp"
 #include "msgpack.hpp"
 
+#include "types/hit_record.hpp"
 #include "types/linear_node.hpp"
+#include "types/slim_ray.hpp"
 #include "types/traversal_state.hpp"
 #include "utils/tostring.hpp"
+#include "utils/tout.hpp"
+
+/// Code built with FR_BVH_COUNT_NODES (like bench/) counts every node a
+/// traversal tests in fr::bvh_nodes_visited. Everything else pays nothing.
+#ifdef FR_BVH_COUNT_NODES
+#define FR_BVH_VISIT() (fr::bvh_nodes_visited++)
+#else
+#define FR_BVH_VISIT()
+#endif
 
 namespace fr {
 
+/// The number of BVH nodes tested by traversals built with
+/// FR_BVH_COUNT_NODES.
+extern uint64_t bvh_nodes_visited;
+
 struct Mesh;
-struct SlimRay;
 struct LinkedNode;
 struct PrimitiveInfo;
-struct HitRecord;
+
+/// Whether a traversal is looking for the nearest hit or just any hit.
+enum class TraversalMode {
+    CLOSEST_HIT,
+    ANY_HIT
+};
 
 /**
  * The construction implementation is based on the one presented in Physically
@@ -31,9 +50,12 @@ struct HitRecord;
 class BVH {
 public:
     /**
-     * Constructs a BVH for traversing the given mesh.
+     * Constructs a BVH for traversing the given mesh. Leaves hold up to
+     * max_leaf_size triangles, as the surface area heuristic sees fit. The
+     * mesh's faces are reordered so each leaf's triangles are contiguous, so
+     * this must happen before anything else depends on face order.
      */
-    explicit BVH(const Mesh* mesh);
+    explicit BVH(Mesh* mesh, uint32_t max_leaf_size = 1);
 
     /**
      * Constructs a BVH for traversing a set of things, where those things
@@ -46,20 +68,33 @@ public:
 
     /**
      * Traverses the BVH by testing the given SlimRay against the bounding
-     * volumes. If a leaf node is hit, the passed primitive intersector
-     * function will be called. Returns the current traversal state when the
-     * function exits.
+     * volumes. If a leaf node is hit, the passed primitive intersector will be
+     * called as intersector(index, ray, hit, request_suspend) for each
+     * primitive in the leaf and should return true if it hit the primitive.
+     * Returns the current traversal state when the function exits.
+     *
+     * Suspension resumes after the leaf it was requested from, so
+     * intersectors that suspend should only be used on BVHs with one
+     * primitive per leaf.
+     *
+     * The intersector is a template parameter so it can be inlined into the
+     * traversal loop. In CLOSEST_HIT mode, traversal continues until the
+     * whole tree has been visited (or the intersector requests suspension).
+     * In ANY_HIT mode, traversal ends as soon as the intersector reports a
+     * hit, and the returned state can't be resumed.
      */
+    template <TraversalMode Mode = TraversalMode::CLOSEST_HIT, typename Intersector>
     TraversalState Traverse(const SlimRay& ray, HitRecord* nearest,
-     std::function<bool (uint32_t index, const SlimRay& ray, HitRecord* hit, bool* request_suspend)> intersector);
+     Intersector intersector);
 
     /**
      * Also traverses the BVH, but resumes traversal where we left off using
      * the given TraversalState packet. Returns the current traversal state
      * when the function exits.
      */
-    TraversalState Traverse(TraversalState state, const SlimRay& ray, HitRecord* nearest,
-     std::function<bool (uint32_t index, const SlimRay& ray, HitRecord* hit, bool* request_suspend)> intersector, bool resume = true);
+    template <TraversalMode Mode = TraversalMode::CLOSEST_HIT, typename Intersector>
+    TraversalState Traverse(TraversalState state, const SlimRay& ray,
+     HitRecord* nearest, Intersector intersector, bool resume = true);
 
     /**
      * Returns the extents of the area contained by the BVH.
@@ -68,6 +103,17 @@ public:
         return _nodes[0].bounds;
     }
 
+    /// Returns the flattened nodes, for converting to other layouts.
+    inline const std::vector<LinearNode>& Nodes() const { return _nodes; }
+
+    /**
+     * Returns up to max_boxes disjoint subtrees' bounding boxes that together
+     * cover everything in the BVH, found by repeatedly opening up the interior
+     * node with the largest surface area. Unlike Extents(), these leave out
+     * most of the empty space between distant contents.
+     */
+    std::vector<BoundingBox> TopBounds(uint32_t max_boxes) const;
+
     inline uint64_t GetSizeInBytes() const { return _nodes.size() * sizeof(LinearNode); }
     inline float GetSizeInMB() const { return (_nodes.size() * sizeof(LinearNode)) / (1024.0f * 1024.0f); }
 
@@ -83,27 +129,41 @@ private:
 
     static const uint32_t NUM_BUCKETS;
 
+    /// The cost of visiting a node relative to intersecting one primitive.
+    /// Stackless traversal can pass through a node up to three times (from
+    /// the parent, the sibling, and a child), so it's about as costly as a
+    /// triangle test.
+    static const float TRAVERSAL_COST;
+
     std::vector<LinearNode> _nodes;
 
     /**
-     * Constructs the BVH from the given initialized build data.
+     * Constructs the BVH from the given initialized build data. Leaf nodes
+     * index into ordered, which is filled with the primitive indexes in leaf
+     * order.
      */
-    void Build(std::vector<PrimitiveInfo>& build_data);
+    void Build(std::vector<PrimitiveInfo>& build_data, uint32_t max_leaf_size,
+     std::vector<uint32_t>* ordered);
 
     /**
      * Recursively partitions and builds the BVH for the given build data
-     * between the start and end indexes. Returns the total nodes created
-     * through the passed pointer.
+     * between the start and end indexes, appending the primitives of each
+     * leaf to ordered. Returns the total nodes created through the passed
+     * pointer.
      */
     LinkedNode* RecursiveBuild(std::vector<PrimitiveInfo>& build_data,
-     size_t start, size_t end, size_t* total_nodes);
+     size_t start, size_t end, uint32_t max_leaf_size,
+     std::vector<uint32_t>* ordered, size_t* total_nodes);
 
     /**
      * Computes the minimum cost split for the build_data given num_buckets
-     * possible candidate splits and the centroid bounding box.
+     * possible candidate splits and the centroid bounding box. The cost of
+     * that split, relative to intersecting one primitive, is returned through
+     * min_cost.
      */
     uint32_t ComputeSAH(std::vector<PrimitiveInfo>& build_data, size_t start,
-     size_t end, float min, float max, float surface_area, BoundingBox::Axis axis);
+     size_t end, float min, float max, float surface_area, BoundingBox::Axis axis,
+     float* min_cost);
 
     /**
      * Flattens the linked tree structure into a linear structure with offsets
@@ -124,21 +184,39 @@ private:
 
     /// Returns the index of the sibling of the current node.
     inline size_t Sibling(size_t current) {
-        size_t parent = _nodes[current].parent;
-        size_t right = _nodes[parent].right;
+        size_t parent = _nodes[current].Parent();
+        size_t right = _nodes[parent].Right();
         return (right == current) ? parent + 1 : right;
     }
 
     /// The near child is defined to be the left-hand child.
     inline size_t NearChild(size_t current, glm::vec3 direction) {
-        float axis_component = AxisComponent(direction, _nodes[current].axis);
-        return axis_component < 0.0f ? _nodes[current].right : current + 1;
+        float axis_component = AxisComponent(direction, _nodes[current].Axis());
+        return axis_component < 0.0f ? _nodes[current].Right() : current + 1;
     }
 
     /// The far child is defined to be the right-hand child.
     inline size_t FarChild(size_t current, glm::vec3 direction) {
-        float axis_component = AxisComponent(direction, _nodes[current].axis);
-        return axis_component < 0.0f ? current + 1 : _nodes[current].right;
+        float axis_component = AxisComponent(direction, _nodes[current].Axis());
+        return axis_component < 0.0f ? current + 1 : _nodes[current].Right();
+    }
+
+    /// Runs the intersector on each primitive in the given leaf node.
+    template <TraversalMode Mode, typename Intersector>
+    inline bool IntersectLeaf(size_t current, const SlimRay& ray,
+     HitRecord* nearest, Intersector& intersector, bool* request_suspend) {
+        const LinearNode& node = _nodes[current];
+        bool hit = false;
+        uint32_t index = node.Index();
+        uint32_t count = node.Count();
+        for (uint32_t i = 0; i < count; i++) {
+            if (intersector(index + i, ray, nearest, request_suspend)) {
+                hit = true;
+                if (Mode == TraversalMode::ANY_HIT) break;
+            }
+            if (*request_suspend) break;
+        }
+        return hit;
     }
 
     /// Performs a quick bounding box check against the given bounds and ray.
@@ -150,6 +228,121 @@ private:
     }
 };
 
+template <TraversalMode Mode, typename Intersector>
+TraversalState BVH::Traverse(const SlimRay& ray, HitRecord* nearest,
+ Intersector intersector) {
+    // Initialize fresh state.
+    TraversalState traversal;
+
+    // Quick test for special cases.
+    if (!_nodes[0].bounds.IsValid()) {
+        traversal.current = 0;
+        traversal.state = TraversalState::State::FROM_CHILD;
+        return traversal;
+    }
+
+    // Start by going down the root's near child.
+    traversal.current = NearChild(0, ray.direction);
+    traversal.state = TraversalState::State::FROM_PARENT;
+
+    return Traverse<Mode>(traversal, ray, nearest, intersector, false);
+}
+
+template <TraversalMode Mode, typename Intersector>
+TraversalState BVH::Traverse(TraversalState state, const SlimRay& ray,
+ HitRecord* nearest, Intersector intersector, bool resume) {
+    // Precompute the inverse direction of the ray.
+    glm::vec3 inv_dir(1.0f / ray.direction.x,
+                      1.0f / ray.direction.y,
+                      1.0f / ray.direction.z);
+
+    // Initialize traversal based on passed state.
+    TraversalState traversal = state;
+    bool request_suspend = false;
+    bool hit = false;
+
+    if (resume) {
+        if (traversal.state == TraversalState::State::FROM_PARENT) {
+            goto resume_parent;
+        } else if (traversal.state == TraversalState::State::FROM_SIBLING) {
+            goto resume_sibling;
+        } else {
+            TERRLN("Must be in FROM_PARENT or FROM_SIBLING state to resume traversal!");
+        }
+    }
+
+    while (true) {
+        switch (traversal.state) {
+            case TraversalState::State::FROM_PARENT:
+                FR_BVH_VISIT();
+                if (!BoundingHit(_nodes[traversal.current].bounds, ray, inv_dir, nearest->t)) {
+                    // Ray missed the near child, try the far child.
+                    traversal.current = Sibling(traversal.current);
+                    traversal.state = TraversalState::State::FROM_SIBLING;
+                } else if (_nodes[traversal.current].IsLeaf()) {
+                    // Ray hit the near child and it's a leaf node.
+                    request_suspend = false;
+                    hit = IntersectLeaf<Mode>(traversal.current, ray, nearest, intersector, &request_suspend);
+                    traversal.hit = hit || traversal.hit;
+                    if (Mode == TraversalMode::ANY_HIT && hit) return traversal;
+                    if (request_suspend) return traversal;
+resume_parent:      traversal.current = Sibling(traversal.current);
+                    traversal.state = TraversalState::State::FROM_SIBLING;
+                } else {
+                    // Ray hit the near child and it's an interior node.
+                    traversal.current = NearChild(traversal.current, ray.direction);
+                    traversal.state = TraversalState::State::FROM_PARENT;
+                }
+                break;
+
+            case TraversalState::State::FROM_SIBLING:
+                FR_BVH_VISIT();
+                if (!BoundingHit(_nodes[traversal.current].bounds, ray, inv_dir, nearest->t)) {
+                    // Ray missed the far child, backtrack to the parent.
+                    traversal.current = _nodes[traversal.current].Parent();
+                    traversal.state = TraversalState::State::FROM_CHILD;
+                } else if (_nodes[traversal.current].IsLeaf()) {
+                    // Ray hit the far child and it's a leaf node.
+                    request_suspend = false;
+                    hit = IntersectLeaf<Mode>(traversal.current, ray, nearest, intersector, &request_suspend);
+                    traversal.hit = hit || traversal.hit;
+                    if (Mode == TraversalMode::ANY_HIT && hit) return traversal;
+                    if (request_suspend) return traversal;
+resume_sibling:     traversal.current = _nodes[traversal.current].Parent();
+                    traversal.state = TraversalState::State::FROM_CHILD;
+                } else {
+                    // Ray hit the far child and it's an interior node.
+                    traversal.current = NearChild(traversal.current, ray.direction);
+                    traversal.state = TraversalState::State::FROM_PARENT;
+                }
+                break;
+
+            case TraversalState::State::FROM_CHILD:
+                if (traversal.current == 0) {
+                    // Traversal has finished.
+                    return traversal;
+                }
+                if (traversal.current == NearChild(_nodes[traversal.current].Parent(), ray.direction)) {
+                    // Coming back up through the near child, so traverse
+                    // to the far child.
+                    traversal.current = Sibling(traversal.current);
+                    traversal.state = TraversalState::State::FROM_SIBLING;
+                } else {
+                    // Coming back up through the far child, so continue
+                    // backtracking through the parent.
+                    traversal.current = _nodes[traversal.current].Parent();
+                    traversal.state = TraversalState::State::FROM_CHILD;
+                }
+                break;
+
+            default:
+                TERRLN("BVH traversal in unknown state!");
+                exit(EXIT_FAILURE);
+                break;
+        }
+    }
+}
+
 std::string ToString(const BVH* bvh, const std::string& indent = "");
 
 } // namespace fr
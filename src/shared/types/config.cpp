@@ -21,6 +21,12 @@ Config::Config() :
  bounce_limit(5),
  transmittance_threshold(0.0f),
  runaway(2.5f),
+ bake(false),
+ bvh_leaf_size(1),
+ max_mesh_faces(0),
+ worker_boxes(1),
+ replicate_faces(0),
+ shared_memory(true),
  name("output"),
  workers(),
  buffers() {
@@ -46,6 +52,12 @@ string ToString(const Config& config, const string& indent) {
      indent << "| bounce_limit = " << config.bounce_limit << endl <<
      indent << "| transmittance_threshold = " << config.transmittance_threshold << endl <<
      indent << "| runaway = " << config.runaway << endl <<
+     indent << "| bake = " << config.bake << endl <<
+     indent << "| bvh_leaf_size = " << config.bvh_leaf_size << endl <<
+     indent << "| max_mesh_faces = " << config.max_mesh_faces << endl <<
+     indent << "| worker_boxes = " << config.worker_boxes << endl <<
+     indent << "| replicate_faces = " << config.replicate_faces << endl <<
+     indent << "| shared_memory = " << config.shared_memory << endl <<
      indent << "| name = " << config.name << endl <<
      indent << "| workers = {" << endl;
     for (const auto& worker : config.workers) {
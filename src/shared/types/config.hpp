@@ -41,6 +41,31 @@ struct Config {
     /// allowed to get ahead of the slowest worker in generating primary rays.
     float runaway;
 
+    /// Whether workers bake meshes into world space, packed into blocks that
+    /// are intersected with SIMD, at the cost of extra memory per triangle.
+    bool bake;
+
+    /// The most triangles a leaf of a mesh BVH may hold. Larger leaves mean
+    /// fewer BVH nodes (and less memory) at the cost of more triangle tests.
+    uint32_t bvh_leaf_size;
+
+    /// Meshes with more faces than this are split into spatially compact
+    /// pieces that are distributed separately, or 0 to never split meshes.
+    uint32_t max_mesh_faces;
+
+    /// The most bounding boxes each worker describes its geometry with in the
+    /// worker BVH. More boxes fit the geometry more tightly, so rays make
+    /// fewer needless hops to workers with nothing in their way.
+    uint32_t worker_boxes;
+
+    /// Meshes with this many faces or fewer are replicated on every worker,
+    /// or 0 to only replicate meshes the scene asks for.
+    uint32_t replicate_faces;
+
+    /// Whether workers on the same host send rays to each other through
+    /// shared memory instead of over loopback TCP.
+    bool shared_memory;
+
     /// Name of the scene.
     std::string name;
 
@@ -51,7 +76,8 @@ struct Config {
     std::vector<std::string> buffers;
 
     MSGPACK_DEFINE(width, height, min, max, antialiasing, samples, bounce_limit,
-     transmittance_threshold, runaway, name, workers, buffers);
+     transmittance_threshold, runaway, bake, bvh_leaf_size, max_mesh_faces,
+     worker_boxes, replicate_faces, shared_memory, name, workers, buffers);
 
     TOSTRINGABLE(Config);
 };
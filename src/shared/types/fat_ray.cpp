@@ -26,6 +26,7 @@ FatRay::FatRay(Kind kind, int16_t x, int16_t y) :
  hit(),
  current_worker(0),
  workers_touched(1),
+ visited(0),
  next(nullptr) {
     bounces = numeric_limits<int16_t>::min();
 
@@ -47,6 +48,7 @@ FatRay::FatRay(Kind kind) :
  hit(),
  current_worker(0),
  workers_touched(1),
+ visited(0),
  next(nullptr) {
     x = numeric_limits<int16_t>::min();
     y = numeric_limits<int16_t>::min();
@@ -71,6 +73,7 @@ FatRay::FatRay() :
  hit(),
  current_worker(0),
  workers_touched(1),
+ visited(0),
  next(nullptr) {
     x = numeric_limits<int16_t>::min();
     y = numeric_limits<int16_t>::min();
@@ -108,6 +111,7 @@ string ToString(const FatRay& ray, const string& indent) {
              indent << "| hit = " << ToString(ray.hit, pad) << endl <<
              indent << "| current_worker = " << ray.current_worker << endl <<
              indent << "| workers_touched = " << ray.workers_touched << endl <<
+             indent << "| visited = " << ray.visited << endl <<
              indent << "| next = " << hex << showbase << ray.next << endl;
             break;
 
@@ -122,6 +126,7 @@ string ToString(const FatRay& ray, const string& indent) {
              indent << "| hit = " << ToString(ray.hit, pad) << endl <<
              indent << "| current_worker = " << ray.current_worker << endl <<
              indent << "| workers_touched = " << ray.workers_touched << endl <<
+             indent << "| visited = " << ray.visited << endl <<
              indent << "| next = " << hex << showbase << ray.next << endl;
             break;
 
@@ -137,6 +142,7 @@ string ToString(const FatRay& ray, const string& indent) {
              indent << "| hit = " << ToString(ray.hit, pad) << endl <<
              indent << "| current_worker = " << ray.current_worker << endl <<
              indent << "| workers_touched = " << ray.workers_touched << endl <<
+             indent << "| visited = " << ray.visited << endl <<
              indent << "| next = " << hex << showbase << ray.next << endl;
             break;
     }
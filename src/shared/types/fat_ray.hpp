@@ -10,6 +10,10 @@
 #include "types/traversal_state.hpp"
 #include "utils/tostring.hpp"
 
+/// The number of workers a ray can remember visiting. Rays through later
+/// workers may test the same worker's geometry once per box it has.
+#define FR_MAX_VISITED_WORKERS 64
+
 namespace fr {
 
 struct FatRay {
@@ -62,6 +66,12 @@ struct FatRay {
     /// The number of workers this ray has touched for far. Purely for analysis.
     uint32_t workers_touched;
 
+    /// Bit mask of the workers (bit id - 1, for the first
+    /// FR_MAX_VISITED_WORKERS workers) whose geometry has already been tested
+    /// during the worker BVH traversal. A worker can have several boxes in the
+    /// worker BVH, but one visit tests everything it has.
+    uint64_t visited;
+
     /// Next pointer for chaining rays together. Obviously not valid once the
     /// ray has been sent over the network.
     FatRay* next;
@@ -72,6 +82,16 @@ struct FatRay {
         return slim.TransformTo(mesh->xform_inv);
     }
 
+    /// Returns true if the worker's geometry has already been tested.
+    inline bool Visited(uint32_t worker) const {
+        return worker > 0 && worker <= FR_MAX_VISITED_WORKERS && (visited & (1ull << (worker - 1)));
+    }
+
+    /// Records that the worker's geometry is being tested.
+    inline void MarkVisited(uint32_t worker) {
+        if (worker > 0 && worker <= FR_MAX_VISITED_WORKERS) visited |= 1ull << (worker - 1);
+    }
+
     /// Evaluate a point along the ray at a specific t value.
     inline glm::vec3 EvaluateAt(float t) const {
         return slim.EvaluateAt(t);
@@ -1,6 +1,7 @@
 #include "types/image.hpp"
 
 #include <limits>
+#include <cstring>
 
 #include "OpenEXR/ImfOutputFile.h"
 #include "OpenEXR/ImfChannelList.h"
@@ -13,6 +14,7 @@ namespace fr {
 Image::Image(int16_t width, int16_t height) :
  _width(width),
  _height(height),
+ _names(),
  _buffers() {
      AddBuffer("R");
      AddBuffer("G");
@@ -20,26 +22,50 @@ Image::Image(int16_t width, int16_t height) :
 }
 
 Image::Image() :
+ _names(),
  _buffers() {
     _width = numeric_limits<int16_t>::min();
     _height = numeric_limits<int16_t>::min();
 }
 
-void Image::AddBuffer(const string& name) {
-    _buffers[name] = Buffer(_width, _height, 0.0f);
+uint16_t Image::AddBuffer(const string& name) {
+    uint16_t id = LookupBuffer(name.c_str());
+    if (id != NO_BUFFER) {
+        _buffers[id] = Buffer(_width, _height, 0.0f);
+        return id;
+    }
+
+    assert(_buffers.size() < NO_BUFFER);
+    _names.push_back(name);
+    _buffers.emplace_back(_width, _height, 0.0f);
+    return _buffers.size() - 1;
+}
+
+uint16_t Image::LookupBuffer(const char* name) const {
+    // There are only ever a handful of buffers, so a linear scan beats
+    // hashing.
+    for (size_t i = 0; i < _names.size(); i++) {
+        if (strcmp(_names[i].c_str(), name) == 0) {
+            return i;
+        }
+    }
+    return NO_BUFFER;
 }
 
 void Image::Merge(const Image* other) {
-    for (const auto& kv_pair : other->_buffers) {
-        _buffers[kv_pair.first].Merge(kv_pair.second);
+    for (size_t i = 0; i < other->_names.size(); i++) {
+        uint16_t id = LookupBuffer(other->_names[i].c_str());
+        if (id == NO_BUFFER) {
+            id = AddBuffer(other->_names[i]);
+        }
+        _buffers[id].Merge(other->_buffers[i]);
     }
 }
 
 void Image::ToEXRFile(const string& filename) const {
     // Create the header and channel list.
     Imf::Header header(_width, _height);
-    for (const auto& kv_pair : _buffers) {
-        const auto& name = kv_pair.first;
+    for (const auto& name : _names) {
         header.channels().insert(name.c_str(), Imf::Channel(Imf::FLOAT));
     }
 
@@ -48,9 +74,9 @@ void Image::ToEXRFile(const string& filename) const {
     Imf::FrameBuffer frame;
 
     // Set up the memory layout.
-    for (const auto& kv_pair : _buffers) {
-        const auto& name = kv_pair.first;
-        const auto& buffer = kv_pair.second;
+    for (size_t i = 0; i < _names.size(); i++) {
+        const auto& name = _names[i];
+        const auto& buffer = _buffers[i];
         frame.insert(name.c_str(), Imf::Slice(Imf::FLOAT,
          const_cast<char*>(reinterpret_cast<const char*>(&(buffer._data[0]))),
          sizeof(float), _width * sizeof(float)));
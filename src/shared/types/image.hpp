@@ -1,8 +1,9 @@
 #pragma once
 
 #include <cstdint>
+#include <cassert>
 #include <string>
-#include <map>
+#include <vector>
 
 #include "types/buffer.hpp"
 
@@ -10,39 +11,57 @@ namespace fr {
 
 class Image {
 public:
+    /// Returned by LookupBuffer() when there is no buffer with the name.
+    static const uint16_t NO_BUFFER = 0xFFFF;
+
     explicit Image(int16_t width, int16_t height);
 
     // FOR MSGPACK ONLY!
     explicit Image();
 
-    /// Adds a new buffer to the image with the given name.
-    void AddBuffer(const std::string& name);
+    /// Adds a new buffer to the image with the given name and returns its ID.
+    /// If a buffer with that name already exists, it is cleared instead.
+    uint16_t AddBuffer(const std::string& name);
+
+    /// Returns the ID of the buffer with the given name, or NO_BUFFER if
+    /// there isn't one. IDs are handed out in the order buffers are added,
+    /// so they match across every image built from the same config.
+    uint16_t LookupBuffer(const char* name) const;
+
+    /// Returns the number of buffers in the image.
+    inline uint16_t NumBuffers() const { return _buffers.size(); }
+
+    /// Returns the name of the buffer with the given ID.
+    inline const std::string& BufferName(uint16_t id) const { return _names[id]; }
 
     /// Merges the other image with this one by folding each buffer into its
     /// corresponding buffer using accumulation.
     void Merge(const Image* other);
 
     /// Overwrites the value at location <x, y> with the given value in the
-    /// named buffer.
-    inline void Write(const std::string& buffer, int16_t x, int16_t y, float value) {
+    /// given buffer.
+    inline void Write(uint16_t buffer, int16_t x, int16_t y, float value) {
+        assert(buffer < _buffers.size());
         _buffers[buffer].Write(x, y, value);
     }
 
     /// Accumulates the given value with the existing value at location <x, y>
-    /// in the named buffer.
-    inline void Accumulate(const std::string& buffer, int16_t x, int16_t y, float value) {
+    /// in the given buffer.
+    inline void Accumulate(uint16_t buffer, int16_t x, int16_t y, float value) {
+        assert(buffer < _buffers.size());
         _buffers[buffer].Accumulate(x, y, value);
     }
 
     /// Dumps all the buffers out to an EXR file.
     void ToEXRFile(const std::string& filename) const;
 
-    MSGPACK_DEFINE(_width, _height, _buffers);
+    MSGPACK_DEFINE(_width, _height, _names, _buffers);
 
 private:
     int16_t _width;
     int16_t _height;
-    std::map<std::string, Buffer> _buffers;
+    std::vector<std::string> _names;
+    std::vector<Buffer> _buffers;
 };
 
 } // namespace fr
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cassert>
 #include <cstdint>
 #include <cstring>
 
@@ -8,33 +9,78 @@
 #include "types/bounding_box.hpp"
 #include "utils/tostring.hpp"
 
+/// The most primitives a BVH leaf can hold, limited by the bits a LinearNode
+/// has to store the count.
+#define FR_MAX_BVH_LEAF_SIZE 15
+
 namespace fr {
 
+/**
+ * A flattened BVH node, packed into 32 bytes so two fit in a cache line.
+ * Interior nodes keep their left child immediately after them, so only the
+ * right child's offset is stored. Accessors hide the bit packing.
+ */
 struct LinearNode {
     explicit LinearNode();
 
+    /// Sentinel parent offset for the root node.
+    static const uint32_t NO_PARENT = 0x3fffffff;
+
+    /// Value stored in the axis bits to mark a leaf node.
+    static const uint32_t LEAF_AXIS = 3;
+
+    /// The most nodes a BVH can have.
+    static const uint32_t MAX_NODES = NO_PARENT;
+
+    /// The highest primitive index a leaf can start at.
+    static const uint32_t MAX_INDEX = 0x0fffffff;
+
     /// The bounding box of this node in world space.
     BoundingBox bounds;
 
-    /// Boolean flag that indicates if this is a leaf node or interior node.
-    /// Yes, it is intentionally this big to pad the entire structure to fit
-    /// in a cache line (64 bytes).
-    uint64_t leaf;
+    /// Offset of the parent of this node in the low 30 bits, and the axis we
+    /// split on less one (or LEAF_AXIS for leaf nodes) in the high 2 bits.
+    uint32_t parent_axis;
+
+    /// Offset of the right-hand child if this is an interior node. For leaf
+    /// nodes, the index of the first primitive in the low 28 bits, and the
+    /// number of (contiguous) primitives in the high 4 bits.
+    uint32_t offset;
+
+    /// Returns true if this is a leaf node.
+    inline bool IsLeaf() const { return (parent_axis >> 30) == LEAF_AXIS; }
+
+    /// Offset of the parent of this node, or NO_PARENT for the root.
+    inline uint32_t Parent() const { return parent_axis & NO_PARENT; }
+
+    /// Axis that we split on, if this is an interior node.
+    inline BoundingBox::Axis Axis() const {
+        return static_cast<BoundingBox::Axis>((parent_axis >> 30) + 1);
+    }
+
+    /// Offset of the right-hand child, if this is an interior node.
+    inline uint32_t Right() const { return offset; }
 
-    /// Index of the primitive, if this is a leaf node.
-    size_t index;
+    /// Index of the first primitive, if this is a leaf node.
+    inline uint32_t Index() const { return offset & MAX_INDEX; }
 
-    /// Offset of the parent of this node if this is an interior node.
-    ssize_t parent;
+    /// Number of primitives, if this is a leaf node.
+    inline uint32_t Count() const { return offset >> 28; }
 
-    /// Offset of the right-hand child of this node if this is an interior node.
-    ssize_t right;
+    /// Makes this an interior node.
+    inline void SetInterior(uint32_t parent, BoundingBox::Axis axis, uint32_t right) {
+        assert(axis != BoundingBox::Axis::NONE);
+        parent_axis = ((axis - 1) << 30) | (parent & NO_PARENT);
+        offset = right;
+    }
 
-    /// Axis that we split on. Yes, it is intentionally this big to pad the
-    /// entire structure to fit in a cache line (64 bytes).
-    uint64_t axis;
+    /// Makes this a leaf node.
+    inline void SetLeaf(uint32_t parent, uint32_t index, uint32_t count) {
+        parent_axis = (LEAF_AXIS << 30) | (parent & NO_PARENT);
+        offset = (count << 28) | (index & MAX_INDEX);
+    }
 
-    MSGPACK_DEFINE(bounds, leaf, index, parent, right, axis);
+    MSGPACK_DEFINE(bounds, parent_axis, offset);
 
     TOSTRINGABLE(LinearNode);
 };
@@ -9,9 +9,10 @@ using std::endl;
 
 namespace fr {
 
-LinkedNode::LinkedNode(size_t index, const BoundingBox& bounds) :
+LinkedNode::LinkedNode(size_t index, size_t count, const BoundingBox& bounds) :
  bounds(bounds),
- index(index) {
+ index(index),
+ count(count) {
     children[0] = nullptr;
     children[1] = nullptr;
 }
@@ -19,6 +20,7 @@ LinkedNode::LinkedNode(size_t index, const BoundingBox& bounds) :
 LinkedNode::LinkedNode(LinkedNode* left, LinkedNode* right,
  BoundingBox::Axis split) :
  index(0),
+ count(0),
  split(split) {
     assert(left != nullptr);
     assert(right != nullptr);
@@ -43,7 +45,8 @@ string ToString(const LinkedNode* node, const string& indent) {
          indent << "| children[1] = " << ToString(node->children[1], pad) << endl;
     } else {
         // Leaf node.
-        stream << indent << "| index = " << node->index << endl;
+        stream << indent << "| index = " << node->index << endl <<
+         indent << "| count = " << node->count << endl;
     }
     stream << indent << "}";
     return stream.str();
@@ -9,7 +9,7 @@ namespace fr {
 
 struct LinkedNode {
     /// Constructor for leaf nodes.
-    explicit LinkedNode(size_t index, const BoundingBox& bounds);
+    explicit LinkedNode(size_t index, size_t count, const BoundingBox& bounds);
 
     /// Constructor for interior nodes.
     explicit LinkedNode(LinkedNode* left, LinkedNode* right,
@@ -21,9 +21,12 @@ struct LinkedNode {
     /// Links to this node's children, if it's an interior node.
     LinkedNode* children[2];
 
-    /// Index of the primitive, if it's a leaf node.
+    /// Index of the first primitive, if it's a leaf node.
     size_t index;
 
+    /// Number of primitives, if it's a leaf node.
+    size_t count;
+
     /// The axis the node was split on.
     BoundingBox::Axis split;
 
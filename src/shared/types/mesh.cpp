@@ -1,16 +1,24 @@
 #include "types/mesh.hpp"
 
+#include <cassert>
+#include <algorithm>
 #include <limits>
 #include <iostream>
 #include <sstream>
 
-#include "types/bvh.hpp"
+#include "types/bounding_box.hpp"
+#include "types/wide_bvh.hpp"
 #include "utils/printers.hpp"
+#include "utils/spacecode.hpp"
 
 using std::numeric_limits;
+using std::vector;
+using std::pair;
+using std::make_pair;
 using std::string;
 using std::stringstream;
 using std::endl;
+using glm::vec3;
 using glm::vec4;
 using glm::mat4;
 using glm::inverse;
@@ -20,9 +28,12 @@ namespace fr {
 
 Mesh::Mesh(uint32_t id) :
  id(id),
+ replicate(false),
  vertices(),
  faces(),
- bvh(nullptr) {
+ bvh(nullptr),
+ baked4(),
+ baked8() {
     material = numeric_limits<uint32_t>::max();
 
     centroid.x = numeric_limits<float>::quiet_NaN();
@@ -42,9 +53,12 @@ Mesh::Mesh(uint32_t id) :
 Mesh::Mesh(uint32_t id, uint32_t material) :
  id(id),
  material(material),
+ replicate(false),
  vertices(),
  faces(),
- bvh(nullptr) {
+ bvh(nullptr),
+ baked4(),
+ baked8() {
     centroid.x = numeric_limits<float>::quiet_NaN();
     centroid.y = numeric_limits<float>::quiet_NaN();
     centroid.z = numeric_limits<float>::quiet_NaN();
@@ -60,9 +74,12 @@ Mesh::Mesh(uint32_t id, uint32_t material) :
 }
 
 Mesh::Mesh() :
+ replicate(false),
  vertices(),
  faces(),
- bvh(nullptr) {
+ bvh(nullptr),
+ baked4(),
+ baked8() {
     id = numeric_limits<uint32_t>::max();
     material = numeric_limits<uint32_t>::max();
 
@@ -90,6 +107,189 @@ void Mesh::ComputeMatrices() {
     xform_inv_tr = transpose(xform_inv);
 }
 
+void Mesh::Split(uint32_t max_faces, vector<Mesh*>* pieces) const {
+    assert(max_faces > 0);
+    assert(pieces != nullptr);
+
+    // Sort the faces along a Z-order curve through the mesh's own bounds.
+    // Flat meshes would divide by zero, so give every axis some thickness.
+    BoundingBox bounds;
+    for (const auto& vertex : vertices) {
+        bounds.Absorb(vertex.v);
+    }
+    vec3 pad(std::max(bounds.max.x - bounds.min.x, 1.0f),
+             std::max(bounds.max.y - bounds.min.y, 1.0f),
+             std::max(bounds.max.z - bounds.min.z, 1.0f));
+    bounds.max = bounds.min + pad * 1.001f;
+
+    vector<pair<uint64_t, uint32_t>> order;
+    order.reserve(faces.size());
+    for (uint32_t i = 0; i < faces.size(); i++) {
+        const Triangle& tri = faces[i];
+        vec3 center = (vertices[tri.verts[0]].v + vertices[tri.verts[1]].v +
+         vertices[tri.verts[2]].v) / 3.0f;
+        order.push_back(make_pair(SpaceEncode(center, bounds.min, bounds.max), i));
+    }
+    std::sort(order.begin(), order.end());
+
+    // Spread the faces evenly over as few pieces as we can.
+    size_t num_pieces = (faces.size() + max_faces - 1) / max_faces;
+    size_t piece_size = (faces.size() + num_pieces - 1) / num_pieces;
+
+    // Maps old vertex indices to new ones, valid for the piece in stamp.
+    vector<uint32_t> remap(vertices.size());
+    vector<size_t> stamp(vertices.size(), numeric_limits<size_t>::max());
+
+    for (size_t piece = 0; piece < num_pieces; piece++) {
+        Mesh* mesh = new Mesh(0, material);
+        mesh->replicate = replicate;
+        for (uint32_t col = 0; col < 4; col++) {
+            mesh->xform_cols[col] = xform_cols[col];
+        }
+        mesh->ComputeMatrices();
+
+        size_t first = piece * piece_size;
+        size_t last = std::min(first + piece_size, faces.size());
+        mesh->faces.reserve(last - first);
+
+        vec3 centroid_num(0.0f, 0.0f, 0.0f);
+        for (size_t i = first; i < last; i++) {
+            const Triangle& tri = faces[order[i].second];
+            uint32_t verts[3];
+            for (uint32_t j = 0; j < 3; j++) {
+                uint32_t old = tri.verts[j];
+                if (stamp[old] != piece) {
+                    stamp[old] = piece;
+                    remap[old] = mesh->vertices.size();
+                    mesh->vertices.push_back(vertices[old]);
+                    centroid_num += vertices[old].v;
+                }
+                verts[j] = remap[old];
+            }
+            mesh->faces.emplace_back(verts[0], verts[1], verts[2]);
+        }
+
+        // Same as the scene parser, the centroid is the average of the
+        // vertices, transformed into world space.
+        vec3 center = centroid_num / static_cast<float>(mesh->vertices.size());
+        mesh->centroid = vec3(mesh->xform * vec4(center, 1.0f));
+
+        pieces->push_back(mesh);
+    }
+}
+
+/// Packs the faces into blocks of Width, transformed into world space.
+template <uint32_t Width>
+static void BakeBlocks(const Mesh* mesh, vector<TriangleBlock<Width>>* blocks) {
+    blocks->clear();
+    blocks->resize((mesh->faces.size() + Width - 1) / Width);
+    for (size_t i = 0; i < mesh->faces.size(); i++) {
+        const Triangle& tri = mesh->faces[i];
+        (*blocks)[i / Width].Set(i % Width,
+         vec3(mesh->xform * vec4(mesh->vertices[tri.verts[0]].v, 1.0f)),
+         vec3(mesh->xform * vec4(mesh->vertices[tri.verts[1]].v, 1.0f)),
+         vec3(mesh->xform * vec4(mesh->vertices[tri.verts[2]].v, 1.0f)));
+    }
+}
+
+void Mesh::Bake(uint32_t width) {
+    assert(width == 4 || width == 8);
+
+    baked4.clear();
+    baked8.clear();
+    if (width == 8) {
+        BakeBlocks<8>(this, &baked8);
+    } else {
+        BakeBlocks<4>(this, &baked4);
+    }
+}
+
+/**
+ * Intersects the ray with the baked faces [first, first + count) a block at a
+ * time. Calls hit(face, t, u, v) for each face hit before max_t, in face
+ * order, and stops early if it returns true.
+ */
+template <uint32_t Width, typename Hit>
+static inline void IntersectBlocks(const vector<TriangleBlock<Width>>& blocks,
+ uint32_t first, uint32_t count, const SlimRay& ray, float max_t, Hit hit) {
+    uint32_t end = first + count;
+    for (uint32_t block = first / Width; block * Width < end; block++) {
+        // Only test the lanes in the range.
+        uint32_t base = block * Width;
+        uint32_t mask = (1 << Width) - 1;
+        if (first > base) mask &= ~((1 << (first - base)) - 1);
+        if (end < base + Width) mask &= (1 << (end - base)) - 1;
+
+        float t[Width];
+        float u[Width];
+        float v[Width];
+        uint32_t hits = IntersectBlock<Width>(blocks[block], ray, mask, max_t,
+         t, u, v);
+        for (uint32_t i = 0; hits != 0; i++, hits >>= 1) {
+            if ((hits & 1) && hit(base + i, t[i], u[i], v[i])) return;
+        }
+    }
+}
+
+bool Mesh::IntersectFaces(uint32_t first, uint32_t count, const SlimRay& ray,
+ const SlimRay& obj_ray, float* t, uint32_t* face, float* u, float* v) const {
+    bool found = false;
+
+    // Candidates only need their (unnormalized) normal checked for culling.
+    auto hit = [this, &obj_ray, t, face, u, v, &found](uint32_t i,
+     float hit_t, float hit_u, float hit_v) {
+        if (hit_t < *t &&
+            faces[i].FacesAgainst(vertices, obj_ray.direction, hit_u, hit_v)) {
+            *t = hit_t;
+            *face = i;
+            *u = hit_u;
+            *v = hit_v;
+            found = true;
+        }
+        return false;
+    };
+
+    if (!baked8.empty()) {
+        IntersectBlocks<8>(baked8, first, count, ray, *t, hit);
+    } else if (!baked4.empty()) {
+        IntersectBlocks<4>(baked4, first, count, ray, *t, hit);
+    } else {
+        for (uint32_t i = first; i < first + count; i++) {
+            float hit_t = 0.0f;
+            float hit_u = 0.0f;
+            float hit_v = 0.0f;
+            if (faces[i].Hit(vertices, obj_ray, &hit_t, &hit_u, &hit_v)) {
+                hit(i, hit_t, hit_u, hit_v);
+            }
+        }
+    }
+
+    return found;
+}
+
+bool Mesh::OccludeFaces(uint32_t first, uint32_t count, const SlimRay& ray,
+ const SlimRay& obj_ray, float max_t) const {
+    bool blocked = false;
+
+    auto hit = [this, &obj_ray, &blocked](uint32_t i, float hit_t,
+     float hit_u, float hit_v) {
+        blocked = faces[i].FacesAgainst(vertices, obj_ray.direction, hit_u, hit_v);
+        return blocked;
+    };
+
+    if (!baked8.empty()) {
+        IntersectBlocks<8>(baked8, first, count, ray, max_t, hit);
+    } else if (!baked4.empty()) {
+        IntersectBlocks<4>(baked4, first, count, ray, max_t, hit);
+    } else {
+        for (uint32_t i = first; i < first + count && !blocked; i++) {
+            blocked = faces[i].Occludes(vertices, obj_ray, max_t);
+        }
+    }
+
+    return blocked;
+}
+
 string ToString(const Mesh& mesh, const string& indent) {
     stringstream stream;
     string pad = indent + "| ";
@@ -101,6 +301,7 @@ string ToString(const Mesh& mesh, const string& indent) {
      indent << "| xform_cols[1] = " << ToString(mesh.xform_cols[1]) << endl <<
      indent << "| xform_cols[2] = " << ToString(mesh.xform_cols[2]) << endl <<
      indent << "| xform_cols[3] = " << ToString(mesh.xform_cols[3]) << endl <<
+     indent << "| replicate = " << mesh.replicate << endl <<
      indent << "| vertices = {" << endl;
     for (const auto& vertex : mesh.vertices) {
         stream << pad << ToString(vertex, pad2) << endl;
@@ -6,13 +6,15 @@
 #include "glm/glm.hpp"
 #include "msgpack.hpp"
 
+#include "types/slim_ray.hpp"
 #include "types/triangle.hpp"
+#include "types/triangle_block.hpp"
 #include "types/vertex.hpp"
 #include "utils/tostring.hpp"
 
 namespace fr {
 
-class BVH;
+class WideBVH;
 
 struct Mesh {
     explicit Mesh(uint32_t id);
@@ -33,6 +35,11 @@ struct Mesh {
     /// Columns of the 4x4 transform matrix. Only used for syncing.
     glm::vec4 xform_cols[4];
 
+    /// Whether copies of the mesh go to every worker instead of just the one
+    /// whose region it's in, so rays can hit it without leaving the worker
+    /// they're on. Replicated meshes aren't part of any worker's bounds.
+    bool replicate;
+
     /// Indexed vertices.
     std::vector<Vertex> vertices;
 
@@ -56,14 +63,65 @@ struct Mesh {
     glm::mat4 xform_inv_tr;
 
     /// The BVH for traversing this mesh efficiently.
-    BVH* bvh;
+    WideBVH* bvh;
+
+    /// World space copies of the faces packed into blocks of 4, with face i in
+    /// lane i % 4 of block i / 4. Only present if the mesh has been baked 4
+    /// wide. Not synced.
+    std::vector<TriangleBlock<4>> baked4;
+
+    /// Same as baked4, but in blocks of 8. Only present if the mesh has been
+    /// baked 8 wide. Not synced.
+    std::vector<TriangleBlock<8>> baked8;
 
     /// Uses the data in xform_cols to build the transformation matrix and
     /// compute the inverse and inverse transpose.
     void ComputeMatrices();
 
+    /**
+     * Splits the mesh into pieces of at most max_faces faces each, so a huge
+     * mesh can be spread over several workers. Faces are grouped in the Morton
+     * order of their centroids, so each piece is spatially compact. Each piece
+     * gets copies of just the vertices it uses, the same material and
+     * transform, and its own world space centroid, and is owned by the
+     * caller. Pieces have an ID of 0, the caller hands those out.
+     */
+    void Split(uint32_t max_faces, std::vector<Mesh*>* pieces) const;
+
+    /// Bakes the faces into world space using the transformation matrix, so
+    /// intersection doesn't have to transform rays into object space, packed
+    /// into blocks of width (4 or 8, see SIMDWidth) faces that are intersected
+    /// together.
+    void Bake(uint32_t width);
+
+    /// Returns true if the mesh has been baked.
+    inline bool IsBaked() const { return !baked4.empty() || !baked8.empty(); }
+
+    inline uint64_t GetBakedSizeInBytes() const {
+        return baked4.size() * sizeof(TriangleBlock<4>) +
+         baked8.size() * sizeof(TriangleBlock<8>);
+    }
+
+    /**
+     * Intersects the world space ray (and the same ray in object space) with
+     * the faces [first, first + count), culling back faces. If one is hit
+     * nearer than t, returns true and updates t, the face index, and the
+     * barycentric coordinates <u, v> of the hit. The local geometry is left
+     * to the caller, once it knows the hit is the nearest.
+     */
+    bool IntersectFaces(uint32_t first, uint32_t count, const SlimRay& ray,
+     const SlimRay& obj_ray, float* t, uint32_t* face, float* u, float* v) const;
+
+    /**
+     * Returns true if any of the faces [first, first + count) blocks the world
+     * space ray (or the same ray in object space) before max_t. Back faces
+     * don't block.
+     */
+    bool OccludeFaces(uint32_t first, uint32_t count, const SlimRay& ray,
+     const SlimRay& obj_ray, float max_t) const;
+
     MSGPACK_DEFINE(id, material, xform_cols[0], xform_cols[1], xform_cols[2],
-     xform_cols[3], vertices, faces);
+     xform_cols[3], replicate, vertices, faces);
 
     TOSTRINGABLE(Mesh);
 };
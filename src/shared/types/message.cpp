@@ -40,6 +40,10 @@ string ToString(const Message& msg, const string& indent) {
             stream << indent << "| kind = INIT" << endl;
             break;
 
+        case Message::Kind::SHM_ATTACH:
+            stream << indent << "| kind = SHM_ATTACH" << endl;
+            break;
+
         case Message::Kind::SYNC_CONFIG:
             stream << indent << "| kind = SYNC_CONFIG" << endl;
             break;
@@ -104,6 +108,10 @@ string ToString(const Message& msg, const string& indent) {
             stream << indent << "| kind = RAY" << endl;
             break;
 
+        case Message::Kind::RAY_BATCH:
+            stream << indent << "| kind = RAY_BATCH" << endl;
+            break;
+
         default:
             stream << indent << "| kind = ?" << endl;
             break;
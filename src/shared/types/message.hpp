@@ -12,6 +12,7 @@ struct Message {
         OK            = 1,
         ERROR         = 2,
         INIT          = 100,
+        SHM_ATTACH    = 101,
         SYNC_CONFIG   = 200,
         SYNC_SHADER   = 201,
         SYNC_TEXTURE  = 202,
@@ -27,7 +28,8 @@ struct Message {
         RENDER_STATS  = 302,
         RENDER_PAUSE  = 303,
         RENDER_RESUME = 304,
-        RAY           = 400
+        RAY           = 400,
+        RAY_BATCH     = 401
     };
 
     explicit Message(Kind kind);
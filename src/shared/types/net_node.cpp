@@ -5,19 +5,44 @@
 #include <cstring>
 #include <sstream>
 #include <fstream>
+#include <atomic>
+#include <thread>
 
 #include "types.hpp"
 #include "utils/library.hpp"
 #include "utils/network.hpp"
+#include "utils/ray_codec.hpp"
+#include "utils/ray_pool.hpp"
+#include "utils/shm_ring.hpp"
 
 using std::stringstream;
 using std::string;
 using std::unordered_map;
 using std::ofstream;
 using std::endl;
+using std::vector;
+using std::atomic;
+using std::thread;
 
 namespace fr {
 
+struct NetNode::RingReader {
+    /// Wakes the loop when the waiter thread sees new data.
+    uv_async_t async;
+
+    /// The ring being read.
+    ShmRing* ring;
+
+    /// Blocks on the ring so the loop doesn't have to.
+    thread waiter;
+
+    /// Cleared to stop the waiter thread.
+    atomic<bool> running;
+
+    /// The node receiving from the ring, or nullptr once it's gone.
+    NetNode* node;
+};
+
 NetNode::NetNode(DispatchCallback dispatcher, const string& address,
  RenderStats* stats) :
  me(0),
@@ -27,6 +52,7 @@ NetNode::NetNode(DispatchCallback dispatcher, const string& address,
  nread(0),
  nwritten(0),
  flushed(false),
+ buffer(nullptr),
  _dispatcher(dispatcher),
  _materials(),
  _textures(),
@@ -34,7 +60,11 @@ NetNode::NetNode(DispatchCallback dispatcher, const string& address,
  _stats_log(),
  _current_stats(stats),
  _num_uninteresting(0),
- _last_progress(0.0f) {
+ _last_progress(0.0f),
+ _batch_offset(-1),
+ _ring(nullptr),
+ _backlog(),
+ _reader(nullptr) {
     size_t pos = address.find(':');
     if (pos == string::npos) {
         ip = address;
@@ -56,6 +86,7 @@ NetNode::NetNode(DispatchCallback dispatcher, RenderStats* stats) :
  nread(0),
  nwritten(0),
  flushed(false),
+ buffer(nullptr),
  _dispatcher(dispatcher),
  _materials(),
  _textures(),
@@ -63,7 +94,31 @@ NetNode::NetNode(DispatchCallback dispatcher, RenderStats* stats) :
  _stats_log(),
  _current_stats(stats),
  _num_uninteresting(0),
- _last_progress(0.0f) {}
+ _last_progress(0.0f),
+ _batch_offset(-1),
+ _ring(nullptr),
+ _backlog(),
+ _reader(nullptr) {}
+
+NetNode::~NetNode() {
+    if (buffer != nullptr) free(buffer);
+
+    for (auto& chunk : _backlog) {
+        free(chunk.base);
+    }
+    if (_ring != nullptr) delete _ring;
+
+    if (_reader != nullptr) {
+        _reader->running = false;
+        _reader->ring->Wake();
+        _reader->waiter.join();
+        _reader->node = nullptr;
+
+        // The reader goes away once libuv is done with the async handle.
+        uv_close(reinterpret_cast<uv_handle_t*>(&_reader->async),
+         OnRingClosed);
+    }
+}
 
 void NetNode::Receive(const char* buf, ssize_t len) {
     if (buf == nullptr || len <= 0) return;
@@ -91,6 +146,23 @@ void NetNode::Receive(const char* buf, ssize_t len) {
                  static_cast<uintptr_t>(bytes_to_go));
 
                 nread = 0;
+
+                // Rays are decoded straight out of the read buffer when the
+                // whole body is already here.
+                if ((message.kind == Message::Kind::RAY ||
+                     message.kind == Message::Kind::RAY_BATCH) &&
+                    message.size > 0 && message.size <= remaining) {
+                    message.body = const_cast<char*>(from);
+                    _dispatcher(this);
+                    message.body = nullptr;
+
+                    remaining -= message.size;
+                    from = reinterpret_cast<const char*>(
+                     reinterpret_cast<uintptr_t>(from) +
+                     static_cast<uintptr_t>(message.size));
+                    continue;
+                }
+
                 if (message.size > 0) {
                     message.body = malloc(message.size);
                 } else {
@@ -122,7 +194,15 @@ void NetNode::Receive(const char* buf, ssize_t len) {
                  static_cast<uintptr_t>(bytes_to_go));
 
                 nread = 0;
-                _dispatcher(this);
+
+                // Shared memory rings are set up here so the dispatcher
+                // never has to know about them.
+                if (message.kind == Message::Kind::SHM_ATTACH) {
+                    AttachSharedMemory(string(
+                     reinterpret_cast<const char*>(message.body), message.size));
+                } else {
+                    _dispatcher(this);
+                }
 
                 free(message.body);
                 mode = ReadMode::HEADER;
@@ -137,74 +217,132 @@ void NetNode::Receive(const char* buf, ssize_t len) {
 }
 
 void NetNode::Send(const Message& msg) {
-    ssize_t bytes_sent = 0;
-    ssize_t space_left = 0;
+    // Large bodies are handed to the write as their own segment, so they need
+    // a copy we own. Small ones get coalesced into the send buffer.
+    if (msg.size > FR_SEND_COALESCE_MAX) {
+        Message owned(msg);
+        owned.body = malloc(msg.size);
+        memcpy(owned.body, msg.body, msg.size);
+        SendOwned(owned);
+        return;
+    }
 
-    size_t header_size = sizeof(msg.kind) + sizeof(msg.size);
+    Append(msg);
+}
 
-    ssize_t bytes_remaining = header_size;
-    if (nwritten + bytes_remaining > FR_WRITE_BUFFER_SIZE) {
-        Flush();
+void NetNode::SendOwned(const Message& msg) {
+    // Small bodies get coalesced into the send buffer like any other message.
+    if (msg.size <= FR_SEND_COALESCE_MAX) {
+        Append(msg);
+        free(msg.body);
+        return;
     }
 
-    char* to = reinterpret_cast<char*>(
-     reinterpret_cast<uintptr_t>(&buffer) +
-     static_cast<uintptr_t>(nwritten));
+    // Coalesce the header, then write the body in place right behind it.
+    Message header(msg);
+    header.body = nullptr;
+    header.size = 0;
+    Append(header);
 
-    const char* from = reinterpret_cast<const char*>(&msg);
+    // Patch the real body size into the header we just appended.
+    memcpy(buffer + nwritten - sizeof(msg.size), &msg.size, sizeof(msg.size));
 
-    memcpy(to, from, header_size);
-    nwritten += header_size;
+    Write(reinterpret_cast<char*>(msg.body), msg.size);
+}
 
-    while (true) {
-        bytes_remaining = msg.size - bytes_sent;
-        space_left = FR_WRITE_BUFFER_SIZE - nwritten;
-
-        to = reinterpret_cast<char*>(
-         reinterpret_cast<uintptr_t>(&buffer) +
-         static_cast<uintptr_t>(nwritten));
-
-        from = reinterpret_cast<const char*>(
-         reinterpret_cast<uintptr_t>(msg.body) +
-         static_cast<uintptr_t>(bytes_sent));
-
-        if (bytes_remaining <= space_left) {
-            memcpy(to, from, bytes_remaining);
-            nwritten += bytes_remaining;
-            bytes_sent += bytes_remaining;
-            break;
-        }
+void NetNode::Append(const Message& msg) {
+    size_t header_size = sizeof(msg.kind) + sizeof(msg.size);
+    assert(header_size + msg.size <= FR_WRITE_BUFFER_SIZE);
 
-        if (space_left > 0) {
-            memcpy(to, from, space_left);
-            nwritten += space_left;
-            bytes_sent += space_left;
-        }
+    // Any other message closes the open ray batch.
+    _batch_offset = -1;
 
+    if (nwritten + header_size + msg.size > FR_WRITE_BUFFER_SIZE) {
         Flush();
     }
 
+    if (buffer == nullptr) {
+        buffer = reinterpret_cast<char*>(malloc(FR_WRITE_BUFFER_SIZE));
+    }
+
+    memcpy(buffer + nwritten, &msg, header_size);
+    nwritten += header_size;
+
+    if (msg.size > 0) {
+        memcpy(buffer + nwritten, msg.body, msg.size);
+        nwritten += msg.size;
+    }
+}
+
+void NetNode::SendAllOwned(const vector<Message>& messages) {
+    for (const auto& msg : messages) {
+        SendOwned(msg);
+    }
 }
 
 void NetNode::Flush() {
+    Write(nullptr, 0);
+}
+
+void NetNode::Write(char* body, size_t size) {
     int result = 0;
 
-    if (nwritten <= 0) return;
+    // With a shared memory ring, the buffers are copied in as they fit and
+    // anything left over waits for the next flush, so this never blocks on
+    // the other end.
+    if (_ring != nullptr) {
+        if (nwritten > 0) {
+            _backlog.push_back({buffer, static_cast<size_t>(nwritten), 0});
+            buffer = nullptr;
+            nwritten = 0;
+        }
+        if (body != nullptr) {
+            _backlog.push_back({body, size, 0});
+        }
+
+        _batch_offset = -1;
+        PumpRing();
+        flushed = true;
+        return;
+    }
+
+    // Hand the send buffer and the body over to the write. Both get freed
+    // once the write completes.
+    WriteRequest* write =
+     reinterpret_cast<WriteRequest*>(malloc(sizeof(WriteRequest)));
+    int count = 0;
 
-    uv_write_t* req = reinterpret_cast<uv_write_t*>(malloc(sizeof(uv_write_t)));
-    req->data = malloc(FR_WRITE_BUFFER_SIZE);
-    memcpy(req->data, &buffer, nwritten);
+    if (nwritten > 0) {
+        write->bufs[count].base = buffer;
+        write->bufs[count].len = nwritten;
+        count++;
+
+        // A fresh send buffer gets allocated on the next send.
+        buffer = nullptr;
+        nwritten = 0;
+    }
+
+    if (body != nullptr) {
+        write->bufs[count].base = body;
+        write->bufs[count].len = size;
+        count++;
+    }
+
+    _batch_offset = -1;
+
+    if (count == 0) {
+        free(write);
+        return;
+    }
 
-    uv_buf_t buf;
-    buf.base = reinterpret_cast<char*>(req->data);
-    buf.len = nwritten;
+    write->count = count;
+    write->req.data = write;
 
-    result = uv_write(req, reinterpret_cast<uv_stream_t*>(&socket),
-     &buf, 1, AfterFlush);
+    result = uv_write(&write->req, reinterpret_cast<uv_stream_t*>(&socket),
+     write->bufs, count, AfterFlush);
     CheckUVResult(result, "write");
 
     flushed = true;
-    nwritten = 0;
 }
 
 void NetNode::AfterFlush(uv_write_t* req, int status) {
@@ -212,8 +350,115 @@ void NetNode::AfterFlush(uv_write_t* req, int status) {
     assert(req->data != nullptr);
     assert(status == 0);
 
-    free(req->data);
-    free(req);
+    WriteRequest* write = reinterpret_cast<WriteRequest*>(req->data);
+    for (int i = 0; i < write->count; i++) {
+        free(write->bufs[i].base);
+    }
+    free(write);
+}
+
+void NetNode::PumpRing() {
+    assert(_ring != nullptr);
+
+    while (!_backlog.empty()) {
+        RingChunk& chunk = _backlog.front();
+        chunk.offset += _ring->Write(chunk.base + chunk.offset,
+         chunk.len - chunk.offset);
+        if (chunk.offset < chunk.len) break;
+
+        free(chunk.base);
+        _backlog.pop_front();
+    }
+}
+
+bool NetNode::UseSharedMemory(const string& name) {
+    assert(_ring == nullptr);
+
+    ShmRing* ring = ShmRing::Create(name);
+    if (ring == nullptr) return false;
+
+    // This is the last thing to go over the socket, so the other end sees
+    // everything sent before it first.
+    Message request(Message::Kind::SHM_ATTACH);
+    request.size = name.size();
+    request.body = const_cast<char*>(name.data());
+    Send(request);
+    Flush();
+
+    _ring = ring;
+    return true;
+}
+
+void NetNode::AttachSharedMemory(const string& name) {
+    assert(_reader == nullptr);
+
+    int result = 0;
+
+    ShmRing* ring = ShmRing::Open(name);
+    if (ring == nullptr) {
+        TERRLN("Failed attaching to shared memory ring " << name << ".");
+        exit(EXIT_FAILURE);
+    }
+
+    _reader = new RingReader;
+    _reader->ring = ring;
+    _reader->running = true;
+    _reader->node = this;
+
+    // Reads happen on the loop like socket reads do. It shouldn't keep the
+    // loop alive on its own.
+    result = uv_async_init(uv_default_loop(), &_reader->async, OnRingReady);
+    CheckUVResult(result, "async_init");
+    _reader->async.data = _reader;
+    uv_unref(reinterpret_cast<uv_handle_t*>(&_reader->async));
+
+    // The waiter sleeps on the ring and pokes the loop whenever the other
+    // end writes. The other end only pays for the wakeup when it's asleep.
+    RingReader* reader = _reader;
+    _reader->waiter = thread([reader]() {
+        uint32_t seen = 0;
+        while (reader->running) {
+            uint32_t now = reader->ring->Wait(seen, FR_SHM_WAIT_TIMEOUT_MS);
+            if (now != seen) {
+                seen = now;
+                uv_async_send(&reader->async);
+            }
+        }
+    });
+
+    // Anything written before we got here gets picked up on the next loop
+    // iteration, since we're still in the middle of parsing.
+    uv_async_send(&_reader->async);
+}
+
+void NetNode::OnRingReady(uv_async_t* handle, int status) {
+    assert(handle != nullptr);
+    assert(handle->data != nullptr);
+
+    RingReader* reader = reinterpret_cast<RingReader*>(handle->data);
+    NetNode* node = reader->node;
+    if (node == nullptr) return;
+
+    // Async sends get coalesced, so drain everything that's there.
+    const char* data = nullptr;
+    size_t len = 0;
+    while ((len = reader->ring->Peek(&data)) > 0) {
+        node->Receive(data, len);
+        reader->ring->Consume(len);
+
+        if (node->_current_stats != nullptr) {
+            node->_current_stats->bytes_rx += len;
+        }
+    }
+}
+
+void NetNode::OnRingClosed(uv_handle_t* handle) {
+    assert(handle != nullptr);
+    assert(handle->data != nullptr);
+
+    RingReader* reader = reinterpret_cast<RingReader*>(handle->data);
+    delete reader->ring;
+    delete reader;
 }
 
 void NetNode::ReceiveConfig(Library* lib) {
@@ -246,9 +491,9 @@ void NetNode::SendConfig(const Library* lib) {
 
     // Pack the message body.
     request.size = buffer.size();
-    request.body = buffer.data();
+    request.body = buffer.release();
 
-    Send(request);
+    SendOwned(request);
 }
 
 void NetNode::ReceiveCamera(Library* lib) {
@@ -284,9 +529,9 @@ void NetNode::SendCamera(const Library* lib) {
 
     // Pack the message body.
     request.size = buffer.size();
-    request.body = buffer.data();
+    request.body = buffer.release();
 
-    Send(request);
+    SendOwned(request);
 }
 
 void NetNode::ReceiveLightList(Library* lib) {
@@ -319,9 +564,9 @@ void NetNode::SendLightList(const Library* lib) {
 
     // Pack the message body.
     request.size = buffer.size();
-    request.body = buffer.data();
+    request.body = buffer.release();
 
-    Send(request);
+    SendOwned(request);
 }
 
 void NetNode::ReceiveWBVH(Library *lib) {
@@ -351,9 +596,9 @@ void NetNode::SendWBVH(BVH* wbvh) {
 
     // Pack the message body.
     request.size = buffer.size();
-    request.body = buffer.data();
+    request.body = buffer.release();
 
-    Send(request);
+    SendOwned(request);
 }
 
 Image* NetNode::ReceiveImage() {
@@ -385,9 +630,9 @@ void NetNode::SendImage(const Library* lib) {
 
     // Pack the message body.
     request.size = buffer.size();
-    request.body = buffer.data();
+    request.body = buffer.release();
 
-    Send(request);
+    SendOwned(request);
 }
 
 uint32_t NetNode::ReceiveMesh(Library *lib) {
@@ -415,11 +660,28 @@ void NetNode::SendMesh(const Library* lib, uint32_t id) {
     assert(lib != nullptr);
     assert(id > 0);
 
-    Mesh* mesh = lib->LookupMesh(id);
+    vector<Message> messages;
+    PackMesh(lib, lib->LookupMesh(id), &messages);
+    SendAllOwned(messages);
+}
+
+void NetNode::PackMesh(const Library* lib, const Mesh* mesh,
+ vector<Message>* messages) {
+    assert(lib != nullptr);
     assert(mesh != nullptr);
+    assert(messages != nullptr);
 
     // Send the material first.
-    SendMaterial(lib, mesh->material);
+    PackMaterial(lib, mesh->material, messages);
+
+    // Is the mesh emissive? If so, this worker should be in the light list,
+    // unless it's replicated. Every worker samples replicated lights itself.
+    Material* material = lib->LookupMaterial(mesh->material);
+    assert(material != nullptr);
+    if (material->emissive && !mesh->replicate) {
+        LightList* lights = lib->LookupLightList();
+        lights->AddEmissiveWorker(me);
+    }
 
     Message request(Message::Kind::SYNC_MESH);
 
@@ -429,9 +691,9 @@ void NetNode::SendMesh(const Library* lib, uint32_t id) {
 
     // Pack the message body.
     request.size = buffer.size();
-    request.body = buffer.data();
+    request.body = buffer.release();
 
-    Send(request);
+    messages->push_back(request);
 }
 
 uint32_t NetNode::ReceiveMaterial(Library* lib) {
@@ -454,8 +716,16 @@ uint32_t NetNode::ReceiveMaterial(Library* lib) {
 }
 
 void NetNode::SendMaterial(const Library* lib, uint32_t id) {
+    vector<Message> messages;
+    PackMaterial(lib, id, &messages);
+    SendAllOwned(messages);
+}
+
+void NetNode::PackMaterial(const Library* lib, uint32_t id,
+ vector<Message>* messages) {
     assert(lib != nullptr);
     assert(id > 0);
+    assert(messages != nullptr);
 
     // Don't send the material if this node already has it.
     if (_materials.find(id) != _materials.end()) return;
@@ -464,18 +734,11 @@ void NetNode::SendMaterial(const Library* lib, uint32_t id) {
     assert(material != nullptr);
 
     // Send the shader first.
-    SendShader(lib, material->shader);
+    PackShader(lib, material->shader, messages);
 
     // Send each of the textures first.
     for (const auto& kv_pair : material->textures) {
-        SendTexture(lib, kv_pair.second);
-    }
-
-    // Is this material emissive? If so, this worker should be in the light
-    // list.
-    if (material->emissive) {
-        LightList* lights = lib->LookupLightList();
-        lights->AddEmissiveWorker(me);
+        PackTexture(lib, kv_pair.second, messages);
     }
 
     Message request(Message::Kind::SYNC_MATERIAL);
@@ -486,9 +749,9 @@ void NetNode::SendMaterial(const Library* lib, uint32_t id) {
 
     // Pack the message body.
     request.size = buffer.size();
-    request.body = buffer.data();
+    request.body = buffer.release();
 
-    Send(request);
+    messages->push_back(request);
 
     // Mark that this node has this material.
     _materials[id] = true;
@@ -513,8 +776,16 @@ uint32_t NetNode::ReceiveTexture(Library *lib) {
 }
 
 void NetNode::SendTexture(const Library* lib, uint32_t id) {
+    vector<Message> messages;
+    PackTexture(lib, id, &messages);
+    SendAllOwned(messages);
+}
+
+void NetNode::PackTexture(const Library* lib, uint32_t id,
+ vector<Message>* messages) {
     assert(lib != nullptr);
     assert(id > 0);
+    assert(messages != nullptr);
 
     // Don't send the texture if this node already has it.
     if (_textures.find(id) != _textures.end()) return;
@@ -530,9 +801,9 @@ void NetNode::SendTexture(const Library* lib, uint32_t id) {
 
     // Pack the message body.
     request.size = buffer.size();
-    request.body = buffer.data();
+    request.body = buffer.release();
 
-    Send(request);
+    messages->push_back(request);
 
     // Mark that this node has this texture.
     _textures[id] = true;
@@ -558,8 +829,16 @@ uint32_t NetNode::ReceiveShader(Library *lib) {
 }
 
 void NetNode::SendShader(const Library* lib, uint32_t id) {
+    vector<Message> messages;
+    PackShader(lib, id, &messages);
+    SendAllOwned(messages);
+}
+
+void NetNode::PackShader(const Library* lib, uint32_t id,
+ vector<Message>* messages) {
     assert(lib != nullptr);
     assert(id > 0);
+    assert(messages != nullptr);
 
     // Don't send the shader if this node already has it.
     if (_shaders.find(id) != _shaders.end()) return;
@@ -575,20 +854,22 @@ void NetNode::SendShader(const Library* lib, uint32_t id) {
 
     // Pack the message body.
     request.size = buffer.size();
-    request.body = buffer.data();
+    request.body = buffer.release();
 
-    Send(request);
+    messages->push_back(request);
 
     // Mark that this node has this shader.
     _shaders[id] = true;
 }
 
 FatRay* NetNode::ReceiveRay() {
-    assert(message.size == sizeof(FatRay));
+    assert(message.size > 0);
 
-    // Forgo safe deserialization for speed.
-    FatRay* ray = new FatRay;
-    memcpy(ray, message.body, sizeof(FatRay));
+    FatRay* ray = RayPool::New();
+    if (DecodeRay(message.body, message.size, ray) != message.size) {
+        TERRLN("Received malformed ray or mismatched ray codec version.");
+        exit(EXIT_FAILURE);
+    }
 
     if (_current_stats != nullptr) {
         _current_stats->rays_rx++;
@@ -598,17 +879,90 @@ FatRay* NetNode::ReceiveRay() {
 }
 
 void NetNode::SendRay(FatRay* ray) {
-    Message msg(Message::Kind::RAY);
+    size_t header_size = sizeof(message.kind) + sizeof(message.size);
+
+    // Start a new batch if there isn't one open or it can't fit the ray.
+    if (_batch_offset < 0 ||
+        nwritten + FR_RAY_CODEC_MAX_SIZE > FR_WRITE_BUFFER_SIZE) {
+        if (nwritten + header_size + sizeof(uint32_t) +
+            FR_RAY_CODEC_MAX_SIZE > FR_WRITE_BUFFER_SIZE) {
+            Flush();
+        }
+
+        if (buffer == nullptr) {
+            buffer = reinterpret_cast<char*>(malloc(FR_WRITE_BUFFER_SIZE));
+        }
+
+        Message msg(Message::Kind::RAY_BATCH);
+        msg.size = sizeof(uint32_t);
+        memcpy(buffer + nwritten, &msg, header_size);
+
+        uint32_t count = 0;
+        memcpy(buffer + nwritten + header_size, &count, sizeof(uint32_t));
+
+        _batch_offset = nwritten;
+        nwritten += header_size + sizeof(uint32_t);
+    }
 
-    // Forgo safe serialization for speed.
-    msg.size = sizeof(FatRay);
-    msg.body = ray;
+    // Encode the ray right into the send buffer and grow the open batch's
+    // size and count in place.
+    uint32_t size = EncodeRay(ray, buffer + nwritten);
+    nwritten += size;
+
+    char* header = buffer + _batch_offset;
+    uint32_t batch_size = 0;
+    memcpy(&batch_size, header + sizeof(message.kind), sizeof(uint32_t));
+    batch_size += size;
+    memcpy(header + sizeof(message.kind), &batch_size, sizeof(uint32_t));
+
+    uint32_t count = 0;
+    memcpy(&count, header + header_size, sizeof(uint32_t));
+    count++;
+    memcpy(header + header_size, &count, sizeof(uint32_t));
 
     if (_current_stats != nullptr) {
         _current_stats->rays_tx++;
     }
+}
+
+FatRay* NetNode::ReceiveRayBatch() {
+    assert(message.size >= sizeof(uint32_t));
+
+    const char* from = reinterpret_cast<const char*>(message.body);
+    size_t remaining = message.size;
+
+    uint32_t count = 0;
+    memcpy(&count, from, sizeof(uint32_t));
+    from += sizeof(uint32_t);
+    remaining -= sizeof(uint32_t);
+
+    // Decode each ray into the pool and chain them together.
+    FatRay* head = nullptr;
+    FatRay* tail = nullptr;
+    for (uint32_t i = 0; i < count; i++) {
+        FatRay* ray = RayPool::New();
+        size_t size = DecodeRay(from, remaining, ray);
+        if (size == 0) {
+            TERRLN("Received malformed ray batch or mismatched ray codec version.");
+            exit(EXIT_FAILURE);
+        }
+        from += size;
+        remaining -= size;
 
-    Send(msg);
+        if (tail != nullptr) {
+            tail->next = ray;
+        } else {
+            head = ray;
+        }
+        tail = ray;
+    }
+    assert(remaining == 0);
+
+    if (_current_stats != nullptr) {
+        _current_stats->rays_rx += count;
+    }
+
+    return head;
 }
 
 void NetNode::ReceiveRenderStats() {
@@ -659,9 +1013,9 @@ void NetNode::SendRenderStats(RenderStats* stats) {
 
     // Pack the message body.
     request.size = buffer.size();
-    request.body = buffer.data();
+    request.body = buffer.release();
 
-    Send(request);
+    SendOwned(request);
 }
 
 bool NetNode::IsInteresting(uint32_t intervals) {
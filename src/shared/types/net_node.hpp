@@ -4,21 +4,32 @@
 #include <string>
 #include <unordered_map>
 #include <deque>
+#include <vector>
 
 #include "uv.h"
 
 #include "types/message.hpp"
 
-/// The size of the static write buffer (for this node).
+/// The size of each write buffer that small messages get coalesced into.
 #define FR_WRITE_BUFFER_SIZE 65536
 
+/// Message bodies larger than this are written in place as their own
+/// segment instead of being copied into the write buffer.
+#define FR_SEND_COALESCE_MAX 4096
+
+/// How long the shared memory reader thread sleeps between checks for a
+/// producer that died without waking it.
+#define FR_SHM_WAIT_TIMEOUT_MS 100
+
 namespace fr {
 
 class Library;
 class Image;
 class BVH;
+struct Mesh;
 struct FatRay;
 struct RenderStats;
+class ShmRing;
 
 class NetNode {
 public:
@@ -48,6 +59,8 @@ public:
      RenderStats* stats = nullptr);
     explicit NetNode(DispatchCallback dispatcher, RenderStats* stats = nullptr);
 
+    ~NetNode();
+
     /// The resource ID of this net node.
     uint32_t me;
 
@@ -78,16 +91,25 @@ public:
     /// True if the write buffer has been flushed recently.
     bool flushed;
 
-    /// The static write buffer for sending data to this net node.
-    char buffer[FR_WRITE_BUFFER_SIZE];
+    /// The write buffer small messages are coalesced into. Ownership passes
+    /// to libuv when it's flushed, and a new one is allocated on demand.
+    char* buffer;
 
     /// Receives the given chunk of bytes, parses out messages, and dispatches
     /// them using the dispatcher callback.
     void Receive(const char* buf, ssize_t len);
 
-    /// Appends the given message to the send buffer.
+    /// Appends the given message to the send buffer. Large bodies are copied
+    /// once and written as their own segment.
     void Send(const Message& msg);
 
+    /// Like Send(), but takes ownership of the malloc'd message body, so large
+    /// bodies are written in place without any copies.
+    void SendOwned(const Message& msg);
+
+    /// Sends each of the messages with SendOwned().
+    void SendAllOwned(const std::vector<Message>& messages);
+
     /// Receives the message in the net node's buffer as a config.
     void ReceiveConfig(Library* lib);
 
@@ -125,6 +147,17 @@ public:
     /// Sends the given mesh (and its dependent assets) to this node.
     void SendMesh(const Library* lib, uint32_t id);
 
+    /**
+     * Serializes the given mesh, preceded by any of its dependent assets this
+     * node hasn't been sent yet, into messages with malloc'd bodies for
+     * sending later with SendAllOwned(). The assets are marked as sent to this
+     * node. This touches no network state, so it may run off the loop thread
+     * as long as nothing else is sending assets to this node at the same
+     * time.
+     */
+    void PackMesh(const Library* lib, const Mesh* mesh,
+     std::vector<Message>* messages);
+
     /// Receives the message in the net node's buffer as a material.
     uint32_t ReceiveMaterial(Library* lib);
 
@@ -146,9 +179,14 @@ public:
     /// Receives the message in the net node's buffer as a freshly allocated ray.
     FatRay* ReceiveRay();
 
-    /// Sends the given ray to this node.
+    /// Sends the given ray to this node. Consecutive rays are packed into a
+    /// single RAY_BATCH message in the send buffer.
     void SendRay(FatRay* ray);
 
+    /// Receives the message in the net node's buffer as a batch of freshly
+    /// allocated rays, chained together through their next pointers.
+    FatRay* ReceiveRayBatch();
+
     /// Receives the message in the net node's buffer as a freshly allocated 
     /// render stats.
     void ReceiveRenderStats();
@@ -159,6 +197,21 @@ public:
     /// Flushes the send buffer, forcing all buffered messages to be written.
     void Flush();
 
+    /**
+     * Switches everything sent to this node from now on over to a shared
+     * memory ring with the given name, for nodes on the same host. The ring
+     * is announced over the socket, and the other end picks it up in
+     * Receive() without the dispatcher ever seeing it. Returns false (and
+     * keeps using the socket) if the ring couldn't be created.
+     */
+    bool UseSharedMemory(const std::string& name);
+
+    /// Are sends to this node going through shared memory?
+    inline bool IsSharedMemory() const { return _ring != nullptr; }
+
+    /// Are there flushed sends waiting for room in the shared memory ring?
+    inline bool IsBacklogged() const { return !_backlog.empty(); }
+
     /// Has this net node been interesting in the last intervals intervals?
     bool IsInteresting(uint32_t intervals);
 
@@ -188,9 +241,70 @@ private:
     RenderStats* _current_stats;
     uint32_t _num_uninteresting;
     float _last_progress;
+    ssize_t _batch_offset;
+
+    /// A flushed buffer still being copied into the shared memory ring.
+    struct RingChunk {
+        char* base;
+        size_t len;
+        size_t offset;
+    };
+
+    /// Reads a shared memory ring on the loop, see AttachSharedMemory().
+    struct RingReader;
+
+    /// The ring sends go through, or nullptr if they go over the socket.
+    ShmRing* _ring;
+
+    /// Flushed buffers that didn't fit in the ring yet, oldest first.
+    std::deque<RingChunk> _backlog;
+
+    /// The reader for the ring the other end sends through, if any.
+    RingReader* _reader;
+    /// A vectored write of the write buffer and/or a large message body.
+    struct WriteRequest {
+        uv_write_t req;
+        uv_buf_t bufs[2];
+        int count;
+    };
+
+    /// Serializes the given material (and its dependent assets) into messages
+    /// if this node doesn't have it yet.
+    void PackMaterial(const Library* lib, uint32_t id,
+     std::vector<Message>* messages);
+
+    /// Serializes the given texture into a message if this node doesn't have
+    /// it yet.
+    void PackTexture(const Library* lib, uint32_t id,
+     std::vector<Message>* messages);
+
+    /// Serializes the given shader into a message if this node doesn't have
+    /// it yet.
+    void PackShader(const Library* lib, uint32_t id,
+     std::vector<Message>* messages);
+
+    /// Copies the given message into the write buffer.
+    void Append(const Message& msg);
+
+    /// Writes out the write buffer, followed by the given body (if any), and
+    /// takes ownership of both.
+    void Write(char* body, size_t size);
 
     /// Post-write callback from libuv.
     static void AfterFlush(uv_write_t* req, int status);
+
+    /// Copies as much of the backlog into the shared memory ring as fits.
+    void PumpRing();
+
+    /// Maps the shared memory ring with the given name and starts receiving
+    /// everything the other end sends from it.
+    void AttachSharedMemory(const std::string& name);
+
+    /// Async callback that receives whatever is in the ring.
+    static void OnRingReady(uv_async_t* handle, int status);
+
+    /// Close callback that frees the ring reader.
+    static void OnRingClosed(uv_handle_t* handle);
 };
 
 } // namespace fr
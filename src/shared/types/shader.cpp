@@ -5,6 +5,7 @@
 #include <sstream>
 
 #include "scripting/shader_script.hpp"
+#include "utils/thread_slot.hpp"
 
 using std::numeric_limits;
 using std::string;
@@ -16,27 +17,45 @@ namespace fr {
 Shader::Shader(uint32_t id) :
  id(id),
  code(""),
- script(nullptr) {}
+ builtin(""),
+ params(),
+ scripts(FR_MAX_THREAD_SLOTS, nullptr) {}
 
 Shader::Shader(uint32_t id, const string& code) :
  id(id),
  code(code),
- script(nullptr) {}
+ builtin(""),
+ params(),
+ scripts(FR_MAX_THREAD_SLOTS, nullptr) {}
 
 Shader::Shader() :
  code(""),
- script(nullptr) {
+ builtin(""),
+ params(),
+ scripts(FR_MAX_THREAD_SLOTS, nullptr) {
     id = numeric_limits<uint32_t>::max(); 
 }
 
 Shader::~Shader() {
-    if (script != nullptr) delete script;
+    for (auto script : scripts) {
+        if (script != nullptr) delete script;
+    }
+}
+
+ShaderScript* Shader::Script(const Library* lib) {
+    // Each slot is only ever touched by the thread that owns it.
+    ShaderScript*& script = scripts[ThreadSlot()];
+    if (script == nullptr) {
+        script = new ShaderScript(this, lib);
+    }
+    return script;
 }
 
 string ToString(const Shader& shader, const string& indent) {
     stringstream stream;
     stream << "Shader {" << endl <<
      indent << "| id = " << shader.id << endl <<
+     indent << "| builtin = " << shader.builtin << endl <<
      indent << "| code = ..." << endl <<
 "======================================================================" << endl <<
 shader.code << endl <<
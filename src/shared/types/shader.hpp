@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
 
 #include "msgpack.hpp"
 
@@ -9,6 +10,7 @@
 namespace fr {
 
 class ShaderScript;
+class Library;
 
 struct Shader {
     explicit Shader(uint32_t id);
@@ -26,12 +28,22 @@ struct Shader {
     /// The code we run for the shader.
     std::string code;
 
-    MSGPACK_DEFINE(id, code);
+    /// The name of the native shader to run instead of the code, if any.
+    std::string builtin;
+
+    /// Packed parameters for the built-in shader.
+    std::vector<float> params;
+
+    MSGPACK_DEFINE(id, code, builtin, params);
 
     TOSTRINGABLE(Shader);
 
-    /// The shader script we actually execute.
-    ShaderScript* script;
+    /// Returns the calling thread's own instance of the shader script,
+    /// interpreting the code the first time the thread asks for it.
+    ShaderScript* Script(const Library* lib);
+
+    /// The shader scripts we actually execute, indexed by thread slot.
+    std::vector<ShaderScript*> scripts;
 };
 
 std::string ToString(const Shader& shader, const std::string& indent = "");
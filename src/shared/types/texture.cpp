@@ -6,6 +6,7 @@
 #include <sstream>
 
 #include "scripting/texture_script.hpp"
+#include "utils/thread_slot.hpp"
 
 using std::numeric_limits;
 using std::string;
@@ -22,7 +23,7 @@ Texture::Texture(uint32_t id) :
  height(0),
  code(""),
  image(),
- script(nullptr) {}
+ scripts(FR_MAX_THREAD_SLOTS, nullptr) {}
 
 Texture::Texture(uint32_t id, const string& code) :
  id(id),
@@ -31,7 +32,7 @@ Texture::Texture(uint32_t id, const string& code) :
  height(0),
  code(code),
  image(),
- script(nullptr) {}
+ scripts(FR_MAX_THREAD_SLOTS, nullptr) {}
 
 Texture::Texture(uint32_t id, int16_t width, int16_t height, const float* data) :
  id(id),
@@ -39,7 +40,7 @@ Texture::Texture(uint32_t id, int16_t width, int16_t height, const float* data)
  width(width),
  height(height),
  code(""),
- script(nullptr) {
+ scripts(FR_MAX_THREAD_SLOTS, nullptr) {
     image.resize(sizeof(float) * width * height);
     memcpy(&image[0], data, sizeof(float) * width * height);
 }
@@ -50,16 +51,31 @@ Texture::Texture() :
  height(0),
  code(""),
  image(),
- script(nullptr) {
+ scripts(FR_MAX_THREAD_SLOTS, nullptr) {
     id = numeric_limits<uint32_t>::max();
 }
 
+Texture::~Texture() {
+    for (auto script : scripts) {
+        if (script != nullptr) delete script;
+    }
+}
+
+TextureScript* Texture::Script() {
+    // Each slot is only ever touched by the thread that owns it.
+    TextureScript*& script = scripts[ThreadSlot()];
+    if (script == nullptr) {
+        script = new TextureScript(code);
+    }
+    return script;
+}
+
 float Texture::Sample(vec2 texcoord) {
     float value = 0.0f;
 
     switch (kind) {
         case Kind::PROCEDURAL:
-            value = script->Evaluate(texcoord);
+            value = Script()->Evaluate(texcoord);
             break;
 
         case Kind::IMAGE:
@@ -28,6 +28,8 @@ struct Texture {
     // FOR MSGPACK ONLY!
     explicit Texture();
 
+    ~Texture();
+
     /// Resource ID of the texture.
     uint32_t id;
 
@@ -53,8 +55,13 @@ struct Texture {
 
     TOSTRINGABLE(Texture);
 
-    /// The texture script we actually execute (if procedural).
-    TextureScript* script;
+    /// Returns the calling thread's own instance of the texture script,
+    /// interpreting the code the first time the thread asks for it.
+    TextureScript* Script();
+
+    /// The texture scripts we actually execute (if procedural), indexed by
+    /// thread slot.
+    std::vector<TextureScript*> scripts;
 
 private:
     /// Samples the image data at texture coordinates <u, v>
@@ -67,17 +67,14 @@ BoundingBox Triangle::WorldBounds(const vector<Vertex>& vertices,
     return bounds;
 }
 
-bool Triangle::Intersect(const vector<Vertex>& vertices, const SlimRay& ray,
- float* t, LocalGeometry* local) const {
+/// Computes the ray parameter and barycentric coordinates of the ray's
+/// intersection with the triangle at v1 with edges e1 and e2. Returns false if
+/// they don't intersect.
+static inline bool IntersectBarycentric(vec3 v1, vec3 e1, vec3 e2,
+ const SlimRay& ray, float* t, float* b1_out, float* b2_out) {
     // Credit: Physically Based Rendering, page 141, with modifications.
-    
-    vec3 v1 = vertices[verts[0]].v;
-    vec3 v2 = vertices[verts[1]].v;
-    vec3 v3 = vertices[verts[2]].v;
 
-    // First compute s1, edge vectors, and denominator.
-    vec3 e1 = v2 - v1;
-    vec3 e2 = v3 - v1;
+    // First compute s1 and the denominator.
     vec3 s1 = cross(ray.direction, e2);
     float divisor = dot(s1, e1);
     if (divisor == 0.0f) {
@@ -107,22 +104,67 @@ bool Triangle::Intersect(const vector<Vertex>& vertices, const SlimRay& ray,
         return false;
     }
 
-    // Compute the interpolated normal from the barycentric coordinates.
-    local->n = InterpolateNormal(vertices, b1, b2);
+    *b1_out = b1;
+    *b2_out = b2;
+    return true;
+}
+
+bool Triangle::Hit(const vector<Vertex>& vertices, const SlimRay& ray,
+ float* t, float* u, float* v) const {
+    vec3 v1 = vertices[verts[0]].v;
+    vec3 v2 = vertices[verts[1]].v;
+    vec3 v3 = vertices[verts[2]].v;
+
+    return IntersectBarycentric(v1, v2 - v1, v3 - v1, ray, t, u, v);
+}
+
+bool Triangle::Intersect(const vector<Vertex>& vertices, const SlimRay& ray,
+ float* t, LocalGeometry* local) const {
+    float b1 = 0.0f;
+    float b2 = 0.0f;
+    if (!Hit(vertices, ray, t, &b1, &b2)) {
+        return false;
+    }
 
     // Check the interpolated normal against the ray normal to cull back-facing
     // intersections.
-    if (dot(local->n, ray.direction) > 0.0f) {
+    if (!FacesAgainst(vertices, ray.direction, b1, b2)) {
         return false;
     }
 
-    // Compute the interpolated texture coordinate from the barycentric coords.
-    local->t = InterpolateTexCoord(vertices, b1, b2);
-
-    // Intersection succeeded.
+    // Intersection succeeded, so interpolate the local geometry.
+    Interpolate(vertices, b1, b2, local);
     return true;
 }
 
+bool Triangle::Occludes(const vector<Vertex>& vertices, const SlimRay& ray,
+ float max_t) const {
+    float t = 0.0f;
+    float b1 = 0.0f;
+    float b2 = 0.0f;
+    if (!Hit(vertices, ray, &t, &b1, &b2) || t >= max_t) {
+        return false;
+    }
+
+    // Cull back-facing intersections just like Intersect does.
+    return FacesAgainst(vertices, ray.direction, b1, b2);
+}
+
+bool Triangle::FacesAgainst(const vector<Vertex>& vertices, vec3 direction,
+ float u, float v) const {
+    // The normal doesn't need normalizing to check its direction.
+    float w = 1.0f - u - v;
+    vec3 n = w * vertices[verts[0]].n + u * vertices[verts[1]].n +
+     v * vertices[verts[2]].n;
+    return dot(n, direction) <= 0.0f;
+}
+
+void Triangle::Interpolate(const vector<Vertex>& vertices, float u, float v,
+ LocalGeometry* local) const {
+    local->n = InterpolateNormal(vertices, u, v);
+    local->t = InterpolateTexCoord(vertices, u, v);
+}
+
 vec3 Triangle::InterpolatePosition(const vector<Vertex>& vertices, float u,
  float v) const {
     vec3 v1 = vertices[verts[0]].v;
@@ -48,6 +48,35 @@ struct Triangle {
     bool Intersect(const std::vector<Vertex>& vertices,
      const SlimRay& ray, float* t, LocalGeometry* local) const;
 
+    /**
+     * Returns true if the given ray hits the front of this triangle before
+     * max_t. Cheaper than Intersect, since the texture coordinate is never
+     * interpolated and the normal is only used for back-face culling.
+     */
+    bool Occludes(const std::vector<Vertex>& vertices,
+     const SlimRay& ray, float max_t) const;
+
+    /**
+     * Finds where the given ray hits this triangle, without culling back
+     * faces or interpolating anything. Returns true if they intersect, and
+     * fills in the ray parameter and the barycentric coordinates <u, v> of
+     * the hit.
+     */
+    bool Hit(const std::vector<Vertex>& vertices, const SlimRay& ray,
+     float* t, float* u, float* v) const;
+
+    /// Returns true if the (unnormalized) interpolated normal at the
+    /// barycentric coordinates <u, v, 1 - u - v> faces against the direction.
+    /// This is all back-face culling needs, so the normal is never normalized.
+    bool FacesAgainst(const std::vector<Vertex>& vertices, glm::vec3 direction,
+     float u, float v) const;
+
+    /// Fills in the local geometry (normal and texture coordinates) at the
+    /// barycentric coordinates <u, v, 1 - u - v>. Only worth doing once the
+    /// nearest hit is known.
+    void Interpolate(const std::vector<Vertex>& vertices, float u, float v,
+     LocalGeometry* local) const;
+
     MSGPACK_DEFINE(verts[0], verts[1], verts[2]);
 
     TOSTRINGABLE(Triangle);
@@ -0,0 +1,70 @@
+#include "types/triangle_block.hpp"
+
+#if FR_AVX_DISPATCH
+#include <immintrin.h>
+#endif
+
+namespace fr {
+
+#if FR_AVX_DISPATCH
+template <>
+__attribute__((target("avx")))
+uint32_t IntersectBlock<8>(const TriangleBlock<8>& block, const SlimRay& ray,
+ uint32_t mask, float max_t, float* t, float* b1, float* b2) {
+    __m256 dx = _mm256_set1_ps(ray.direction.x);
+    __m256 dy = _mm256_set1_ps(ray.direction.y);
+    __m256 dz = _mm256_set1_ps(ray.direction.z);
+
+    __m256 e1x = _mm256_loadu_ps(block.e1_x);
+    __m256 e1y = _mm256_loadu_ps(block.e1_y);
+    __m256 e1z = _mm256_loadu_ps(block.e1_z);
+    __m256 e2x = _mm256_loadu_ps(block.e2_x);
+    __m256 e2y = _mm256_loadu_ps(block.e2_y);
+    __m256 e2z = _mm256_loadu_ps(block.e2_z);
+
+    // s1 = cross(direction, e2), divisor = dot(s1, e1)
+    __m256 s1x = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 s1y = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 s1z = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 divisor = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(s1x, e1x),
+     _mm256_mul_ps(s1y, e1y)), _mm256_mul_ps(s1z, e1z));
+    __m256 inv_divisor = _mm256_div_ps(_mm256_set1_ps(1.0f), divisor);
+
+    // d = origin - v1, b1 = dot(d, s1) / divisor
+    __m256 ddx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(block.v1_x));
+    __m256 ddy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(block.v1_y));
+    __m256 ddz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(block.v1_z));
+    __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ddx, s1x),
+     _mm256_mul_ps(ddy, s1y)), _mm256_mul_ps(ddz, s1z)), inv_divisor);
+
+    // s2 = cross(d, e1), b2 = dot(direction, s2) / divisor
+    __m256 s2x = _mm256_sub_ps(_mm256_mul_ps(ddy, e1z), _mm256_mul_ps(ddz, e1y));
+    __m256 s2y = _mm256_sub_ps(_mm256_mul_ps(ddz, e1x), _mm256_mul_ps(ddx, e1z));
+    __m256 s2z = _mm256_sub_ps(_mm256_mul_ps(ddx, e1y), _mm256_mul_ps(ddy, e1x));
+    __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, s2x),
+     _mm256_mul_ps(dy, s2y)), _mm256_mul_ps(dz, s2z)), inv_divisor);
+
+    // t = dot(e2, s2) / divisor
+    __m256 tt = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, s2x),
+     _mm256_mul_ps(e2y, s2y)), _mm256_mul_ps(e2z, s2z)), inv_divisor);
+
+    // Ordered comparisons against NaN (from a zero divisor) are all false.
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 valid = _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ),
+     _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid,
+     _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+    valid = _mm256_and_ps(valid,
+     _mm256_cmp_ps(tt, _mm256_set1_ps(SELF_INTERSECT_EPSILON), _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid,
+     _mm256_cmp_ps(tt, _mm256_set1_ps(max_t), _CMP_LT_OQ));
+
+    _mm256_storeu_ps(t, tt);
+    _mm256_storeu_ps(b1, u);
+    _mm256_storeu_ps(b2, v);
+    return _mm256_movemask_ps(valid) & mask;
+}
+#endif
+
+} // namespace fr
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__SSE2__)
+#include <xmmintrin.h>
+#endif
+
+#include "glm/glm.hpp"
+
+#include "types/slim_ray.hpp"
+#include "utils/simd.hpp"
+
+namespace fr {
+
+/**
+ * Width triangles baked into world space, stored as a structure of arrays so
+ * a ray can be tested against all of them at once. Each triangle is its
+ * first vertex and the edges from it to the other two. Unused lanes are left
+ * zeroed, which never intersects anything.
+ */
+template <uint32_t Width>
+struct TriangleBlock {
+    float v1_x[Width];
+    float v1_y[Width];
+    float v1_z[Width];
+    float e1_x[Width];
+    float e1_y[Width];
+    float e1_z[Width];
+    float e2_x[Width];
+    float e2_y[Width];
+    float e2_z[Width];
+
+    /// Stores the triangle with the given world space vertices in a lane.
+    inline void Set(uint32_t lane, glm::vec3 v1, glm::vec3 v2, glm::vec3 v3) {
+        glm::vec3 e1 = v2 - v1;
+        glm::vec3 e2 = v3 - v1;
+        v1_x[lane] = v1.x;
+        v1_y[lane] = v1.y;
+        v1_z[lane] = v1.z;
+        e1_x[lane] = e1.x;
+        e1_y[lane] = e1.y;
+        e1_z[lane] = e1.z;
+        e2_x[lane] = e2.x;
+        e2_y[lane] = e2.y;
+        e2_z[lane] = e2.z;
+    }
+};
+
+/**
+ * Intersects the ray with the triangles in the lanes set in mask. Returns a
+ * mask of the lanes hit between SELF_INTERSECT_EPSILON and max_t, and fills
+ * in their ray parameter and barycentric coordinates. No back-face culling is
+ * done, since that needs the vertex normals.
+ */
+template <uint32_t Width>
+inline uint32_t IntersectBlock(const TriangleBlock<Width>& block,
+ const SlimRay& ray, uint32_t mask, float max_t, float* t, float* b1,
+ float* b2) {
+    // Credit: Physically Based Rendering, page 141, one lane at a time.
+    uint32_t hits = 0;
+    for (uint32_t i = 0; i < Width; i++) {
+        if (!(mask & (1 << i))) continue;
+
+        glm::vec3 v1(block.v1_x[i], block.v1_y[i], block.v1_z[i]);
+        glm::vec3 e1(block.e1_x[i], block.e1_y[i], block.e1_z[i]);
+        glm::vec3 e2(block.e2_x[i], block.e2_y[i], block.e2_z[i]);
+
+        glm::vec3 s1 = glm::cross(ray.direction, e2);
+        float divisor = glm::dot(s1, e1);
+        if (divisor == 0.0f) continue;
+        float inv_divisor = 1.0f / divisor;
+
+        glm::vec3 d = ray.origin - v1;
+        b1[i] = glm::dot(d, s1) * inv_divisor;
+        if (b1[i] < 0.0f || b1[i] > 1.0f) continue;
+
+        glm::vec3 s2 = glm::cross(d, e1);
+        b2[i] = glm::dot(ray.direction, s2) * inv_divisor;
+        if (b2[i] < 0.0f || b1[i] + b2[i] > 1.0f) continue;
+
+        t[i] = glm::dot(e2, s2) * inv_divisor;
+        if (t[i] < SELF_INTERSECT_EPSILON || t[i] >= max_t) continue;
+
+        hits |= 1 << i;
+    }
+    return hits;
+}
+
+#if defined(__SSE2__)
+/// Intersects all four triangles at once with SSE.
+template <>
+inline uint32_t IntersectBlock<4>(const TriangleBlock<4>& block,
+ const SlimRay& ray, uint32_t mask, float max_t, float* t, float* b1,
+ float* b2) {
+    __m128 dx = _mm_set1_ps(ray.direction.x);
+    __m128 dy = _mm_set1_ps(ray.direction.y);
+    __m128 dz = _mm_set1_ps(ray.direction.z);
+
+    __m128 e1x = _mm_loadu_ps(block.e1_x);
+    __m128 e1y = _mm_loadu_ps(block.e1_y);
+    __m128 e1z = _mm_loadu_ps(block.e1_z);
+    __m128 e2x = _mm_loadu_ps(block.e2_x);
+    __m128 e2y = _mm_loadu_ps(block.e2_y);
+    __m128 e2z = _mm_loadu_ps(block.e2_z);
+
+    // s1 = cross(direction, e2), divisor = dot(s1, e1)
+    __m128 s1x = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 s1y = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 s1z = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 divisor = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s1x, e1x),
+     _mm_mul_ps(s1y, e1y)), _mm_mul_ps(s1z, e1z));
+    __m128 inv_divisor = _mm_div_ps(_mm_set1_ps(1.0f), divisor);
+
+    // d = origin - v1, b1 = dot(d, s1) / divisor
+    __m128 ddx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(block.v1_x));
+    __m128 ddy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(block.v1_y));
+    __m128 ddz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(block.v1_z));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ddx, s1x),
+     _mm_mul_ps(ddy, s1y)), _mm_mul_ps(ddz, s1z)), inv_divisor);
+
+    // s2 = cross(d, e1), b2 = dot(direction, s2) / divisor
+    __m128 s2x = _mm_sub_ps(_mm_mul_ps(ddy, e1z), _mm_mul_ps(ddz, e1y));
+    __m128 s2y = _mm_sub_ps(_mm_mul_ps(ddz, e1x), _mm_mul_ps(ddx, e1z));
+    __m128 s2z = _mm_sub_ps(_mm_mul_ps(ddx, e1y), _mm_mul_ps(ddy, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, s2x),
+     _mm_mul_ps(dy, s2y)), _mm_mul_ps(dz, s2z)), inv_divisor);
+
+    // t = dot(e2, s2) / divisor
+    __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, s2x),
+     _mm_mul_ps(e2y, s2y)), _mm_mul_ps(e2z, s2z)), inv_divisor);
+
+    // Comparisons against NaN (from a zero divisor) are all false.
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 valid = _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(tt, _mm_set1_ps(SELF_INTERSECT_EPSILON)));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(tt, _mm_set1_ps(max_t)));
+
+    _mm_storeu_ps(t, tt);
+    _mm_storeu_ps(b1, u);
+    _mm_storeu_ps(b2, v);
+    return _mm_movemask_ps(valid) & mask;
+}
+#endif
+
+#if FR_AVX_DISPATCH
+/// Intersects all eight triangles at once with AVX. Only call this when the
+/// CPU supports AVX. Compilers that can't build it (see FR_AVX_DISPATCH) get
+/// the generic version instead.
+template <>
+uint32_t IntersectBlock<8>(const TriangleBlock<8>& block, const SlimRay& ray,
+ uint32_t mask, float max_t, float* t, float* b1, float* b2);
+#endif
+
+} // namespace fr
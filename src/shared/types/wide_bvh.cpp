@@ -0,0 +1,156 @@
+#include "types/wide_bvh.hpp"
+
+#include <cstdlib>
+#include <cassert>
+#include <iostream>
+#include <sstream>
+
+#if FR_AVX_DISPATCH
+#include <immintrin.h>
+#endif
+
+#include "utils/tout.hpp"
+
+using std::vector;
+using std::string;
+using std::stringstream;
+using std::endl;
+using glm::vec3;
+
+namespace fr {
+
+#if FR_AVX_DISPATCH
+template <>
+__attribute__((target("avx")))
+uint32_t IntersectChildren<8>(const WideNode<8>& node,
+ vec3 origin, vec3 inv_dir, float max_t, float* t) {
+    __m256 ox = _mm256_set1_ps(origin.x);
+    __m256 oy = _mm256_set1_ps(origin.y);
+    __m256 oz = _mm256_set1_ps(origin.z);
+    __m256 ix = _mm256_set1_ps(inv_dir.x);
+    __m256 iy = _mm256_set1_ps(inv_dir.y);
+    __m256 iz = _mm256_set1_ps(inv_dir.z);
+
+    __m256 x0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.min_x), ox), ix);
+    __m256 x1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.max_x), ox), ix);
+    __m256 y0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.min_y), oy), iy);
+    __m256 y1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.max_y), oy), iy);
+    __m256 z0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.min_z), oz), iz);
+    __m256 z1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.max_z), oz), iz);
+
+    __m256 t_near = _mm256_max_ps(
+     _mm256_max_ps(_mm256_min_ps(x0, x1), _mm256_min_ps(y0, y1)),
+     _mm256_max_ps(_mm256_min_ps(z0, z1), _mm256_setzero_ps()));
+    __m256 t_far = _mm256_min_ps(
+     _mm256_min_ps(_mm256_max_ps(x0, x1), _mm256_max_ps(y0, y1)),
+     _mm256_min_ps(_mm256_max_ps(z0, z1), _mm256_set1_ps(max_t)));
+
+    _mm256_storeu_ps(t, t_near);
+    uint32_t used = (1 << node.num_children) - 1;
+    return _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ)) & used;
+}
+#endif
+
+WideBVH::WideBVH(const BVH* bvh, uint32_t width) :
+ _width(width),
+ _extents(bvh->Extents()),
+ _max_depth(0),
+ _nodes4(),
+ _nodes8() {
+    assert(width == 4 || width == 8);
+
+    if (width == 8) {
+        Collapse<8>(bvh->Nodes(), 0, &_nodes8, 0);
+    } else {
+        Collapse<4>(bvh->Nodes(), 0, &_nodes4, 0);
+    }
+
+    // Each level of the traversal leaves at most width - 1 siblings on the
+    // stack.
+    if ((_max_depth + 1) * (width - 1) + 1 > FR_WIDE_BVH_STACK_SIZE) {
+        TERRLN("Wide BVH is too deep to traverse!");
+        exit(EXIT_FAILURE);
+    }
+}
+
+template <uint32_t Width>
+uint32_t WideBVH::Collapse(const vector<LinearNode>& binary, size_t current,
+ vector<WideNode<Width>>* nodes, uint32_t depth) {
+    // Start with the node's own children, or the node itself if the whole
+    // tree is one leaf.
+    size_t slots[Width];
+    uint32_t num_slots = 0;
+    if (binary[current].IsLeaf()) {
+        slots[num_slots++] = current;
+    } else {
+        slots[num_slots++] = current + 1;
+        slots[num_slots++] = binary[current].Right();
+    }
+
+    // Open up the largest interior child until we run out of room.
+    while (num_slots < Width) {
+        int32_t largest = -1;
+        float largest_area = -1.0f;
+        for (uint32_t i = 0; i < num_slots; i++) {
+            const LinearNode& node = binary[slots[i]];
+            if (node.IsLeaf()) continue;
+
+            float area = node.bounds.SurfaceArea();
+            if (area > largest_area) {
+                largest = i;
+                largest_area = area;
+            }
+        }
+        if (largest < 0) break;
+
+        size_t opened = slots[largest];
+        slots[largest] = opened + 1;
+        slots[num_slots++] = binary[opened].Right();
+    }
+
+    if (depth > _max_depth) _max_depth = depth;
+
+    uint32_t index = nodes->size();
+    nodes->emplace_back();
+
+    for (uint32_t i = 0; i < num_slots; i++) {
+        const LinearNode& child = binary[slots[i]];
+
+        uint32_t target = 0;
+        uint8_t count = 0;
+        if (child.IsLeaf()) {
+            assert(child.Count() > 0);
+            target = child.Index();
+            count = child.Count();
+        } else {
+            target = Collapse<Width>(binary, slots[i], nodes, depth + 1);
+        }
+
+        // The recursion may have moved the nodes, so look ours up again.
+        WideNode<Width>& node = (*nodes)[index];
+        node.min_x[i] = child.bounds.min.x;
+        node.min_y[i] = child.bounds.min.y;
+        node.min_z[i] = child.bounds.min.z;
+        node.max_x[i] = child.bounds.max.x;
+        node.max_y[i] = child.bounds.max.y;
+        node.max_z[i] = child.bounds.max.z;
+        node.child[i] = target;
+        node.count[i] = count;
+    }
+    (*nodes)[index].num_children = num_slots;
+
+    return index;
+}
+
+string ToString(const WideBVH* bvh, const string& indent) {
+    stringstream stream;
+    stream << "WideBVH {" << endl <<
+     indent << "| width = " << bvh->_width << endl <<
+     indent << "| nodes = " << (bvh->_nodes4.size() + bvh->_nodes8.size()) << endl <<
+     indent << "| max_depth = " << bvh->_max_depth << endl <<
+     indent << "| extents = " << ToString(bvh->_extents, indent + "| ") << endl <<
+     indent << "}";
+    return stream.str();
+}
+
+} // namespace fr
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <xmmintrin.h>
+#endif
+
+#include "glm/glm.hpp"
+
+#include "types/bounding_box.hpp"
+#include "types/bvh.hpp"
+#include "types/hit_record.hpp"
+#include "types/linear_node.hpp"
+#include "types/slim_ray.hpp"
+#include "utils/simd.hpp"
+#include "utils/tostring.hpp"
+#include "utils/uncopyable.hpp"
+
+/// The most entries a wide BVH traversal stack can hold.
+#define FR_WIDE_BVH_STACK_SIZE 512
+
+namespace fr {
+
+/**
+ * A node of a WideBVH with up to Width children. The child boxes are stored
+ * as a structure of arrays so they can be tested against a ray all at once.
+ */
+template <uint32_t Width>
+struct WideNode {
+    float min_x[Width];
+    float min_y[Width];
+    float min_z[Width];
+    float max_x[Width];
+    float max_y[Width];
+    float max_z[Width];
+
+    /// Index of each child node, or of the first primitive if the child is a
+    /// leaf.
+    uint32_t child[Width];
+
+    /// Number of primitives in each child if it's a leaf, or 0 if it's a node.
+    uint8_t count[Width];
+
+    /// Number of children in use. They're packed at the front.
+    uint8_t num_children;
+};
+
+/**
+ * Tests the ray against each child box of the node. Returns a bit mask of
+ * the children hit before max_t, and their entry distances through t.
+ */
+template <uint32_t Width>
+inline uint32_t IntersectChildren(const WideNode<Width>& node,
+ glm::vec3 origin, glm::vec3 inv_dir, float max_t, float* t) {
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < node.num_children; i++) {
+        float x0 = (node.min_x[i] - origin.x) * inv_dir.x;
+        float x1 = (node.max_x[i] - origin.x) * inv_dir.x;
+        float y0 = (node.min_y[i] - origin.y) * inv_dir.y;
+        float y1 = (node.max_y[i] - origin.y) * inv_dir.y;
+        float z0 = (node.min_z[i] - origin.z) * inv_dir.z;
+        float z1 = (node.max_z[i] - origin.z) * inv_dir.z;
+
+        float t_near = std::max(std::max(std::min(x0, x1), std::min(y0, y1)),
+         std::max(std::min(z0, z1), 0.0f));
+        float t_far = std::min(std::min(std::max(x0, x1), std::max(y0, y1)),
+         std::min(std::max(z0, z1), max_t));
+
+        t[i] = t_near;
+        if (t_near <= t_far) mask |= 1 << i;
+    }
+    return mask;
+}
+
+#if defined(__SSE2__)
+/// Tests all four child boxes at once with SSE.
+template <>
+inline uint32_t IntersectChildren<4>(const WideNode<4>& node,
+ glm::vec3 origin, glm::vec3 inv_dir, float max_t, float* t) {
+    __m128 ox = _mm_set1_ps(origin.x);
+    __m128 oy = _mm_set1_ps(origin.y);
+    __m128 oz = _mm_set1_ps(origin.z);
+    __m128 ix = _mm_set1_ps(inv_dir.x);
+    __m128 iy = _mm_set1_ps(inv_dir.y);
+    __m128 iz = _mm_set1_ps(inv_dir.z);
+
+    __m128 x0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_x), ox), ix);
+    __m128 x1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_x), ox), ix);
+    __m128 y0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_y), oy), iy);
+    __m128 y1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_y), oy), iy);
+    __m128 z0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_z), oz), iz);
+    __m128 z1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_z), oz), iz);
+
+    __m128 t_near = _mm_max_ps(
+     _mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)),
+     _mm_max_ps(_mm_min_ps(z0, z1), _mm_setzero_ps()));
+    __m128 t_far = _mm_min_ps(
+     _mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)),
+     _mm_min_ps(_mm_max_ps(z0, z1), _mm_set1_ps(max_t)));
+
+    _mm_storeu_ps(t, t_near);
+    uint32_t used = (1 << node.num_children) - 1;
+    return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) & used;
+}
+#endif
+
+#if FR_AVX_DISPATCH
+/// Tests all eight child boxes at once with AVX. Only call this when the CPU
+/// supports AVX.
+template <>
+uint32_t IntersectChildren<8>(const WideNode<8>& node,
+ glm::vec3 origin, glm::vec3 inv_dir, float max_t, float* t);
+#endif
+
+/**
+ * A mesh BVH with 4 or 8 children per node, built by collapsing a binary BVH,
+ * so a ray tests a whole node's worth of child boxes in one SIMD operation.
+ * Unlike BVH, traversal uses a stack and visits children nearest first, so
+ * it can't be suspended. That's fine for meshes, which are always traversed
+ * entirely on one worker.
+ */
+class WideBVH : private Uncopyable {
+public:
+    /**
+     * Collapses the given binary BVH into one with width children per node,
+     * where width is 4 or 8 (see SIMDWidth). The binary BVH is no longer
+     * needed afterwards.
+     */
+    explicit WideBVH(const BVH* bvh, uint32_t width);
+
+    /**
+     * Traverses the BVH with the given SlimRay. If a leaf is hit, the passed
+     * intersector will be called as intersector(index, count, ray, hit) for
+     * the leaf's primitives [index, index + count), so it can test them
+     * together, and should return true if it hit any of them. Returns true if
+     * anything was hit.
+     *
+     * In ANY_HIT mode, traversal ends as soon as the intersector reports a
+     * hit.
+     */
+    template <TraversalMode Mode = TraversalMode::CLOSEST_HIT, typename Intersector>
+    bool Traverse(const SlimRay& ray, HitRecord* nearest, Intersector intersector);
+
+    /**
+     * Returns the extents of the area contained by the BVH.
+     */
+    inline BoundingBox Extents() const { return _extents; }
+
+    /// Returns the number of children per node.
+    inline uint32_t GetWidth() const { return _width; }
+
+    inline uint64_t GetSizeInBytes() const {
+        return _nodes4.size() * sizeof(WideNode<4>) +
+         _nodes8.size() * sizeof(WideNode<8>);
+    }
+    inline float GetSizeInMB() const { return GetSizeInBytes() / (1024.0f * 1024.0f); }
+
+    TOSTRINGABLEBYPTR(WideBVH);
+
+private:
+    /// A node or leaf waiting to be visited.
+    struct StackEntry {
+        /// Index of the node, or of the first primitive if it's a leaf.
+        uint32_t index;
+
+        /// Number of primitives if it's a leaf, or 0 if it's a node.
+        uint32_t count;
+
+        /// Distance at which the ray enters its bounds.
+        float t;
+    };
+
+    /// Number of children per node.
+    uint32_t _width;
+
+    /// The extents of the area contained by the BVH.
+    BoundingBox _extents;
+
+    /// The deepest node below the root.
+    uint32_t _max_depth;
+
+    /// Nodes, if the BVH is 4 wide.
+    std::vector<WideNode<4>> _nodes4;
+
+    /// Nodes, if the BVH is 8 wide.
+    std::vector<WideNode<8>> _nodes8;
+
+    /**
+     * Recursively collapses the binary subtree rooted at current into wide
+     * nodes, by repeatedly opening up the interior child with the largest
+     * surface area until there are Width children or only leaves. Returns the
+     * index of the new node.
+     */
+    template <uint32_t Width>
+    uint32_t Collapse(const std::vector<LinearNode>& binary, size_t current,
+     std::vector<WideNode<Width>>* nodes, uint32_t depth);
+
+    /// Traverses the nodes of the given width.
+    template <uint32_t Width, TraversalMode Mode, typename Intersector>
+    bool TraverseNodes(const std::vector<WideNode<Width>>& nodes,
+     const SlimRay& ray, HitRecord* nearest, Intersector& intersector);
+};
+
+template <TraversalMode Mode, typename Intersector>
+bool WideBVH::Traverse(const SlimRay& ray, HitRecord* nearest,
+ Intersector intersector) {
+    if (_width == 8) {
+        return TraverseNodes<8, Mode>(_nodes8, ray, nearest, intersector);
+    }
+    return TraverseNodes<4, Mode>(_nodes4, ray, nearest, intersector);
+}
+
+template <uint32_t Width, TraversalMode Mode, typename Intersector>
+bool WideBVH::TraverseNodes(const std::vector<WideNode<Width>>& nodes,
+ const SlimRay& ray, HitRecord* nearest, Intersector& intersector) {
+    // Precompute the inverse direction of the ray.
+    glm::vec3 inv_dir(1.0f / ray.direction.x,
+                      1.0f / ray.direction.y,
+                      1.0f / ray.direction.z);
+
+    StackEntry stack[FR_WIDE_BVH_STACK_SIZE];
+    size_t top = 0;
+    stack[top++] = {0, 0, 0.0f};
+
+    bool hit = false;
+
+    while (top > 0) {
+        StackEntry entry = stack[--top];
+
+        // Skip anything that's behind the nearest hit found since it was
+        // pushed.
+        if (entry.t > nearest->t) continue;
+
+        if (entry.count > 0) {
+            // It's a leaf, so test its primitives.
+            if (intersector(entry.index, entry.count, ray, nearest)) {
+                hit = true;
+                if (Mode == TraversalMode::ANY_HIT) return true;
+            }
+            continue;
+        }
+
+        FR_BVH_VISIT();
+        const WideNode<Width>& node = nodes[entry.index];
+        float t[Width];
+        uint32_t mask = IntersectChildren<Width>(node, ray.origin, inv_dir,
+         nearest->t, t);
+
+        // Push the children we hit so the nearest ends up on top, by
+        // insertion sorting them by entry distance as they go on.
+        size_t first = top;
+        for (uint32_t i = 0; i < node.num_children; i++) {
+            if (!(mask & (1 << i))) continue;
+
+            StackEntry child = {node.child[i], node.count[i], t[i]};
+            size_t j = top++;
+            while (j > first && stack[j - 1].t < child.t) {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+            stack[j] = child;
+        }
+    }
+
+    return hit;
+}
+
+std::string ToString(const WideBVH* bvh, const std::string& indent = "");
+
+} // namespace fr
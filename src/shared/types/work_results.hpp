@@ -1,23 +1,25 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <vector>
 
 #include "ray_forward.hpp"
 #include "buffer_op.hpp"
 
+/// The number of buckets for tracking how many workers a ray touched. Rays
+/// that touched more workers than this are counted in the last bucket.
+#define FR_MAX_WORKERS_TOUCHED 64
+
 namespace fr {
 
 struct WorkResults {
     explicit WorkResults() :
      forwards(),
      ops(),
-     intersects_produced(0),
-     illuminates_produced(0),
-     lights_produced(0),
-     intersects_killed(0),
-     illuminates_killed(0),
-     lights_killed(0) {}
+     shades() {
+        Reset();
+    }
 
     /// Rays we need to forward.
     std::vector<RayForward> forwards;
@@ -25,8 +27,12 @@ struct WorkResults {
     /// Buffer operations we need to do.
     std::vector<BufferOp> ops;
 
-    /// Workers touched.
-    std::map<uint32_t, uint64_t> workers_touched;
+    /// Light rays waiting to be shaded in batches with other rays that hit
+    /// the same shader.
+    std::vector<FatRay*> shades;
+
+    /// Number of rays killed, indexed by the number of workers they touched.
+    uint64_t workers_touched[FR_MAX_WORKERS_TOUCHED];
 
     /// Intersect rays produced.
     uint64_t intersects_produced;
@@ -45,6 +51,29 @@ struct WorkResults {
 
     /// Light rays killed.
     uint64_t lights_killed;
+
+    /// Records a ray that touched the given number of workers.
+    inline void RecordWorkersTouched(uint32_t count) {
+        if (count >= FR_MAX_WORKERS_TOUCHED) {
+            count = FR_MAX_WORKERS_TOUCHED - 1;
+        }
+        workers_touched[count]++;
+    }
+
+    /// Clears the results for reuse. The vectors keep their capacity, so
+    /// reused results don't touch the heap once they've warmed up.
+    inline void Reset() {
+        forwards.clear();
+        ops.clear();
+        shades.clear();
+        memset(workers_touched, 0, sizeof(workers_touched));
+        intersects_produced = 0;
+        illuminates_produced = 0;
+        lights_produced = 0;
+        intersects_killed = 0;
+        illuminates_killed = 0;
+        lights_killed = 0;
+    }
 };
 
 } // namespace fr
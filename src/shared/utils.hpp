@@ -4,7 +4,12 @@
 #include "utils/library.hpp"
 #include "utils/network.hpp"
 #include "utils/printers.hpp"
+#include "utils/ray_codec.hpp"
+#include "utils/ray_pool.hpp"
+#include "utils/shm_ring.hpp"
+#include "utils/simd.hpp"
 #include "utils/spacecode.hpp"
+#include "utils/thread_slot.hpp"
 #include "utils/tostring.hpp"
 #include "utils/tout.hpp"
 #include "utils/uncopyable.hpp"
@@ -1,5 +1,6 @@
 #include "utils/library.hpp"
 
+#include <algorithm>
 #include <limits>
 
 #include "glm/glm.hpp"
@@ -9,6 +10,8 @@
 
 using std::string;
 using std::function;
+using std::vector;
+using std::pair;
 using std::numeric_limits;
 using glm::vec3;
 using glm::vec4;
@@ -30,8 +33,8 @@ Library::Library() :
  _nodes(),
  _material_name_index(),
  _spatial_index(),
- _emissive_index(),
- _chunk_size(0) {
+ _spatial_splits(),
+ _emissive_index() {
     // ID #0 is always reserved.
     _shaders.push_back(nullptr);
     _textures.push_back(nullptr);
@@ -172,14 +175,60 @@ void Library::ForEachNetNode(function<void (uint32_t, NetNode*)> func) {
     }
 }
 
-void Library::BuildSpatialIndex() {
+void Library::BuildSpatialIndex(const vector<pair<uint64_t, uint64_t>>& costs) {
     _spatial_index.clear();
+    _spatial_splits.clear();
 
     for (uint32_t id = 1; id < _nodes.size(); id++) {
         _spatial_index.push_back(id);
     }
 
-    _chunk_size = ((SPACECODE_MAX + 1) / (_nodes.size() - 1)) + 1;
+    // Node i owns the space codes below _spatial_splits[i], and the last node
+    // owns everything after the final split.
+    size_t num_nodes = _spatial_index.size();
+    if (num_nodes < 2) return;
+
+    uint64_t total = 0;
+    for (const auto& cost : costs) {
+        total += cost.second;
+    }
+
+    if (total == 0) {
+        // Nothing to balance, so split the range into equal chunks.
+        uint64_t chunk_size = ((SPACECODE_MAX + 1) / num_nodes) + 1;
+        for (size_t i = 1; i < num_nodes; i++) {
+            _spatial_splits.push_back(i * chunk_size);
+        }
+        return;
+    }
+
+    vector<pair<uint64_t, uint64_t>> sorted(costs);
+    std::sort(sorted.begin(), sorted.end());
+
+    // Walk the meshes in space code order, handing each to the node whose
+    // share of the total cost its midpoint falls in. Any nodes left over at
+    // the end get the (empty) tail of the range.
+    size_t node = 0;
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < sorted.size(); i++) {
+        uint64_t midpoint = prefix + sorted[i].second / 2;
+        size_t wanted = std::min<uint64_t>(num_nodes - 1,
+         midpoint * num_nodes / total);
+
+        // Never split between meshes with the same space code, since the
+        // lookup couldn't tell them apart.
+        if (i == 0 || sorted[i].first != sorted[i - 1].first) {
+            while (node < wanted) {
+                _spatial_splits.push_back(sorted[i].first);
+                node++;
+            }
+        }
+
+        prefix += sorted[i].second;
+    }
+    while (_spatial_splits.size() < num_nodes - 1) {
+        _spatial_splits.push_back(SPACECODE_MAX + 1);
+    }
 }
 
 bool Library::Intersect(FatRay* ray, uint32_t me) {
@@ -187,38 +236,44 @@ bool Library::Intersect(FatRay* ray, uint32_t me) {
 
     HitRecord nearest(0, 0, numeric_limits<float>::infinity());
 
+    // Where on which face the nearest hit is, so the local geometry only has
+    // to be interpolated once traversal is done.
+    uint32_t nearest_face = 0;
+    float nearest_u = 0.0f;
+    float nearest_v = 0.0f;
+
     _mbvh->Traverse(ray->slim, &nearest,
-     [this, me](uint32_t mesh_index, const SlimRay& mesh_ray, HitRecord* mesh_hit, bool* mesh_suspend) {
+     [this, me, &nearest_face, &nearest_u, &nearest_v](uint32_t mesh_index, const SlimRay& mesh_ray, HitRecord* mesh_hit, bool* mesh_suspend) {
         Mesh *mesh = _meshes[mesh_index];
-        TraversalState state = mesh->bvh->Traverse(mesh_ray, mesh_hit,
-         [me, mesh_index, mesh](uint32_t tri_index, const SlimRay& tri_ray, HitRecord* tri_hit, bool* tri_suspend) {
-            float t = numeric_limits<float>::quiet_NaN();
-            LocalGeometry local;
-
-            // Transform the ray to object space.
-            SlimRay xformed_ray = tri_ray.TransformTo(mesh->xform_inv);
-
-            const Triangle& tri = mesh->faces[tri_index];
-            if (tri.Intersect(mesh->vertices, xformed_ray, &t, &local) && t < tri_hit->t) {
-                tri_hit->worker = me;
-                tri_hit->mesh = mesh_index;
-                tri_hit->t = t;
-                tri_hit->geom = local;
-                return true;
+
+        // Transform the ray to object space once for the whole mesh. Baked
+        // meshes only need the direction for back-face culling.
+        SlimRay xformed_ray = mesh_ray.TransformTo(mesh->xform_inv);
+
+        return mesh->bvh->Traverse(mesh_ray, mesh_hit,
+         [me, mesh_index, mesh, &xformed_ray, &nearest_face, &nearest_u, &nearest_v](uint32_t first, uint32_t count, const SlimRay& tri_ray, HitRecord* tri_hit) {
+            if (!mesh->IntersectFaces(first, count, tri_ray, xformed_ray,
+                 &tri_hit->t, &nearest_face, &nearest_u, &nearest_v)) {
+                return false;
             }
 
-            return false;
+            tri_hit->worker = me;
+            tri_hit->mesh = mesh_index;
+            return true;
         });
-        return state.hit;
     });
 
     if (nearest.worker > 0 && nearest.t < ray->hit.t) {
         ray->hit = nearest;
 
+        // Interpolate the local geometry now that we know it's needed.
+        const Mesh* mesh = _meshes[ray->hit.mesh];
+        mesh->faces[nearest_face].Interpolate(mesh->vertices, nearest_u,
+         nearest_v, &ray->hit.geom);
+
         // Correct the interpolated normal.
         vec4 n(ray->hit.geom.n, 0.0f);
-        ray->hit.geom.n = normalize(
-         vec3(_meshes[ray->hit.mesh]->xform_inv_tr * n));
+        ray->hit.geom.n = normalize(vec3(mesh->xform_inv_tr * n));
 
         return true;
     }
@@ -226,4 +281,28 @@ bool Library::Intersect(FatRay* ray, uint32_t me) {
     return false;
 }
 
+bool Library::Occlude(const SlimRay& ray, float max_t) {
+    assert(_mbvh != nullptr);
+
+    // Nothing past max_t can block the ray, so bound traversal there, and
+    // stop at the first blocker found.
+    HitRecord bound(0, 0, max_t);
+
+    TraversalState state = _mbvh->Traverse<TraversalMode::ANY_HIT>(ray, &bound,
+     [this, max_t](uint32_t mesh_index, const SlimRay& mesh_ray, HitRecord* mesh_hit, bool* mesh_suspend) {
+        Mesh *mesh = _meshes[mesh_index];
+
+        // Transform the ray to object space once for the whole mesh. Baked
+        // meshes only need the direction for back-face culling.
+        SlimRay xformed_ray = mesh_ray.TransformTo(mesh->xform_inv);
+
+        return mesh->bvh->Traverse<TraversalMode::ANY_HIT>(mesh_ray, mesh_hit,
+         [mesh, max_t, &xformed_ray](uint32_t first, uint32_t count, const SlimRay& tri_ray, HitRecord* tri_hit) {
+            return mesh->OccludeFaces(first, count, tri_ray, xformed_ray, max_t);
+        });
+    });
+
+    return state.hit != 0;
+}
+
 }
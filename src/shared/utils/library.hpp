@@ -2,11 +2,13 @@
 
 #include <cstdint>
 #include <cassert>
+#include <algorithm>
 #include <vector>
 #include <unordered_map>
 #include <string>
 #include <stdexcept>
 #include <functional>
+#include <utility>
 
 #include "utils/uncopyable.hpp"
 #include "utils/tout.hpp"
@@ -24,6 +26,7 @@ struct Material;
 struct Mesh;
 class NetNode;
 struct FatRay;
+struct SlimRay;
 
 class Library : private Uncopyable {
 public:
@@ -120,6 +123,13 @@ public:
 
     bool Intersect(FatRay* ray, uint32_t me);
 
+    /**
+     * Returns true if any local geometry blocks the ray before max_t. Stops
+     * at the first blocker found rather than searching for the nearest, and
+     * never computes the local geometry at the blocker.
+     */
+    bool Occlude(const SlimRay& ray, float max_t);
+
     // Net nodes...
     void StoreNetNode(uint32_t id, NetNode* node);
 
@@ -144,16 +154,27 @@ public:
     }
 
     // Spatial index access for net nodes...
-    void BuildSpatialIndex();
+
+    /**
+     * Builds the spatial index, which gives each net node a contiguous range
+     * of space codes. Given the space code and cost (such as size in bytes) of
+     * every mesh, the ranges are split along the space code order so the total
+     * cost of each node is as even as possible. Meshes with the same space
+     * code always land on the same node. Without any costs, the space code
+     * range is split into equal chunks instead.
+     */
+    void BuildSpatialIndex(const std::vector<std::pair<uint64_t, uint64_t>>& costs);
 
     inline uint32_t LookupNetNodeBySpaceCode(uint64_t spacecode) const {
 #ifndef NDEBUG
-        if (_chunk_size == 0) {
+        if (_spatial_index.empty()) {
             TERRLN("Attempted to lookup net node by space code without first building the spatial index!");
             exit(EXIT_FAILURE);
         }
 #endif
-        return _spatial_index.at(spacecode / _chunk_size);
+        size_t index = std::upper_bound(_spatial_splits.begin(),
+         _spatial_splits.end(), spacecode) - _spatial_splits.begin();
+        return _spatial_index[index];
     }
 
 private:
@@ -170,8 +191,8 @@ private:
     std::vector<NetNode*> _nodes;
     std::unordered_map<std::string, uint32_t> _material_name_index;
     std::vector<uint32_t> _spatial_index;
+    std::vector<uint64_t> _spatial_splits;
     std::vector<uint32_t> _emissive_index;
-    uint64_t _chunk_size;
 };
 
 } // namespace fr
@@ -0,0 +1,249 @@
+#include "utils/ray_codec.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <new>
+#include <limits>
+#include <atomic>
+
+#include "glm/glm.hpp"
+
+#include "types/fat_ray.hpp"
+
+using std::numeric_limits;
+using std::atomic;
+using glm::vec2;
+using glm::vec3;
+
+namespace fr {
+
+/// Flags in the header of an encoded ray.
+enum RayCodecFlags {
+    HAS_TRAVERSAL = 1 << 0,
+    HAS_HIT       = 1 << 1,
+    HAS_LIGHT     = 1 << 2,
+    QUANTIZED     = 1 << 3
+};
+
+/// Fixed header at the front of every encoded ray.
+struct RayCodecHeader {
+    uint8_t version;
+    uint8_t kind;
+    uint8_t flags;
+    uint8_t reserved;
+    int16_t x;
+    int16_t y;
+    int16_t bounces;
+    uint16_t workers_touched;
+};
+
+static atomic<uint64_t> rays_encoded(0);
+
+static atomic<uint64_t> bytes_encoded(0);
+
+template <typename T>
+static inline void Put(char** cursor, const T& value) {
+    memcpy(*cursor, &value, sizeof(T));
+    *cursor += sizeof(T);
+}
+
+template <typename T>
+static inline bool Get(const char** cursor, const char* end, T* value) {
+    if (*cursor + sizeof(T) > end) return false;
+    memcpy(value, *cursor, sizeof(T));
+    *cursor += sizeof(T);
+    return true;
+}
+
+#ifdef FR_RAY_CODEC_QUANTIZE
+
+/// Maps a unit vector onto the octahedron and quantizes it to 16 bits per
+/// component.
+static uint32_t OctEncode(vec3 v) {
+    float l1 = glm::abs(v.x) + glm::abs(v.y) + glm::abs(v.z);
+    vec2 p(v.x / l1, v.y / l1);
+    if (v.z < 0.0f) {
+        vec2 folded((1.0f - glm::abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f),
+                    (1.0f - glm::abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f));
+        p = folded;
+    }
+    int16_t qx = static_cast<int16_t>(glm::round(glm::clamp(p.x, -1.0f, 1.0f) * 32767.0f));
+    int16_t qy = static_cast<int16_t>(glm::round(glm::clamp(p.y, -1.0f, 1.0f) * 32767.0f));
+    return (static_cast<uint32_t>(static_cast<uint16_t>(qx)) << 16) |
+     static_cast<uint16_t>(qy);
+}
+
+static vec3 OctDecode(uint32_t bits) {
+    vec2 p(static_cast<int16_t>(bits >> 16) / 32767.0f,
+           static_cast<int16_t>(bits & 0xFFFF) / 32767.0f);
+    vec3 v(p.x, p.y, 1.0f - glm::abs(p.x) - glm::abs(p.y));
+    if (v.z < 0.0f) {
+        v.x = (1.0f - glm::abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f);
+        v.y = (1.0f - glm::abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return glm::normalize(v);
+}
+
+/// Only unit vectors survive octahedral encoding.
+static inline bool IsUnit(vec3 v) {
+    return glm::abs(glm::dot(v, v) - 1.0f) < 0.0001f;
+}
+
+#endif
+
+/// Writes a direction or normal, quantized if the codec allows it.
+static inline void PutDirection(char** cursor, vec3 v, bool quantized) {
+#ifdef FR_RAY_CODEC_QUANTIZE
+    if (quantized) {
+        Put(cursor, OctEncode(v));
+        return;
+    }
+#endif
+    Put(cursor, v);
+}
+
+static inline bool GetDirection(const char** cursor, const char* end, vec3* v,
+ bool quantized) {
+    if (quantized) {
+#ifdef FR_RAY_CODEC_QUANTIZE
+        uint32_t bits;
+        if (!Get(cursor, end, &bits)) return false;
+        *v = OctDecode(bits);
+        return true;
+#else
+        // Can't decode what we don't know how to encode.
+        return false;
+#endif
+    }
+    return Get(cursor, end, v);
+}
+
+size_t EncodeRay(const FatRay* ray, void* buf) {
+    assert(ray != nullptr);
+    assert(buf != nullptr);
+
+    char* start = reinterpret_cast<char*>(buf);
+    char* cursor = start;
+
+    RayCodecHeader header;
+    header.version = FR_RAY_CODEC_VERSION;
+    header.kind = ray->kind;
+    header.flags = 0;
+    header.reserved = 0;
+    header.x = ray->x;
+    header.y = ray->y;
+    header.bounces = ray->bounces;
+    header.workers_touched =
+     ray->workers_touched < numeric_limits<uint16_t>::max() ?
+     ray->workers_touched : numeric_limits<uint16_t>::max();
+
+    // Illuminate rays are never traversed, they're consumed on arrival.
+    if (ray->kind != FatRay::Kind::ILLUMINATE) header.flags |= HAS_TRAVERSAL;
+    if (ray->kind == FatRay::Kind::LIGHT) header.flags |= HAS_LIGHT;
+    if (ray->hit.worker != 0) header.flags |= HAS_HIT;
+
+#ifdef FR_RAY_CODEC_QUANTIZE
+    if (IsUnit(ray->slim.direction) &&
+        (ray->hit.worker == 0 || IsUnit(ray->hit.geom.n))) {
+        header.flags |= QUANTIZED;
+    }
+#endif
+    bool quantized = (header.flags & QUANTIZED) != 0;
+
+    Put(&cursor, header);
+    Put(&cursor, ray->slim.origin);
+    PutDirection(&cursor, ray->slim.direction, quantized);
+    Put(&cursor, ray->transmittance);
+
+    if (header.flags & HAS_TRAVERSAL) {
+        assert(ray->traversal.current <= numeric_limits<uint32_t>::max());
+        Put(&cursor, static_cast<uint32_t>(ray->traversal.current));
+        Put(&cursor, static_cast<uint16_t>(ray->traversal.state));
+        Put(&cursor, static_cast<uint16_t>(ray->traversal.hit));
+        Put(&cursor, ray->current_worker);
+        Put(&cursor, ray->visited);
+    }
+
+    if (header.flags & HAS_LIGHT) {
+        Put(&cursor, ray->emission);
+        Put(&cursor, ray->target);
+    }
+
+    if (header.flags & HAS_HIT) {
+        Put(&cursor, ray->hit.worker);
+        Put(&cursor, ray->hit.mesh);
+        Put(&cursor, ray->hit.t);
+        PutDirection(&cursor, ray->hit.geom.n, quantized);
+        Put(&cursor, ray->hit.geom.t);
+    }
+
+    size_t size = cursor - start;
+    assert(size <= FR_RAY_CODEC_MAX_SIZE);
+
+    rays_encoded++;
+    bytes_encoded += size;
+
+    return size;
+}
+
+size_t DecodeRay(const void* buf, size_t size, FatRay* ray) {
+    assert(buf != nullptr);
+    assert(ray != nullptr);
+
+    const char* start = reinterpret_cast<const char*>(buf);
+    const char* end = start + size;
+    const char* cursor = start;
+
+    RayCodecHeader header;
+    if (!Get(&cursor, end, &header)) return 0;
+    if (header.version != FR_RAY_CODEC_VERSION) return 0;
+    bool quantized = (header.flags & QUANTIZED) != 0;
+
+    // Start from a fresh ray so fields that weren't sent have their defaults.
+    new (ray) FatRay(static_cast<FatRay::Kind>(header.kind), header.x,
+     header.y);
+    ray->bounces = header.bounces;
+    ray->workers_touched = header.workers_touched;
+
+    if (!Get(&cursor, end, &ray->slim.origin)) return 0;
+    if (!GetDirection(&cursor, end, &ray->slim.direction, quantized)) return 0;
+    if (!Get(&cursor, end, &ray->transmittance)) return 0;
+
+    if (header.flags & HAS_TRAVERSAL) {
+        uint32_t current;
+        uint16_t state, hit;
+        if (!Get(&cursor, end, &current)) return 0;
+        if (!Get(&cursor, end, &state)) return 0;
+        if (!Get(&cursor, end, &hit)) return 0;
+        if (!Get(&cursor, end, &ray->current_worker)) return 0;
+        if (!Get(&cursor, end, &ray->visited)) return 0;
+        ray->traversal.current = current;
+        ray->traversal.state = state;
+        ray->traversal.hit = hit;
+    }
+
+    if (header.flags & HAS_LIGHT) {
+        if (!Get(&cursor, end, &ray->emission)) return 0;
+        if (!Get(&cursor, end, &ray->target)) return 0;
+    }
+
+    if (header.flags & HAS_HIT) {
+        if (!Get(&cursor, end, &ray->hit.worker)) return 0;
+        if (!Get(&cursor, end, &ray->hit.mesh)) return 0;
+        if (!Get(&cursor, end, &ray->hit.t)) return 0;
+        if (!GetDirection(&cursor, end, &ray->hit.geom.n, quantized)) return 0;
+        if (!Get(&cursor, end, &ray->hit.geom.t)) return 0;
+    }
+
+    return cursor - start;
+}
+
+uint64_t RaysEncoded() {
+    return rays_encoded.load();
+}
+
+uint64_t BytesEncoded() {
+    return bytes_encoded.load();
+}
+
+} // namespace fr
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/// Version of the ray wire encoding. Bump this whenever the layout changes.
+#define FR_RAY_CODEC_VERSION 2
+
+/// Define to quantize unit directions and normals to 32-bit octahedral
+/// encodings on the wire. Saves 16 bytes on a ray with a hit, but is lossy.
+// #define FR_RAY_CODEC_QUANTIZE
+
+/// Upper bound on the size of an encoded ray.
+#define FR_RAY_CODEC_MAX_SIZE 128
+
+namespace fr {
+
+struct FatRay;
+
+/**
+ * Encodes a ray into its compact wire format. Only the fields the ray's kind
+ * actually uses are written, the traversal state is packed into 32-bit
+ * fields, and the hit record is only written if the ray has hit something.
+ * The in-memory next pointer never goes on the wire.
+ *
+ * @param   ray     The ray to encode.
+ * @param   buf     Where to write the encoding. Must have room for at least
+ *                  FR_RAY_CODEC_MAX_SIZE bytes.
+ * @return  The number of bytes written.
+ */
+size_t EncodeRay(const FatRay* ray, void* buf);
+
+/**
+ * Decodes a ray from its compact wire format.
+ *
+ * @param   buf     The encoded ray.
+ * @param   size    The number of bytes available in buf.
+ * @param   ray     The ray to decode into.
+ * @return  The number of bytes consumed, or 0 if the encoding is truncated
+ *          or from a different codec version.
+ */
+size_t DecodeRay(const void* buf, size_t size, FatRay* ray);
+
+/// Returns the number of rays encoded so far.
+uint64_t RaysEncoded();
+
+/// Returns the number of bytes rays have been encoded into so far.
+uint64_t BytesEncoded();
+
+} // namespace fr
@@ -0,0 +1,124 @@
+#include "utils/ray_pool.hpp"
+
+#include <cassert>
+#include <cstdlib>
+#include <atomic>
+#include <mutex>
+
+#include "utils/tout.hpp"
+
+using std::atomic;
+using std::mutex;
+using std::lock_guard;
+
+namespace fr {
+
+/// Free ray storage is chained through the ray's next pointer.
+struct RayFreeList {
+    FatRay* head;
+    uint32_t size;
+};
+
+/// This thread's free list. Plain old data so it can live in TLS.
+static __thread RayFreeList local = { nullptr, 0 };
+
+/// Guards the global free list and slab allocation.
+static mutex global_lock;
+
+/// The free list shared by all threads.
+static RayFreeList global = { nullptr, 0 };
+
+/// Total number of rays worth of storage allocated.
+static atomic<uint64_t> capacity(0);
+
+/// Number of rays currently alive.
+static atomic<int64_t> live(0);
+
+/// The largest number of rays alive at once.
+static atomic<int64_t> high_water(0);
+
+/// Moves up to count rays from the front of one free list to another.
+static void Transfer(RayFreeList* from, RayFreeList* to, uint32_t count) {
+    while (count > 0 && from->head != nullptr) {
+        FatRay* ray = from->head;
+        from->head = ray->next;
+        from->size--;
+
+        ray->next = to->head;
+        to->head = ray;
+        to->size++;
+
+        count--;
+    }
+}
+
+/// Allocates a fresh slab and chains all of it onto the given free list.
+static void AllocateSlab(RayFreeList* to) {
+    FatRay* slab = reinterpret_cast<FatRay*>(
+     malloc(sizeof(FatRay) * FR_RAY_POOL_SLAB_SIZE));
+    if (slab == nullptr) {
+        TERRLN("Failed to allocate ray pool slab.");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < FR_RAY_POOL_SLAB_SIZE; i++) {
+        slab[i].next = to->head;
+        to->head = &slab[i];
+    }
+    to->size += FR_RAY_POOL_SLAB_SIZE;
+
+    capacity += FR_RAY_POOL_SLAB_SIZE;
+}
+
+void* RayPool::Grab() {
+    // Refill from the global free list a batch at a time.
+    if (local.head == nullptr) {
+        lock_guard<mutex> guard(global_lock);
+        if (global.head == nullptr) {
+            AllocateSlab(&global);
+        }
+        Transfer(&global, &local, FR_RAY_POOL_BATCH_SIZE);
+    }
+
+    FatRay* ray = local.head;
+    assert(ray != nullptr);
+    local.head = ray->next;
+    local.size--;
+
+    int64_t now = ++live;
+    int64_t peak = high_water.load(std::memory_order_relaxed);
+    while (now > peak && !high_water.compare_exchange_weak(peak, now)) {}
+
+    return ray;
+}
+
+void RayPool::Release(FatRay* ray) {
+    assert(ray != nullptr);
+
+    ray->~FatRay();
+    ray->next = local.head;
+    local.head = ray;
+    local.size++;
+    live--;
+
+    // Hand a batch back if this thread is hoarding rays that other threads
+    // allocated.
+    if (local.size > FR_RAY_POOL_LOCAL_MAX) {
+        lock_guard<mutex> guard(global_lock);
+        Transfer(&local, &global, FR_RAY_POOL_BATCH_SIZE);
+    }
+}
+
+int64_t RayPool::Live() {
+    return live.load();
+}
+
+int64_t RayPool::HighWater() {
+    return high_water.load();
+}
+
+uint64_t RayPool::Capacity() {
+    return capacity.load();
+}
+
+} // namespace fr
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <new>
+#include <utility>
+
+#include "types/fat_ray.hpp"
+
+/// The number of rays allocated at once when the pool runs dry.
+#define FR_RAY_POOL_SLAB_SIZE 4096
+
+/// The number of rays moved between a thread's free list and the global free
+/// list at once.
+#define FR_RAY_POOL_BATCH_SIZE 256
+
+/// The number of free rays a thread may hold onto before returning a batch to
+/// the global free list.
+#define FR_RAY_POOL_LOCAL_MAX (FR_RAY_POOL_BATCH_SIZE * 2)
+
+namespace fr {
+
+/**
+ * A process-wide pool of FatRay storage. Each thread keeps its own free list
+ * and only touches the shared free list (under a lock) to grab or return a
+ * whole batch of rays at once, so rays can be created on one thread and
+ * destroyed on another without every allocation contending on malloc. Storage
+ * is carved out of slabs that live for the lifetime of the process.
+ *
+ * Rays from the pool must be destroyed with Release(), never delete.
+ */
+class RayPool {
+public:
+    /// Constructs a new ray out of pooled storage with the given constructor
+    /// arguments.
+    template <typename... Args>
+    static inline FatRay* New(Args&&... args) {
+        return new (Grab()) FatRay(std::forward<Args>(args)...);
+    }
+
+    /// Destroys a ray and returns its storage to the pool.
+    static void Release(FatRay* ray);
+
+    /// Returns the number of rays currently alive.
+    static int64_t Live();
+
+    /// Returns the largest number of rays that have been alive at once.
+    static int64_t HighWater();
+
+    /// Returns the number of rays worth of storage allocated so far.
+    static uint64_t Capacity();
+
+private:
+    /// Returns uninitialized storage for a single ray.
+    static void* Grab();
+};
+
+} // namespace fr
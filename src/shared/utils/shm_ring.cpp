@@ -0,0 +1,247 @@
+#include "utils/shm_ring.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <set>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils/tout.hpp"
+
+using std::string;
+using std::atomic;
+using std::set;
+using std::mutex;
+using std::lock_guard;
+
+/// Marks a ring that's been fully set up by its creator.
+#define FR_SHM_RING_MAGIC 0x46525247
+
+namespace fr {
+
+/// Lives at the front of the shared mapping. The producer and consumer
+/// counters sit on their own cache lines so the two sides don't fight over
+/// them. (GCC 4.7 doesn't have alignas.)
+struct ShmRing::Header {
+    /// FR_SHM_RING_MAGIC once the creator is done setting up.
+    uint32_t magic;
+
+    /// Total bytes ever written. Only the producer changes it.
+    atomic<uint64_t> head __attribute__((aligned(64)));
+
+    /// Total bytes ever consumed. Only the consumer changes it.
+    atomic<uint64_t> tail __attribute__((aligned(64)));
+
+    /// Bumped after every write. The consumer's futex waits on it.
+    atomic<uint32_t> signal __attribute__((aligned(64)));
+
+    /// Nonzero while the consumer may be blocked in Wait().
+    atomic<uint32_t> sleeping;
+};
+
+static_assert((FR_SHM_RING_SIZE & (FR_SHM_RING_SIZE - 1)) == 0,
+ "FR_SHM_RING_SIZE must be a power of two");
+
+static_assert(sizeof(atomic<uint64_t>) == sizeof(uint64_t) &&
+ sizeof(atomic<uint32_t>) == sizeof(uint32_t),
+ "Shared memory ring counters must be lock-free");
+
+/// Guards created_names.
+static mutex created_lock;
+
+/// Names of the rings this process created that are still linked, because
+/// the other side may never open (and unlink) them. Never freed, so it's
+/// still around for the exit handler.
+static set<string>* created_names = nullptr;
+
+/// Unlinks the rings this process created that are still around at exit.
+static void UnlinkCreated() {
+    lock_guard<mutex> lock(created_lock);
+    for (const auto& name : *created_names) {
+        shm_unlink(name.c_str());
+    }
+    created_names->clear();
+}
+
+static inline int Futex(atomic<uint32_t>* addr, int op, uint32_t value,
+ const struct timespec* timeout) {
+    // Not FUTEX_PRIVATE_FLAG, since the other side is another process.
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), op, value,
+     timeout, nullptr, 0);
+}
+
+ShmRing* ShmRing::Create(const string& name) {
+    // Clear out anything a crashed run left behind.
+    shm_unlink(name.c_str());
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        TERRLN("shm_open " << name << ": " << strerror(errno));
+        return nullptr;
+    }
+
+    if (ftruncate(fd, MapSize()) != 0) {
+        TERRLN("ftruncate " << name << ": " << strerror(errno));
+        close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    void* map = mmap(nullptr, MapSize(), PROT_READ | PROT_WRITE, MAP_SHARED,
+     fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        TERRLN("mmap " << name << ": " << strerror(errno));
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    Header* header = new (map) Header;
+    header->head.store(0);
+    header->tail.store(0);
+    header->signal.store(0);
+    header->sleeping.store(0);
+    header->magic = FR_SHM_RING_MAGIC;
+
+    {
+        lock_guard<mutex> lock(created_lock);
+        if (created_names == nullptr) {
+            created_names = new set<string>;
+            atexit(UnlinkCreated);
+        }
+        created_names->insert(name);
+    }
+
+    return new ShmRing(name, header, true);
+}
+
+ShmRing* ShmRing::Open(const string& name) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if (fd < 0) {
+        TERRLN("shm_open " << name << ": " << strerror(errno));
+        return nullptr;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 ||
+        static_cast<size_t>(info.st_size) != MapSize()) {
+        TERRLN("Shared memory ring " << name << " has the wrong size.");
+        close(fd);
+        return nullptr;
+    }
+
+    void* map = mmap(nullptr, MapSize(), PROT_READ | PROT_WRITE, MAP_SHARED,
+     fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        TERRLN("mmap " << name << ": " << strerror(errno));
+        return nullptr;
+    }
+
+    Header* header = reinterpret_cast<Header*>(map);
+    if (header->magic != FR_SHM_RING_MAGIC) {
+        TERRLN("Shared memory ring " << name << " isn't set up.");
+        munmap(map, MapSize());
+        return nullptr;
+    }
+
+    // Both sides have it mapped now, so nobody needs the name anymore.
+    shm_unlink(name.c_str());
+
+    return new ShmRing(name, header, false);
+}
+
+size_t ShmRing::MapSize() {
+    return sizeof(Header) + FR_SHM_RING_SIZE;
+}
+
+ShmRing::ShmRing(const string& name, Header* header, bool creator) :
+ _name(name),
+ _header(header),
+ _data(reinterpret_cast<char*>(header) + sizeof(Header)),
+ _creator(creator) {}
+
+ShmRing::~ShmRing() {
+    munmap(_header, MapSize());
+
+    // The other side unlinks the name when it opens the ring, but it may
+    // never have gotten that far.
+    if (_creator) {
+        lock_guard<mutex> lock(created_lock);
+        if (created_names->erase(_name) > 0) {
+            shm_unlink(_name.c_str());
+        }
+    }
+}
+
+size_t ShmRing::Write(const char* buf, size_t len) {
+    uint64_t head = _header->head.load(std::memory_order_relaxed);
+    uint64_t tail = _header->tail.load(std::memory_order_acquire);
+
+    size_t room = FR_SHM_RING_SIZE - (head - tail);
+    size_t count = std::min(len, room);
+    if (count == 0) return 0;
+
+    // Copy in two pieces if we wrap around the end.
+    size_t offset = head & (FR_SHM_RING_SIZE - 1);
+    size_t first = std::min(count, static_cast<size_t>(FR_SHM_RING_SIZE) - offset);
+    memcpy(_data + offset, buf, first);
+    memcpy(_data, buf + first, count - first);
+
+    _header->head.store(head + count, std::memory_order_release);
+
+    // Only make the syscall if the consumer might be asleep.
+    _header->signal.fetch_add(1);
+    if (_header->sleeping.load() != 0) {
+        Futex(&_header->signal, FUTEX_WAKE, 1, nullptr);
+    }
+
+    return count;
+}
+
+size_t ShmRing::Peek(const char** data) const {
+    uint64_t head = _header->head.load(std::memory_order_acquire);
+    uint64_t tail = _header->tail.load(std::memory_order_relaxed);
+
+    size_t offset = tail & (FR_SHM_RING_SIZE - 1);
+    *data = _data + offset;
+    return std::min(static_cast<size_t>(head - tail),
+     static_cast<size_t>(FR_SHM_RING_SIZE) - offset);
+}
+
+void ShmRing::Consume(size_t len) {
+    uint64_t tail = _header->tail.load(std::memory_order_relaxed);
+    _header->tail.store(tail + len, std::memory_order_release);
+}
+
+uint32_t ShmRing::Wait(uint32_t seen, uint32_t timeout_ms) {
+    // Announce that we might sleep before the final check, so a write either
+    // shows up in the check or sees us sleeping and wakes us.
+    _header->sleeping.store(1);
+    if (_header->signal.load() == seen) {
+        struct timespec timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        Futex(&_header->signal, FUTEX_WAIT, seen, &timeout);
+    }
+    _header->sleeping.store(0);
+
+    return _header->signal.load();
+}
+
+void ShmRing::Wake() {
+    Futex(&_header->signal, FUTEX_WAKE, 1, nullptr);
+}
+
+} // namespace fr
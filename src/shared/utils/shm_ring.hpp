@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include "utils/uncopyable.hpp"
+
+/// The number of bytes each shared memory ring holds. Must be a power of two.
+#define FR_SHM_RING_SIZE (8 * 1024 * 1024)
+
+namespace fr {
+
+/**
+ * A single producer, single consumer byte ring in POSIX shared memory, for
+ * streaming messages between processes on the same host without going
+ * through the kernel's socket buffers. The producer only copies bytes in and
+ * bumps a counter; the consumer is only woken through a futex if it's
+ * actually asleep, so a busy stream costs no syscalls at all.
+ *
+ * Each side must only be used from one thread at a time, except for Wait()
+ * and Wake(), which are safe to call from the consumer's waiter thread.
+ */
+class ShmRing : private Uncopyable {
+public:
+    /**
+     * Creates a fresh, empty ring under the given name (which must start with
+     * a slash), replacing any stale ring left behind under the same name.
+     * The name is unlinked when the ring is destroyed or the process exits,
+     * in case the other side never opens it. Returns nullptr if shared memory
+     * isn't available.
+     */
+    static ShmRing* Create(const std::string& name);
+
+    /**
+     * Maps the ring created under the given name, then unlinks the name so
+     * the ring goes away with its last mapping. Returns nullptr if there's no
+     * such ring.
+     */
+    static ShmRing* Open(const std::string& name);
+
+    ~ShmRing();
+
+    /// Returns the name the ring was created under.
+    inline const std::string& Name() const { return _name; }
+
+    /**
+     * Copies as much of the given bytes into the ring as there's room for,
+     * and wakes the consumer if it's waiting. Returns the number of bytes
+     * copied. Producer only.
+     */
+    size_t Write(const char* buf, size_t len);
+
+    /**
+     * Points data at the bytes ready to be read, and returns how many there
+     * are. Only returns bytes up to the end of the ring, so call it again
+     * after Consume() to get any that wrapped around. Consumer only.
+     */
+    size_t Peek(const char** data) const;
+
+    /// Releases the given number of peeked bytes back to the producer.
+    /// Consumer only.
+    void Consume(size_t len);
+
+    /**
+     * Blocks until the producer has written since the write count was seen,
+     * or until timeout_ms passes. Returns the current write count, to pass in
+     * next time.
+     */
+    uint32_t Wait(uint32_t seen, uint32_t timeout_ms);
+
+    /// Wakes anything blocked in Wait(), without writing anything.
+    void Wake();
+
+private:
+    struct Header;
+
+    explicit ShmRing(const std::string& name, Header* header, bool creator);
+
+    /// Returns the size of the whole mapping, header included.
+    static size_t MapSize();
+
+    /// The name the ring was created under.
+    std::string _name;
+
+    /// The shared header, followed by the ring's bytes.
+    Header* _header;
+
+    /// The ring's bytes.
+    char* _data;
+
+    /// Whether this side created the ring, and so has to make sure its name
+    /// gets unlinked.
+    bool _creator;
+};
+
+} // namespace fr
@@ -0,0 +1,12 @@
+#include "utils/simd.hpp"
+
+namespace fr {
+
+uint32_t SIMDWidth() {
+#if FR_AVX_DISPATCH
+    if (__builtin_cpu_supports("avx")) return 8;
+#endif
+    return 4;
+}
+
+} // namespace fr
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+
+/// Whether the compiler can build AVX intrinsics in functions marked
+/// target("avx") without -mavx, and has __builtin_cpu_supports. That takes
+/// GCC 4.9 or clang 3.8.
+#if defined(__clang__)
+#define FR_AVX_COMPILER \
+    (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8))
+#elif defined(__GNUC__)
+#define FR_AVX_COMPILER \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#else
+#define FR_AVX_COMPILER 0
+#endif
+
+/// Whether we can build AVX code paths and pick them at runtime on CPUs that
+/// support AVX. Otherwise everything runs 4 wide. SSE2 is always available,
+/// since we build with it.
+#if FR_AVX_COMPILER && (defined(__x86_64__) || defined(__i386__))
+#define FR_AVX_DISPATCH 1
+#else
+#define FR_AVX_DISPATCH 0
+#endif
+
+namespace fr {
+
+/**
+ * Returns how many floats this CPU can operate on at once: 8 if it supports
+ * AVX, otherwise 4.
+ */
+uint32_t SIMDWidth();
+
+} // namespace fr
@@ -0,0 +1,31 @@
+#include "utils/thread_slot.hpp"
+
+#include <cstdlib>
+#include <atomic>
+#include <limits>
+
+#include "utils/tout.hpp"
+
+using std::atomic;
+using std::numeric_limits;
+
+namespace fr {
+
+/// The next slot to hand out.
+static atomic<uint32_t> next_slot(0);
+
+/// The calling thread's slot, if it has one yet.
+static __thread uint32_t slot = numeric_limits<uint32_t>::max();
+
+uint32_t ThreadSlot() {
+    if (slot == numeric_limits<uint32_t>::max()) {
+        slot = next_slot++;
+        if (slot >= FR_MAX_THREAD_SLOTS) {
+            TERRLN("Ran out of thread slots, increase FR_MAX_THREAD_SLOTS.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return slot;
+}
+
+} // namespace fr
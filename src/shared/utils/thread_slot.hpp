@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+/// The maximum number of threads that can be handed a thread slot.
+#define FR_MAX_THREAD_SLOTS 256
+
+namespace fr {
+
+/**
+ * Returns a small index unique to the calling thread, handed out the first
+ * time each thread asks for one and stable for the thread's lifetime. Use it
+ * to index pre-sized per-thread tables without any locking.
+ */
+uint32_t ThreadSlot();
+
+} // namespace fr
@@ -0,0 +1,168 @@
+#include "compute_pool.hpp"
+
+#include <cassert>
+#include <pthread.h>
+#include <sched.h>
+
+#include "utils.hpp"
+
+using std::vector;
+using std::thread;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+
+namespace fr {
+
+ComputePool::ComputePool(uint32_t num_threads, WorkCallback work,
+ AfterWorkCallback after_work) :
+ _work(work),
+ _after_work(after_work),
+ _num_threads(num_threads > 0 ? num_threads : HardwareConcurrency()),
+ _next_deque(0),
+ _deques(),
+ _threads(),
+ _pending(0),
+ _stopping(false),
+ _done(),
+ _draining() {
+    int result = 0;
+
+    // Finished jobs wake up the loop through the async handle. It shouldn't
+    // keep the loop alive on its own.
+    result = uv_async_init(uv_default_loop(), &_async, OnAsync);
+    CheckUVResult(result, "async_init");
+    _async.data = this;
+    uv_unref(reinterpret_cast<uv_handle_t*>(&_async));
+
+    for (uint32_t i = 0; i < _num_threads; i++) {
+        _deques.push_back(new JobDeque);
+    }
+
+    for (uint32_t i = 0; i < _num_threads; i++) {
+        _threads.emplace_back(&ComputePool::Run, this, i);
+    }
+}
+
+ComputePool::~ComputePool() {
+    {
+        lock_guard<mutex> guard(_idle_lock);
+        _stopping = true;
+    }
+    _idle.notify_all();
+
+    for (auto& t : _threads) {
+        t.join();
+    }
+
+    for (auto deque : _deques) {
+        delete deque;
+    }
+}
+
+void ComputePool::Submit(void* data) {
+    // Deal jobs out round-robin. Idle threads will steal them if the owner
+    // is busy.
+    JobDeque* deque = _deques[_next_deque];
+    _next_deque = (_next_deque + 1) % _num_threads;
+
+    // Count the job before it becomes visible, so a thread that takes it
+    // right away can't drive the count below zero.
+    {
+        lock_guard<mutex> guard(_idle_lock);
+        _pending++;
+    }
+
+    {
+        lock_guard<mutex> guard(deque->lock);
+        deque->jobs.push_back(data);
+    }
+    _idle.notify_one();
+}
+
+uint32_t ComputePool::HardwareConcurrency() {
+    uint32_t count = thread::hardware_concurrency();
+    return count > 0 ? count : 1;
+}
+
+void ComputePool::Run(uint32_t index) {
+    Pin(index);
+
+    while (true) {
+        void* data = nullptr;
+        if (!Take(index, &data)) {
+            // Nothing to do anywhere, sleep until more work shows up.
+            unique_lock<mutex> guard(_idle_lock);
+            _idle.wait(guard, [this]() {
+                return _stopping || _pending.load() > 0;
+            });
+            if (_stopping) return;
+            continue;
+        }
+
+        void* results = _work(data, index);
+
+        {
+            lock_guard<mutex> guard(_done_lock);
+            _done.push_back(results);
+        }
+        uv_async_send(&_async);
+    }
+}
+
+bool ComputePool::Take(uint32_t index, void** data) {
+    // Try our own deque first, oldest job first.
+    {
+        JobDeque* deque = _deques[index];
+        lock_guard<mutex> guard(deque->lock);
+        if (!deque->jobs.empty()) {
+            *data = deque->jobs.front();
+            deque->jobs.pop_front();
+            _pending--;
+            return true;
+        }
+    }
+
+    // Steal the newest job from someone else.
+    for (uint32_t i = 1; i < _num_threads; i++) {
+        JobDeque* victim = _deques[(index + i) % _num_threads];
+        lock_guard<mutex> guard(victim->lock);
+        if (!victim->jobs.empty()) {
+            *data = victim->jobs.back();
+            victim->jobs.pop_back();
+            _pending--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ComputePool::Pin(uint32_t index) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % HardwareConcurrency(), &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        TERRLN("Failed to pin compute thread " << index << ".");
+    }
+}
+
+void ComputePool::OnAsync(uv_async_t* handle, int status) {
+    assert(handle != nullptr);
+    assert(handle->data != nullptr);
+
+    ComputePool* pool = reinterpret_cast<ComputePool*>(handle->data);
+
+    // Async sends get coalesced, so drain everything that's finished.
+    {
+        lock_guard<mutex> guard(pool->_done_lock);
+        pool->_draining.swap(pool->_done);
+    }
+
+    for (auto results : pool->_draining) {
+        pool->_after_work(results);
+    }
+    pool->_draining.clear();
+}
+
+} // namespace fr
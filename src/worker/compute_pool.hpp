@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "uv.h"
+
+#include "utils/uncopyable.hpp"
+
+namespace fr {
+
+/**
+ * A fixed set of pinned compute threads owned by the worker. Each thread has
+ * its own job deque. Threads pop jobs from the front of their own deque and
+ * steal from the back of other threads' deques when they run dry. Finished
+ * jobs are handed back to the libuv loop through an async handle, so the loop
+ * thread only ever does networking and bookkeeping.
+ */
+class ComputePool : private Uncopyable {
+public:
+    /// Runs on a compute thread with the submitted job data and the index of
+    /// the thread running it. Returns the results of the job.
+    typedef void* (*WorkCallback)(void* data, uint32_t thread);
+
+    /// Runs on the libuv loop thread with the results of a finished job.
+    typedef void (*AfterWorkCallback)(void* results);
+
+    explicit ComputePool(uint32_t num_threads, WorkCallback work,
+     AfterWorkCallback after_work);
+
+    ~ComputePool();
+
+    /// Submits a job to the pool. Only call this from the libuv loop thread.
+    void Submit(void* data);
+
+    /// Returns the number of compute threads in the pool.
+    inline uint32_t NumThreads() const { return _num_threads; }
+
+    /// Returns the number of hardware threads available on this machine.
+    static uint32_t HardwareConcurrency();
+
+private:
+    struct JobDeque {
+        std::mutex lock;
+        std::deque<void*> jobs;
+    };
+
+    WorkCallback _work;
+    AfterWorkCallback _after_work;
+    uint32_t _num_threads;
+    uint32_t _next_deque;
+    std::vector<JobDeque*> _deques;
+    std::vector<std::thread> _threads;
+    std::atomic<uint32_t> _pending;
+    bool _stopping;
+    std::mutex _idle_lock;
+    std::condition_variable _idle;
+    std::mutex _done_lock;
+    std::vector<void*> _done;
+    std::vector<void*> _draining;
+    uv_async_t _async;
+
+    /// Main loop of each compute thread.
+    void Run(uint32_t index);
+
+    /// Takes a job from the given thread's deque, or steals one from another
+    /// thread. Returns false if there was no work anywhere.
+    bool Take(uint32_t index, void** data);
+
+    /// Pins the calling thread to a single hardware thread.
+    static void Pin(uint32_t index);
+
+    /// Async callback from libuv for draining finished jobs on the loop.
+    static void OnAsync(uv_async_t* handle, int status);
+};
+
+} // namespace fr
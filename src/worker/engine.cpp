@@ -4,8 +4,16 @@
 #include <cassert>
 #include <cstdlib>
 #include <ctime>
+#include <csignal>
+#include <cstring>
 #include <vector>
 #include <utility>
+#include <mutex>
+#include <algorithm>
+
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <netdb.h>
 
 #include "uv.h"
 
@@ -13,10 +21,15 @@
 #include "types.hpp"
 #include "utils.hpp"
 #include "ray_queue.hpp"
+#include "compute_pool.hpp"
 
 /// How long to wait for more data before flushing the send buffer.
 #define FR_FLUSH_TIMEOUT_MS 10
 
+/// The most compute threads we can run. Each one that shades takes a thread
+/// slot, and the loop thread takes one too.
+#define FR_MAX_COMPUTE_THREADS (FR_MAX_THREAD_SLOTS - 1)
+
 using std::string;
 using std::flush;
 using std::cout;
@@ -24,6 +37,9 @@ using std::endl;
 using std::vector;
 using std::pair;
 using std::make_pair;
+using std::mutex;
+using std::lock_guard;
+using std::sort;
 using glm::vec2;
 using glm::vec3;
 using glm::vec4;
@@ -63,15 +79,56 @@ static uv_timer_t flush_timer;
 /// The timer for sending stats during rendering.
 static uv_timer_t stats_timer;
 
+/// Signal handlers for shutting down cleanly.
+static uv_signal_t sigint_handler;
+static uv_signal_t sigterm_handler;
+
 /// The number of other workers we're connected to.
 static uint32_t num_workers_connected = 0;
 
-/// The maximum number of jobs "in flight" at any given time.
+/// The compute threads that run ray processing jobs.
+static ComputePool* pool = nullptr;
+
+/// The maximum number of jobs queued up or running on the compute pool at any
+/// given time.
 static uint32_t max_jobs = 0;
 
-/// The number of jobs currently available for running on libuv's thread pool.
+/// The number of jobs currently queued up or running on the compute pool.
 static uint32_t active_jobs = 0;
 
+/// The maximum number of rays drained from the ray queue into a single job.
+static uint32_t batch_size = 1;
+
+/// A batch of rays to process and the results of processing them.
+struct Job {
+    /// Rays in the batch, chained through their next pointers.
+    FatRay* rays;
+
+    /// Results of processing the batch.
+    WorkResults results;
+};
+
+/// Finished jobs ready for reuse. Jobs are only handed out and returned on
+/// the loop thread, so this needs no locking, and it stops growing once
+/// max_jobs jobs exist.
+static vector<Job*> free_jobs;
+
+/// A compute thread's private copy of the image.
+struct ThreadImage {
+    /// Only contended when the copies are merged at the end of a render.
+    mutex lock;
+
+    /// The image accumulations are folded into.
+    Image* image;
+};
+
+/// Whether compute threads fold accumulations into their own image copies
+/// instead of handing them back to the loop.
+static bool local_accumulate = false;
+
+/// Per compute thread image copies, indexed by compute thread.
+static vector<ThreadImage*> thread_images;
+
 /// Render stats for this worker.
 static RenderStats stats;
 
@@ -87,10 +144,12 @@ void ScheduleJob();
 void ProcessRay(FatRay* ray, WorkResults* results);
 void ProcessIntersect(FatRay* ray, WorkResults* results);
 void ProcessIlluminate(FatRay* ray, WorkResults* results);
+void SampleLights(const FatRay* ray, WorkResults* results, bool replicated);
 void ProcessLight(FatRay* ray, WorkResults* results);
 void ForwardRay(FatRay* ray, WorkResults* results, uint32_t id);
 void IlluminateIntersection(FatRay* ray, WorkResults* results);
-void ShadeIntersection(FatRay* ray, WorkResults* results);
+bool ShadeIntersection(FatRay* ray, WorkResults* results);
+void ShadeBatches(WorkResults* results);
 void IntersectWBVH(FatRay* ray, WorkResults* results, BVH* wbvh);
 void IntersectLinear(FatRay* ray, WorkResults* results);
 void LightWBVH(FatRay* ray, WorkResults* results, BVH* wbvh);
@@ -99,12 +158,13 @@ void LightLinear(FatRay* ray, WorkResults* results);
 void OnConnection(uv_stream_t* stream, int status);
 uv_buf_t OnAlloc(uv_handle_t* handle, size_t suggested_size);
 void OnRead(uv_stream_t* stream, ssize_t nread, uv_buf_t buf);
-void OnWork(uv_work_t* req);
-void AfterWork(uv_work_t* req, int status);
+void* OnWork(void* data, uint32_t thread);
+void AfterWork(void* data);
 void OnStatsTimeout(uv_timer_t* timer, int status);
 void OnClose(uv_handle_t* handle);
 
 void OnRay(NetNode* node);
+void OnRayBatch(NetNode* node);
 void OnInit(NetNode* node);
 void OnSyncConfig(NetNode* node);
 void OnSyncMesh(NetNode* node);
@@ -133,14 +193,49 @@ uv_buf_t OnAlloc(uv_handle_t* handle, size_t suggested_size);
 void OnRead(uv_stream_t* stream, ssize_t nread, uv_buf_t buf);
 void OnClose(uv_handle_t* handle);
 
+/// Returns true if the address belongs to this host.
+bool IsLocalAddress(const string& address);
+
 } // namespace client
 
 void OnFlushTimeout(uv_timer_t* timer, int status);
 
-void EngineInit(const string& ip, uint16_t port, uint32_t jobs) {
+void OnShutdownSignal(uv_signal_t* handle, int signum);
+
+void EngineInit(const string& ip, uint16_t port, uint32_t threads,
+ uint32_t jobs, uint32_t batch, bool accumulate) {
     int result = 0;
 
-    max_jobs = jobs;
+    // Every compute thread needs a thread slot to shade with, so make sure
+    // they'll all get one now rather than dying mid-render.
+    if (threads > FR_MAX_COMPUTE_THREADS) {
+        TERRLN("Can't run " << threads << " compute threads, the most is " <<
+         FR_MAX_COMPUTE_THREADS << ".");
+        exit(EXIT_FAILURE);
+    }
+    if (threads == 0 &&
+        ComputePool::HardwareConcurrency() > FR_MAX_COMPUTE_THREADS) {
+        threads = FR_MAX_COMPUTE_THREADS;
+        TOUTLN("Limiting compute threads to " << threads << " of " <<
+         ComputePool::HardwareConcurrency() << " hardware threads.");
+    }
+
+    // Spin up the compute threads.
+    pool = new ComputePool(threads, server::OnWork, server::AfterWork);
+    TOUTLN("Running " << pool->NumThreads() << " compute threads.");
+
+    // Keep a couple of jobs queued up per thread by default so no thread
+    // idles waiting on the loop.
+    max_jobs = jobs > 0 ? jobs : pool->NumThreads() * 2;
+    batch_size = batch > 0 ? batch : 1;
+    local_accumulate = accumulate;
+    if (local_accumulate) {
+        for (uint32_t i = 0; i < pool->NumThreads(); i++) {
+            ThreadImage* local = new ThreadImage;
+            local->image = nullptr;
+            thread_images.push_back(local);
+        }
+    }
 
     // Randomize the world.
     srand(time(0));
@@ -157,10 +252,29 @@ void EngineInit(const string& ip, uint16_t port, uint32_t jobs) {
     // Initialize the stats timeout timer.
     result = uv_timer_init(uv_default_loop(), &stats_timer);
     CheckUVResult(result, "timer_init");
+
+    // Stop the loop on SIGINT or SIGTERM so the compute pool gets shut down.
+    result = uv_signal_init(uv_default_loop(), &sigint_handler);
+    CheckUVResult(result, "signal_init");
+    result = uv_signal_start(&sigint_handler, OnShutdownSignal, SIGINT);
+    CheckUVResult(result, "signal_start");
+    result = uv_signal_init(uv_default_loop(), &sigterm_handler);
+    CheckUVResult(result, "signal_init");
+    result = uv_signal_start(&sigterm_handler, OnShutdownSignal, SIGTERM);
+    CheckUVResult(result, "signal_start");
 }
 
 void EngineRun() {
     uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+    // Let the compute threads finish whatever they're running and join them.
+    delete pool;
+    pool = nullptr;
+}
+
+void OnShutdownSignal(uv_signal_t* handle, int signum) {
+    TOUTLN("Caught signal " << signum << ", shutting down.");
+    uv_stop(uv_default_loop());
 }
 
 void server::Init(const string& ip, uint16_t port) {
@@ -291,6 +405,10 @@ void server::DispatchMessage(NetNode* node) {
             OnRay(node);
             break;
 
+        case Message::Kind::RAY_BATCH:
+            OnRayBatch(node);
+            break;
+
         case Message::Kind::INIT:
             OnInit(node);
             break;
@@ -356,21 +474,41 @@ void server::DispatchMessage(NetNode* node) {
 
 void server::ScheduleJob() {
     assert(rayq != nullptr);
-
-    int result = 0;
+    assert(pool != nullptr);
 
     // Don't schedule anything if we're maxed out.
     if (active_jobs >= max_jobs) {
         return;
     }
 
-    // Attempt to queue some work.
-    FatRay* ray = rayq->Pop();
-    if (ray != nullptr) {
-        uv_work_t* req = reinterpret_cast<uv_work_t*>(malloc(sizeof(uv_work_t)));
-        req->data = ray;
-        result = uv_queue_work(uv_default_loop(), req, OnWork, AfterWork);
-        CheckUVResult(result, "queue_work");
+    // Attempt to drain a batch of rays, chaining them together through their
+    // next pointers.
+    FatRay* head = nullptr;
+    FatRay* tail = nullptr;
+    for (uint32_t i = 0; i < batch_size; i++) {
+        FatRay* ray = rayq->Pop();
+        if (ray == nullptr) break;
+
+        if (tail != nullptr) {
+            tail->next = ray;
+        } else {
+            head = ray;
+        }
+        tail = ray;
+    }
+
+    // Queue the batch as a single job, recycling an old one if we can.
+    if (head != nullptr) {
+        Job* job = nullptr;
+        if (!free_jobs.empty()) {
+            job = free_jobs.back();
+            free_jobs.pop_back();
+        } else {
+            job = new Job;
+        }
+        job->rays = head;
+
+        pool->Submit(job);
         active_jobs++;
     }
 }
@@ -406,6 +544,11 @@ void server::IntersectWBVH(FatRay* ray, WorkResults* results, BVH* wbvh) {
     // Common continuation for suspending traversal upon intersection.
     auto suspender = [ray](uint32_t worker_index, const SlimRay& r,
      HitRecord* hit, bool* request_suspend) {
+        // Workers can have several boxes, but there's no point in going back
+        // to one that's already tested all of its geometry.
+        if (ray->Visited(worker_index)) return false;
+        ray->MarkVisited(worker_index);
+
         // Save the current worker and request suspension.
         ray->current_worker = worker_index;
         *request_suspend = true;
@@ -418,8 +561,8 @@ void server::IntersectWBVH(FatRay* ray, WorkResults* results, BVH* wbvh) {
         if (ray->traversal.current == 0) {
             // Yes it is. Illuminate the nearest intersection and kill the ray.
             IlluminateIntersection(ray, results);
-            results->workers_touched[ray->workers_touched]++;
-            delete ray;
+            results->RecordWorkersTouched(ray->workers_touched);
+            RayPool::Release(ray);
             results->intersects_killed++;
             return;
         } else {
@@ -428,7 +571,11 @@ void server::IntersectWBVH(FatRay* ray, WorkResults* results, BVH* wbvh) {
             ray->traversal = wbvh->Traverse(ray->traversal, ray->slim, &ray->hit, suspender);
         }
     } else {
-        // No, it's not. Kick off the initial traversal.
+        // No, it's not. Test local geometry first, since that's the only
+        // place replicated meshes are found, then kick off the initial
+        // traversal.
+        ray->MarkVisited(me);
+        lib->Intersect(ray, me);
         ray->traversal = wbvh->Traverse(ray->slim, &ray->hit, suspender);
     }
 
@@ -440,8 +587,8 @@ void server::IntersectWBVH(FatRay* ray, WorkResults* results, BVH* wbvh) {
             ForwardRay(ray, results, ray->hit.worker);
         } else {
             // No it did not. Kill the ray.
-            results->workers_touched[ray->workers_touched]++;
-            delete ray;
+            results->RecordWorkersTouched(ray->workers_touched);
+            RayPool::Release(ray);
             results->intersects_killed++;
         }
     } else {
@@ -471,16 +618,16 @@ void server::IntersectLinear(FatRay* ray, WorkResults* results) {
         if (ray->hit.worker == me) {
             // Yes, let's illuminate the intersection and kill the ray.
             IlluminateIntersection(ray, results);
-            results->workers_touched[ray->workers_touched]++;
-            delete ray;
+            results->RecordWorkersTouched(ray->workers_touched);
+            RayPool::Release(ray);
             results->intersects_killed++;
         } else if (ray->hit.worker != 0) {
             // No, forward the ray to the hit worker.
             ForwardRay(ray, results, ray->hit.worker);
         } else {
             // There was no hit. Kill the ray.
-            results->workers_touched[ray->workers_touched]++;
-            delete ray;
+            results->RecordWorkersTouched(ray->workers_touched);
+            RayPool::Release(ray);
             results->intersects_killed++;
         }
     } else {
@@ -509,9 +656,26 @@ void server::ProcessIlluminate(FatRay* ray, WorkResults* results) {
     // Everything this function does and calls must be thread-safe. This
     // function will NOT run in the main thread, it runs on the thread pool.
 
+    // Replicated lights were already sampled by the worker that owns the
+    // intersection.
+    SampleLights(ray, results, false);
+
+    // Kill the ray.
+    RayPool::Release(ray);
+    results->illuminates_killed++;
+}
+
+void server::SampleLights(const FatRay* ray, WorkResults* results,
+ bool replicated) {
+    // !!! WARNING !!!
+    // Everything this function does and calls must be thread-safe. This
+    // function will NOT run in the main thread, it runs on the thread pool.
+
     Config* config = lib->LookupConfig();
 
-    lib->ForEachEmissiveMesh([ray, results, config](uint32_t id, Mesh* mesh) {
+    lib->ForEachEmissiveMesh([ray, results, config, replicated](uint32_t id, Mesh* mesh) {
+        if (mesh->replicate != replicated) return;
+
         // The target we're trying to hit is the original intersection.
         vec3 target = ray->EvaluateAt(ray->hit.t);
 
@@ -521,7 +685,6 @@ void server::ProcessIlluminate(FatRay* ray, WorkResults* results) {
 
         Shader* shader = lib->LookupShader(mat->shader);
         assert(shader != nullptr);
-        assert(shader->script != nullptr);
 
         for (const auto& tri : mesh->faces) {
             for (uint16_t i = 0; i < config->samples; i++) {
@@ -542,8 +705,13 @@ void server::ProcessIlluminate(FatRay* ray, WorkResults* results) {
                     continue;
                 }
 
+                // Surfaces facing away from the light can't be lit by it.
+                if (dot(ray->hit.geom.n, direction) > 0) {
+                    continue;
+                }
+
                 // Create a new light ray that inherits the source <x, y> pixel.
-                FatRay* light = new FatRay(FatRay::Kind::LIGHT, ray->x, ray->y);
+                FatRay* light = RayPool::New(FatRay::Kind::LIGHT, ray->x, ray->y);
                 results->lights_produced++;
 
                 // The origin is at the sample position.
@@ -552,8 +720,12 @@ void server::ProcessIlluminate(FatRay* ray, WorkResults* results) {
                 light->slim.direction = direction;
                 light->target = target;
 
+                // Carry the target's hit record along, so whoever owns it
+                // can shade it without intersecting it again.
+                light->hit = ray->hit;
+
                 // Run the shader's emissive() function.
-                light->emission = shader->script->Emissive(texcoord);
+                light->emission = shader->Script(lib)->Emissive(texcoord);
 
                 // Scale the transmittance by the number of samples.
                 light->transmittance = ray->transmittance / config->samples;
@@ -563,10 +735,6 @@ void server::ProcessIlluminate(FatRay* ray, WorkResults* results) {
             }
         }
     });
-
-    // Kill the ray.
-    delete ray;
-    results->illuminates_killed++;
 }
 
 void server::LightWBVH(FatRay* ray, WorkResults* results, BVH* wbvh) {
@@ -577,44 +745,65 @@ void server::LightWBVH(FatRay* ray, WorkResults* results, BVH* wbvh) {
     // Common continuation for suspending traversal upon intersection.
     auto suspender = [ray](uint32_t worker_index, const SlimRay& r,
      HitRecord* hit, bool* request_suspend) {
+        // Workers can have several boxes, but there's no point in going back
+        // to one that's already tested all of its geometry.
+        if (ray->Visited(worker_index)) return false;
+        ray->MarkVisited(worker_index);
+
         // Save the current worker and request suspension.
         ray->current_worker = worker_index;
         *request_suspend = true;
         return false; // Didn't hit anything... yet.
     };
 
+    // Light rays only need to know if something is in the way of the target,
+    // so traversal is bounded just short of it.
+    float max_t = distance(ray->slim.origin, ray->target) - TARGET_INTERSECT_EPSILON;
+    HitRecord bound(0, 0, max_t);
+
     // Is this a suspended ray?
     if (ray->traversal.state != TraversalState::State::NONE) {
         // Yes, it is. Is the traversal complete?
         if (ray->traversal.current == 0) {
-            // Yes it is. Shade the nearest intersection and kill the ray.
-            ShadeIntersection(ray, results);
-            results->workers_touched[ray->workers_touched]++;
-            delete ray;
+            // Yes it is, and nothing was in the way. We own the target, so
+            // shade it and kill the ray, unless it's being held for batched
+            // shading.
+            if (!ShadeIntersection(ray, results)) {
+                results->RecordWorkersTouched(ray->workers_touched);
+                RayPool::Release(ray);
+                results->lights_killed++;
+            }
+            return;
+        } else if (lib->Occlude(ray->slim, max_t)) {
+            // No it's not, but local geometry blocks the target. Kill the ray
+            // without visiting any more workers.
+            results->RecordWorkersTouched(ray->workers_touched);
+            RayPool::Release(ray);
             results->lights_killed++;
             return;
         } else {
-            // No it's not. Test local geometry and resume traversal.
-            ray->traversal.hit = lib->Intersect(ray, me);
-            ray->traversal = wbvh->Traverse(ray->traversal, ray->slim, &ray->hit, suspender);
+            // No it's not, and nothing local is in the way. Resume traversal.
+            ray->traversal = wbvh->Traverse(ray->traversal, ray->slim, &bound, suspender);
         }
+    } else if (lib->Occlude(ray->slim, max_t)) {
+        // No, it's not, but local geometry (which includes any replicated
+        // meshes) blocks the target. Kill the ray without leaving.
+        results->RecordWorkersTouched(ray->workers_touched);
+        RayPool::Release(ray);
+        results->lights_killed++;
+        return;
     } else {
-        // No, it's not. Kick off the initial traversal.
-        ray->traversal = wbvh->Traverse(ray->slim, &ray->hit, suspender);
+        // No, it's not, and nothing local is in the way. Kick off the
+        // initial traversal.
+        ray->MarkVisited(me);
+        ray->traversal = wbvh->Traverse(ray->slim, &bound, suspender);
     }
 
     // Did the traversal complete?
     if (ray->traversal.current == 0) {
-        // Yes it did. Did it hit anything?
-        if (ray->hit.worker > 0) {
-            // Yes it did. Forward this ray to the winning worker.
-            ForwardRay(ray, results, ray->hit.worker);
-        } else {
-            // No it did not. Kill the ray.
-            results->workers_touched[ray->workers_touched]++;
-            delete ray;
-            results->lights_killed++;
-        }
+        // Yes it did, so the target is visible. Forward this ray to the
+        // worker that owns the target for shading.
+        ForwardRay(ray, results, ray->hit.worker);
     } else {
         // No it did not. Forward this ray to the current worker.
         ForwardRay(ray, results, ray->current_worker);
@@ -628,9 +817,16 @@ void server::LightLinear(FatRay* ray, WorkResults* results) {
 
     Config* config = lib->LookupConfig();
 
-    // Our turn to check for a hit?
+    // Our turn to check for blockers?
     if (ray->current_worker == me) {
-        lib->Intersect(ray, me);
+        float max_t = distance(ray->slim.origin, ray->target) - TARGET_INTERSECT_EPSILON;
+        if (lib->Occlude(ray->slim, max_t)) {
+            // Something is in the way of the target. Kill the ray.
+            results->RecordWorkersTouched(ray->workers_touched);
+            RayPool::Release(ray);
+            results->lights_killed++;
+            return;
+        }
     }
 
     // Move the ray to the next worker.
@@ -638,21 +834,18 @@ void server::LightLinear(FatRay* ray, WorkResults* results) {
 
     // Have we checked every worker?
     if (ray->current_worker > config->workers.size()) {
-        // Yes, are we the nearest hit?
+        // Yes, so the target is visible. Do we own it?
         if (ray->hit.worker == me) {
-            // Yes, shade the intersection and kill the ray.
-            ShadeIntersection(ray, results);
-            results->workers_touched[ray->workers_touched]++;
-            delete ray;
-            results->lights_killed++;
-        } else if (ray->hit.worker != 0) {
-            // No, forward the ray to the hit worker.
-            ForwardRay(ray, results, ray->hit.worker);
+            // Yes, shade the target and kill the ray, unless it's being held
+            // for batched shading.
+            if (!ShadeIntersection(ray, results)) {
+                results->RecordWorkersTouched(ray->workers_touched);
+                RayPool::Release(ray);
+                results->lights_killed++;
+            }
         } else {
-            // There was no hit. Kill the ray.
-            results->workers_touched[ray->workers_touched]++;
-            delete ray;
-            results->lights_killed++;
+            // No, forward the ray to the worker that does.
+            ForwardRay(ray, results, ray->hit.worker);
         }
     } else {
         // Forward it on.
@@ -708,31 +901,30 @@ void server::IlluminateIntersection(FatRay* ray, WorkResults* results) {
 
     Shader* shader = lib->LookupShader(mat->shader);
     assert(shader != nullptr);
-    assert(shader->script != nullptr);
 
-    shader->script->Indirect(ray, hit, results);
+    shader->Script(lib)->Indirect(ray, hit, results);
+
+    // Every worker has the replicated lights, so sample those right here.
+    SampleLights(ray, results, true);
 
     // Create ILLUMINATE rays and send them to each emissive node.
     LightList* lights = lib->LookupLightList();
     lights->ForEachEmissiveWorker([ray, results](uint32_t id) {
-        FatRay* illum = new FatRay(*ray);
+        FatRay* illum = RayPool::New(*ray);
         illum->kind = FatRay::Kind::ILLUMINATE;
         results->illuminates_produced++;
         ForwardRay(illum, results, id);
     });
 }
 
-void server::ShadeIntersection(FatRay* ray, WorkResults* results) {
+bool server::ShadeIntersection(FatRay* ray, WorkResults* results) {
     // !!! WARNING !!!
     // Everything this function does and calls must be thread-safe. This
     // function will NOT run in the main thread, it runs on the thread pool.
 
-    // Did it hit close enough to the target?
-    vec3 hit = ray->EvaluateAt(ray->hit.t);
-    if (distance(hit, ray->target) > TARGET_INTERSECT_EPSILON) {
-        // Nope, ignore.
-        return;
-    }
+    // Light rays carry the hit record of their target, and only get here if
+    // nothing was in the way.
+    vec3 hit = ray->target;
 
     // Find the shader and run the direct() function.
     Mesh* mesh = lib->LookupMesh(ray->hit.mesh);
@@ -743,35 +935,125 @@ void server::ShadeIntersection(FatRay* ray, WorkResults* results) {
 
     Shader* shader = lib->LookupShader(mat->shader);
     assert(shader != nullptr);
-    assert(shader->script != nullptr);
 
-    shader->script->Direct(ray, hit, results);
+    // Batched shaders are run once the whole job has been processed, so
+    // hold onto the ray until then.
+    ShaderScript* script = shader->Script(lib);
+    if (script->HasDirectBatch()) {
+        results->shades.push_back(ray);
+        return true;
+    }
+
+    script->Direct(ray, hit, results);
+    return false;
 }
 
-void server::OnWork(uv_work_t* req) {
+void server::ShadeBatches(WorkResults* results) {
     // !!! WARNING !!!
     // Everything this function does and calls must be thread-safe. This
     // function will NOT run in the main thread, it runs on the thread pool.
 
-    // Pull the ray out of the data baton.
-    FatRay *ray = reinterpret_cast<FatRay*>(req->data);
+    auto material_of = [](const FatRay* ray) {
+        Mesh* mesh = lib->LookupMesh(ray->hit.mesh);
+        assert(mesh != nullptr);
+        return mesh->material;
+    };
 
-    // Allocate results of this work.
-    WorkResults* results = new WorkResults;
+    // Group the held rays by material, since materials sharing a shader can
+    // still bind different textures...
+    vector<FatRay*>& shades = results->shades;
+    sort(shades.begin(), shades.end(), [&material_of](const FatRay* a, const FatRay* b) {
+        return material_of(a) < material_of(b);
+    });
 
-    // Dispatch the ray.
-    ProcessRay(ray, results);
+    // ...and make one call per group.
+    size_t start = 0;
+    while (start < shades.size()) {
+        uint32_t id = material_of(shades[start]);
+        size_t end = start + 1;
+        while (end < shades.size() && material_of(shades[end]) == id) {
+            end++;
+        }
 
-    // Pass the work results back through the data baton.
-    req->data = results;
+        Material* mat = lib->LookupMaterial(id);
+        assert(mat != nullptr);
+        Shader* shader = lib->LookupShader(mat->shader);
+        assert(shader != nullptr);
+        shader->Script(lib)->DirectBatch(&shades[start], end - start, results);
+
+        start = end;
+    }
+
+    // Now the rays can die.
+    for (auto ray : shades) {
+        results->RecordWorkersTouched(ray->workers_touched);
+        RayPool::Release(ray);
+        results->lights_killed++;
+    }
+    shades.clear();
 }
 
-void server::AfterWork(uv_work_t* req, int status) {
-    assert(req != nullptr);
-    assert(req->data != nullptr);
+void* server::OnWork(void* data, uint32_t thread) {
+    // !!! WARNING !!!
+    // Everything this function does and calls must be thread-safe. This
+    // function will NOT run in the main thread, it runs on the compute pool.
+
+    // Pull the job out of the data baton.
+    Job* job = reinterpret_cast<Job*>(data);
+    FatRay* ray = job->rays;
+    job->rays = nullptr;
+
+    // Every ray in the batch merges into the same results.
+    WorkResults* results = &job->results;
+
+    // Dispatch each ray in the batch. The chain is broken before processing,
+    // since the next pointer gets reused once a ray is queued or forwarded.
+    while (ray != nullptr) {
+        FatRay* next = ray->next;
+        ray->next = nullptr;
+        ProcessRay(ray, results);
+        ray = next;
+    }
+
+    // Shade everything that was held for batching.
+    if (!results->shades.empty()) {
+        ShadeBatches(results);
+    }
+
+    // Fold accumulations into this thread's image copy so the loop never
+    // sees them. Writes still go back to the loop, since last-writer-wins
+    // doesn't survive merging the copies.
+    if (local_accumulate) {
+        ThreadImage* local = thread_images[thread];
+        lock_guard<mutex> guard(local->lock);
+
+        // Once the copies have been merged at the end of a render, jobs that
+        // were still in flight hand their accumulations back to the loop
+        // like everything else.
+        if (local->image != nullptr) {
+            size_t kept = 0;
+            for (size_t i = 0; i < results->ops.size(); i++) {
+                const BufferOp& op = results->ops[i];
+                if (op.kind == BufferOp::Kind::ACCUMULATE) {
+                    local->image->Accumulate(op.buffer, op.x, op.y, op.value);
+                } else {
+                    results->ops[kept++] = op;
+                }
+            }
+            results->ops.erase(results->ops.begin() + kept, results->ops.end());
+        }
+    }
+
+    // Pass the job back to the loop.
+    return job;
+}
+
+void server::AfterWork(void* data) {
+    assert(data != nullptr);
 
     // Pull the work result out of the data baton.
-    WorkResults* results = reinterpret_cast<WorkResults*>(req->data);
+    Job* job = reinterpret_cast<Job*>(data);
+    WorkResults* results = &job->results;
 
     // Do buffer operations.
     Image* image = lib->LookupImage();
@@ -797,7 +1079,7 @@ void server::AfterWork(uv_work_t* req, int status) {
             // Send it and kill the local copy.
             forward.ray->workers_touched++;
             forward.node->SendRay(forward.ray);
-            delete forward.ray;
+            RayPool::Release(forward.ray);
         }
     }
 
@@ -808,12 +1090,15 @@ void server::AfterWork(uv_work_t* req, int status) {
     stats.intersects_killed += results->intersects_killed;
     stats.illuminates_killed += results->illuminates_killed;
     stats.lights_killed += results->lights_killed;
-    for (const auto& kv : results->workers_touched) {
-        trav_stats.workers_touched[kv.first] += kv.second;
+    for (uint32_t i = 0; i < FR_MAX_WORKERS_TOUCHED; i++) {
+        if (results->workers_touched[i] > 0) {
+            trav_stats.workers_touched[i] += results->workers_touched[i];
+        }
     }
 
-    delete results;
-    free(req);
+    // Recycle the job.
+    results->Reset();
+    free_jobs.push_back(job);
 
     // This job is done. Schedule more work.
     active_jobs--;
@@ -833,6 +1118,21 @@ void server::OnRay(NetNode* node) {
     ScheduleJob();
 }
 
+void server::OnRayBatch(NetNode* node) {
+    assert(node != nullptr);
+    assert(rayq != nullptr);
+
+    // Unpack the whole batch and push it into the queue.
+    FatRay* rays = node->ReceiveRayBatch();
+    stats.rays_rx += rayq->PushAll(rays);
+
+    // Try to schedule jobs for everything that arrived.
+    uint32_t num_jobs = max_jobs - active_jobs;
+    for (uint32_t i = 0; i < num_jobs; i++) {
+        ScheduleJob();
+    }
+}
+
 void server::OnInit(NetNode* node) {
     assert(node->message.size == sizeof(uint32_t));
 
@@ -877,6 +1177,13 @@ void server::OnSyncConfig(NetNode* node) {
     }
     lib->StoreImage(image);
 
+    // Give each compute thread a blank copy to accumulate into.
+    for (auto local : thread_images) {
+        lock_guard<mutex> guard(local->lock);
+        if (local->image != nullptr) delete local->image;
+        local->image = new Image(*image);
+    }
+
     // Connect to all the other workers.
     client::Init();
 }
@@ -920,7 +1227,7 @@ void server::OnSyncTexture(NetNode* node) {
     // Prepare the texture for execution (if it's procedural).
     Texture* tex = lib->LookupTexture(id);
     if (tex->kind == Texture::Kind::PROCEDURAL) {
-        tex->script = new TextureScript(tex->code);
+        tex->Script();
     }
 
     TOUTLN("[" << node->ip << "] Received texture " << id << ".");
@@ -933,9 +1240,10 @@ void server::OnSyncShader(NetNode* node) {
     // Unpack the shader.
     uint32_t id = node->ReceiveShader(lib);
 
-    // Prepare the shader for execution.
+    // Prepare the shader for execution. This only interprets the code for
+    // the loop thread; compute threads get their own copies on first use.
     Shader* shader = lib->LookupShader(id);
-    shader->script = new ShaderScript(shader->code, lib);
+    shader->Script(lib);
 
     TOUTLN("[" << node->ip << "] Received shader " << id << ".");
 }
@@ -976,12 +1284,28 @@ void server::OnBuildBVH(NetNode* node) {
     assert(node != nullptr);
 
     vector<pair<uint32_t, BoundingBox>> mesh_bounds;
+    vector<pair<uint32_t, BoundingBox>> owned_bounds;
+
+    Config* config = lib->LookupConfig();
+
+    uint32_t width = SIMDWidth();
+    TOUTLN("Using " << width << "-wide mesh BVHs.");
 
     TOUT("Building local BVH" << flush);
-    lib->ForEachMesh([&mesh_bounds](uint32_t id, Mesh* mesh) {
-        mesh->bvh = new BVH(mesh);
+    lib->ForEachMesh([&mesh_bounds, &owned_bounds, config, width](uint32_t id, Mesh* mesh) {
+        // Mesh traversal never suspends, so collapse the binary BVH into a
+        // wide one and throw the binary one away.
+        BVH bvh(mesh, config->bvh_leaf_size);
+        mesh->bvh = new WideBVH(&bvh, width);
         bvh_size_mb += mesh->bvh->GetSizeInMB();
+        if (config->bake) {
+            mesh->Bake(width);
+            bvh_size_mb += mesh->GetBakedSizeInBytes() / (1024.0f * 1024.0f);
+        }
         mesh_bounds.emplace_back(make_pair(id, mesh->bvh->Extents()));
+        if (!mesh->replicate) {
+            owned_bounds.emplace_back(make_pair(id, mesh->bvh->Extents()));
+        }
         cout << "." << flush;
     });
 
@@ -991,13 +1315,17 @@ void server::OnBuildBVH(NetNode* node) {
     lib->StoreMBVH(mbvh);
     cout << "." << endl;
 
-    // This worker's bounding box is the mesh BVH extents.
-    BoundingBox worker_bounds = mbvh->Extents();
+    // This worker's bounds are the top few nodes of a BVH over the meshes it
+    // owns, so they don't claim the empty space between distant meshes.
+    // Replicated meshes are left out, since every worker has them and tests
+    // them before going anywhere else.
+    BVH owned(owned_bounds);
+    vector<BoundingBox> worker_bounds = owned.TopBounds(config->worker_boxes);
 
     // Reply with OK and worker bounds.
     Message reply(Message::Kind::OK);
-    reply.size = sizeof(BoundingBox);
-    reply.body = &worker_bounds;
+    reply.size = worker_bounds.size() * sizeof(BoundingBox);
+    reply.body = worker_bounds.data();
     node->Send(reply);
 
     TOUTLN("Local BVH ready.");
@@ -1059,6 +1387,18 @@ void server::OnRenderStop(NetNode* node) {
     result = uv_timer_stop(&stats_timer);
     CheckUVResult(result, "timer_stop");
 
+    // Fold each compute thread's image copy into the real one.
+    Image* image = lib->LookupImage();
+    assert(image != nullptr);
+    for (auto local : thread_images) {
+        lock_guard<mutex> guard(local->lock);
+        if (local->image != nullptr) {
+            image->Merge(local->image);
+            delete local->image;
+            local->image = nullptr;
+        }
+    }
+
     node->SendImage(lib);
 
     TOUTLN("[" << node->ip << "] Sending image to renderer.");
@@ -1068,6 +1408,17 @@ void server::OnRenderStop(NetNode* node) {
         TOUTLN("\t" << kv.first << " worker(s): " << kv.second);
     }
 
+    TOUTLN("Ray codec stats:");
+    TOUTLN("\tRays encoded: " << RaysEncoded());
+    if (RaysEncoded() > 0) {
+        TOUTLN("\tAverage size: " << (static_cast<float>(BytesEncoded()) / RaysEncoded()) << " bytes (vs. " << sizeof(FatRay) << " bytes in memory)");
+    }
+
+    TOUTLN("Ray pool stats:");
+    TOUTLN("\tLive rays: " << RayPool::Live());
+    TOUTLN("\tHigh water mark: " << RayPool::HighWater() << " rays (" << ((RayPool::HighWater() * sizeof(FatRay)) / (1024.0f * 1024.0f)) << " MB)");
+    TOUTLN("\tCapacity: " << RayPool::Capacity() << " rays (" << ((RayPool::Capacity() * sizeof(FatRay)) / (1024.0f * 1024.0f)) << " MB)");
+
     TOUTLN("Scene stats:");
     TOUTLN("\tNumber of vertices: " << num_verts);
     TOUTLN("\tNumber of faces: " << num_faces);
@@ -1110,7 +1461,9 @@ void OnFlushTimeout(uv_timer_t* timer, int status) {
     // Flush all the client connections.
     if (lib != nullptr) {
         lib->ForEachNetNode([](uint32_t id, NetNode* node) {
-            if (!node->flushed && node->nwritten > 0) {
+            // Also retry anything still waiting for room in a shared memory
+            // ring.
+            if (!node->flushed && (node->nwritten > 0 || node->IsBacklogged())) {
                 node->Flush();
             }
             node->flushed = false;
@@ -1203,6 +1556,19 @@ void client::OnConnect(uv_connect_t* req, int status) {
      OnAlloc, OnRead);
     CheckUVResult(result, "read_start");
 
+    // Workers on the same host skip the network stack and send rays through
+    // shared memory instead. The config may name this host differently for
+    // different workers, so go by the addresses it actually has.
+    Config* config = lib->LookupConfig();
+    if (config->shared_memory && IsLocalAddress(node->ip)) {
+        string name = "/flexrender-" + config->workers[me - 1] + "-" +
+         node->ip + ":" + std::to_string(node->port);
+        if (node->UseSharedMemory(name)) {
+            TOUTLN("[" << node->ip << "] Sending through shared memory on port " <<
+             node->port << ".");
+        }
+    }
+
     // Nothing else to do if we're still waiting for everyone to connect.
     num_workers_connected++;
     if (num_workers_connected < lib->LookupConfig()->workers.size() - 1) {
@@ -1215,6 +1581,53 @@ void client::OnConnect(uv_connect_t* req, int status) {
     renderer->Send(reply);
 }
 
+bool client::IsLocalAddress(const string& address) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+
+    struct addrinfo* resolved = nullptr;
+    if (getaddrinfo(address.c_str(), nullptr, &hints, &resolved) != 0) {
+        return false;
+    }
+
+    struct ifaddrs* interfaces = nullptr;
+    if (getifaddrs(&interfaces) != 0) {
+        freeaddrinfo(resolved);
+        return false;
+    }
+
+    bool local = false;
+    for (struct addrinfo* info = resolved; info != nullptr && !local;
+     info = info->ai_next) {
+        in_addr_t addr =
+         reinterpret_cast<struct sockaddr_in*>(info->ai_addr)->sin_addr.s_addr;
+
+        // All of 127.0.0.0/8 is loopback, even though only one address of it
+        // is usually on an interface.
+        if ((ntohl(addr) >> 24) == 127) {
+            local = true;
+            break;
+        }
+
+        for (struct ifaddrs* iface = interfaces; iface != nullptr;
+         iface = iface->ifa_next) {
+            if (iface->ifa_addr == nullptr ||
+                iface->ifa_addr->sa_family != AF_INET) {
+                continue;
+            }
+            if (reinterpret_cast<struct sockaddr_in*>(iface->ifa_addr)->sin_addr.s_addr == addr) {
+                local = true;
+                break;
+            }
+        }
+    }
+
+    freeifaddrs(interfaces);
+    freeaddrinfo(resolved);
+    return local;
+}
+
 uv_buf_t client::OnAlloc(uv_handle_t* handle, size_t suggested_size) {
     assert(handle != nullptr);
     assert(handle->data != nullptr);
@@ -5,7 +5,8 @@
 
 namespace fr {
 
-void EngineInit(const std::string& ip, uint16_t port, uint32_t jobs);
+void EngineInit(const std::string& ip, uint16_t port, uint32_t threads,
+ uint32_t jobs, uint32_t batch, bool accumulate);
 
 void EngineRun();
 
@@ -27,19 +27,19 @@ RayQueue::~RayQueue() {
     while (_light_front != nullptr) {
         ray = _light_front;
         _light_front = ray->next;
-        delete ray;
+        RayPool::Release(ray);
     }
 
     while (_illuminate_front != nullptr) {
         ray = _illuminate_front;
         _illuminate_front = ray->next;
-        delete ray;
+        RayPool::Release(ray);
     }
 
     while (_intersect_front != nullptr) {
         ray = _intersect_front;
         _intersect_front = ray->next;
-        delete ray;
+        RayPool::Release(ray);
     }
 }
 
@@ -86,6 +86,17 @@ void RayQueue::Push(FatRay* ray) {
     }
 }
 
+size_t RayQueue::PushAll(FatRay* rays) {
+    size_t count = 0;
+    while (rays != nullptr) {
+        FatRay* next = rays->next;
+        Push(rays);
+        rays = next;
+        count++;
+    }
+    return count;
+}
+
 FatRay* RayQueue::Pop() {
     FatRay* ray = nullptr;
 
@@ -131,14 +142,14 @@ FatRay* RayQueue::Pop() {
     }
 
     // Generate a primary ray if the intersection queue is empty.
-    ray = new FatRay;
+    ray = RayPool::New();
     if (_camera->GeneratePrimary(ray)) {
         _stats->intersects_produced++;
         return ray;
     }
 
     // No more primary rays.
-    delete ray;
+    RayPool::Release(ray);
     return nullptr;
 }
 
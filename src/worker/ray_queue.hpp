@@ -19,6 +19,11 @@ public:
     /// Pushes the given ray into the queue and assumes ownership of its memory.
     void Push(FatRay* ray);
 
+    /// Pushes a chain of rays (linked through their next pointers) into the
+    /// queue and assumes ownership of their memory. Returns the number of
+    /// rays pushed.
+    size_t PushAll(FatRay* rays);
+
     /// Pops a ray out of the queue and relinquishes control of its memory.
     FatRay* Pop();
 
@@ -25,7 +25,16 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    uint32_t jobs = 10;
+    uint32_t threads = 0;
+    {
+        string threads_str = FlagValue(argc, argv, "-t", "--threads");
+        if (threads_str != "") {
+            stringstream stream(threads_str);
+            stream >> threads;
+        }
+    }
+
+    uint32_t jobs = 0;
     {
         string jobs_str = FlagValue(argc, argv, "-j", "--jobs");
         if (jobs_str != "") {
@@ -34,9 +43,20 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    uint32_t batch = 1;
+    {
+        string batch_str = FlagValue(argc, argv, "-b", "--batch");
+        if (batch_str != "") {
+            stringstream stream(batch_str);
+            stream >> batch;
+        }
+    }
+
+    bool accumulate = FlagExists(argc, argv, "-l", "--local-accumulate");
+
     TOUTLN("FlexWorker starting.");
 
-    EngineInit("0.0.0.0", port, jobs);
+    EngineInit("0.0.0.0", port, threads, jobs, batch, accumulate);
     TOUTLN("Listening on port " << port << ".");
 
     EngineRun();
@@ -0,0 +1,166 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "glm/glm.hpp"
+
+#include "types/fat_ray.hpp"
+#include "utils/ray_codec.hpp"
+
+using std::cout;
+using std::endl;
+using glm::vec2;
+using glm::vec3;
+
+using namespace fr;
+
+/// The number of checks that have failed so far.
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            cout << __FILE__ << ":" << __LINE__ << ": " << context << \
+             ": CHECK(" #cond ") failed" << endl; \
+            failures++; \
+        } \
+    } while (0)
+
+/// Quantized directions come back unit length and close to where they were.
+static bool SameDirection(vec3 a, vec3 b, bool exact) {
+    if (exact) return memcmp(&a, &b, sizeof(vec3)) == 0;
+    return glm::dot(a, b) > 0.9999f;
+}
+
+/// Builds a ray of the given kind with a distinct value in every field.
+static FatRay MakeRay(FatRay::Kind kind, bool has_hit) {
+    FatRay ray(kind, 123, -45);
+    ray.bounces = 3;
+    ray.workers_touched = 7;
+    ray.slim.origin = vec3(1.5f, -2.25f, 3.125f);
+    ray.slim.direction = glm::normalize(vec3(0.3f, -0.5f, 0.8f));
+    ray.transmittance = 0.625f;
+    ray.emission = vec3(4.0f, 5.0f, 6.0f);
+    ray.target = vec3(-7.0f, 8.0f, -9.0f);
+    ray.traversal.current = 1234567;
+    ray.traversal.state = 2;
+    ray.traversal.hit = 1;
+    ray.current_worker = 5;
+    ray.visited = 0x8000000000000011ULL;
+
+    if (has_hit) {
+        ray.hit.worker = 3;
+        ray.hit.mesh = 42;
+        ray.hit.t = 17.5f;
+        ray.hit.geom.n = glm::normalize(vec3(-0.2f, 0.9f, 0.1f));
+        ray.hit.geom.t = vec2(0.25f, 0.75f);
+    }
+
+    return ray;
+}
+
+/// Round trips one ray and checks every field its kind puts on the wire.
+static void CheckRoundTrip(FatRay::Kind kind, bool has_hit) {
+    const char* context = has_hit ? "hit" : "no hit";
+    FatRay ray = MakeRay(kind, has_hit);
+
+    char buf[FR_RAY_CODEC_MAX_SIZE];
+    size_t size = EncodeRay(&ray, buf);
+    CHECK(size > 0 && size <= FR_RAY_CODEC_MAX_SIZE);
+
+#ifdef FR_RAY_CODEC_QUANTIZE
+    bool exact = false;
+#else
+    bool exact = true;
+#endif
+
+    FatRay out;
+    CHECK(DecodeRay(buf, size, &out) == size);
+
+    CHECK(out.kind == ray.kind);
+    CHECK(out.x == ray.x);
+    CHECK(out.y == ray.y);
+    CHECK(out.bounces == ray.bounces);
+    CHECK(out.workers_touched == ray.workers_touched);
+    CHECK(memcmp(&out.slim.origin, &ray.slim.origin, sizeof(vec3)) == 0);
+    CHECK(SameDirection(out.slim.direction, ray.slim.direction, exact));
+    CHECK(out.transmittance == ray.transmittance);
+    CHECK(out.next == nullptr);
+
+    // Illuminate rays never carry traversal state.
+    if (kind != FatRay::Kind::ILLUMINATE) {
+        CHECK(out.traversal.current == ray.traversal.current);
+        CHECK(out.traversal.state == ray.traversal.state);
+        CHECK(out.traversal.hit == ray.traversal.hit);
+        CHECK(out.current_worker == ray.current_worker);
+        CHECK(out.visited == ray.visited);
+    }
+
+    // Only light rays carry emission and a target.
+    if (kind == FatRay::Kind::LIGHT) {
+        CHECK(memcmp(&out.emission, &ray.emission, sizeof(vec3)) == 0);
+        CHECK(memcmp(&out.target, &ray.target, sizeof(vec3)) == 0);
+    }
+
+    if (has_hit) {
+        CHECK(out.hit.worker == ray.hit.worker);
+        CHECK(out.hit.mesh == ray.hit.mesh);
+        CHECK(out.hit.t == ray.hit.t);
+        CHECK(SameDirection(out.hit.geom.n, ray.hit.geom.n, exact));
+        CHECK(memcmp(&out.hit.geom.t, &ray.hit.geom.t, sizeof(vec2)) == 0);
+    } else {
+        CHECK(out.hit.worker == 0);
+    }
+
+    // Every truncation of the encoding has to be rejected.
+    for (size_t len = 0; len < size; len++) {
+        FatRay partial;
+        CHECK(DecodeRay(buf, len, &partial) == 0);
+    }
+
+    // So does an encoding from another codec version.
+    char other[FR_RAY_CODEC_MAX_SIZE];
+    memcpy(other, buf, size);
+    other[0] = FR_RAY_CODEC_VERSION + 1;
+    FatRay mismatched;
+    CHECK(DecodeRay(other, size, &mismatched) == 0);
+
+#ifndef FR_RAY_CODEC_QUANTIZE
+    // And a quantized encoding we don't know how to decode.
+    memcpy(other, buf, size);
+    other[2] |= 1 << 3;
+    CHECK(DecodeRay(other, size, &mismatched) == 0);
+#endif
+}
+
+int main(int argc, char *argv[]) {
+    FatRay::Kind kinds[] = {
+        FatRay::Kind::INTERSECT,
+        FatRay::Kind::ILLUMINATE,
+        FatRay::Kind::LIGHT
+    };
+
+    for (auto kind : kinds) {
+        CheckRoundTrip(kind, false);
+        CheckRoundTrip(kind, true);
+    }
+
+    // Rays that don't fit in the header's counters get clamped, not wrapped.
+    {
+        const char* context = "workers_touched";
+        FatRay ray = MakeRay(FatRay::Kind::INTERSECT, false);
+        ray.workers_touched = 100000;
+        char buf[FR_RAY_CODEC_MAX_SIZE];
+        FatRay out;
+        CHECK(DecodeRay(buf, EncodeRay(&ray, buf), &out) > 0);
+        CHECK(out.workers_touched == 65535);
+    }
+
+    if (failures > 0) {
+        cout << failures << " check(s) failed." << endl;
+        return EXIT_FAILURE;
+    }
+
+    cout << "All ray codec checks passed." << endl;
+    return EXIT_SUCCESS;
+}